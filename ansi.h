@@ -0,0 +1,136 @@
+#ifndef ANSI_H_
+#define ANSI_H_
+
+// Escape sequence stripping, for looking through recorded output as text. What is left is what a reader would call
+// the text: printable bytes, UTF-8 and line structure. CSI, OSC, DCS and the other string sequences, two-byte
+// escapes and every control byte besides '\n' and '\t' are dropped, so `ls --color` output reads like plain `ls`
+// and a line redrawn with '\r' reads as everything that was drawn on it.
+//
+// The stripper is streaming: a sequence split across two buffers is still dropped as a whole. A '\n' always comes
+// through, even in the middle of a sequence, so the stripped text has the lines of the raw bytes. With SSE2, runs of
+// plain text are copied 16 bytes at a time.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+enum AnsiState {
+  ANSI_TEXT,
+  ANSI_ESCAPE,         // After ESC, or ESC and intermediates.
+  ANSI_CSI,            // Parameters and intermediates up to the final byte.
+  ANSI_STRING,         // OSC, DCS, SOS, PM, APC payload up to BEL or ST.
+  ANSI_STRING_ESCAPE,  // ESC inside a string, ST if a '\\' follows.
+};
+
+struct AnsiStripper {
+  AnsiState state;
+};
+
+static inline void ansi_strip_init(AnsiStripper *a) {
+  a->state = ANSI_TEXT;
+}
+
+static inline bool ansi_is_text(uint8_t b) {
+  return (b >= 0x20 && b != 0x7f) || b == '\n' || b == '\t';
+}
+
+// Copies the plain text `in` starts with to `out`, in 16-byte blocks and up to the first byte that is not plain
+// text: a control byte but '\n' and '\t', or DEL. Returns its length. `out` may be `in` or behind it.
+static inline size_t ansi_copy_text(const char *in, size_t len, char *out) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i tab = _mm_set1_epi8('\t');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i printable = _mm_cmpeq_epi8(_mm_max_epu8(v, space), v);  // Unsigned >= 0x20.
+    __m128i ok = _mm_or_si128(_mm_or_si128(printable, _mm_cmpeq_epi8(v, newline)), _mm_cmpeq_epi8(v, tab));
+    ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del), ok);
+
+    unsigned special = ~_mm_movemask_epi8(ok) & 0xffff;
+    if (special != 0) {
+      size_t run = __builtin_ctz(special);
+      memmove(out + i, in + i, run);  // Not the whole block: in place, its tail is still to be read.
+      return i + run;
+    }
+    _mm_storeu_si128((__m128i *)(out + i), v);
+  }
+#else
+  (void)in;
+  (void)out;
+#endif
+  return i;
+}
+
+// Copies the text in `len` bytes of `in` to `out`, which may be `in`, and returns its length.
+static inline size_t ansi_strip(AnsiStripper *a, const char *in, size_t len, char *out) {
+  size_t n = 0;
+  AnsiState state = a->state;
+
+  for (size_t i = 0; i < len; i++) {
+    if (state == ANSI_TEXT) {
+      size_t run = ansi_copy_text(in + i, len - i, out + n);
+      n += run;
+      i += run;
+      if (i == len) break;
+    }
+
+    uint8_t b = (uint8_t)in[i];
+    if (b == '\n' && state != ANSI_TEXT) out[n++] = '\n';
+
+    switch (state) {
+      case ANSI_TEXT:
+        if (ansi_is_text(b)) {
+          out[n++] = (char)b;
+        } else if (b == 0x1b) {
+          state = ANSI_ESCAPE;
+        }
+        break;
+
+      case ANSI_ESCAPE:
+        if (b == '[') {
+          state = ANSI_CSI;
+        } else if (b == ']' || b == 'P' || b == 'X' || b == '^' || b == '_') {
+          state = ANSI_STRING;
+        } else if (b >= 0x30 && b <= 0x7e) {
+          state = ANSI_TEXT;
+        } else if (b == 0x18 || b == 0x1a) {  // CAN and SUB abort the sequence.
+          state = ANSI_TEXT;
+        }
+        break;  // Intermediates and other controls keep the sequence going.
+
+      case ANSI_CSI:
+        if (b >= 0x40 && b <= 0x7e) {
+          state = ANSI_TEXT;
+        } else if (b == 0x1b) {
+          state = ANSI_ESCAPE;
+        } else if (b == 0x18 || b == 0x1a) {
+          state = ANSI_TEXT;
+        }
+        break;
+
+      case ANSI_STRING:
+        if (b == 0x07 || b == 0x18 || b == 0x1a) {
+          state = ANSI_TEXT;
+        } else if (b == 0x1b) {
+          state = ANSI_STRING_ESCAPE;
+        }
+        break;
+
+      case ANSI_STRING_ESCAPE:
+        state = b == '\\' ? ANSI_TEXT : b == 0x1b ? ANSI_STRING_ESCAPE : ANSI_STRING;
+        break;
+    }
+  }
+
+  a->state = state;
+  return n;
+}
+
+#endif  // ANSI_H_
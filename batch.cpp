@@ -0,0 +1,315 @@
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "steal.h"
+#include "termy.h"
+
+#define READ_BUF_SIZE 65536
+#define DEBUG_BUF_SIZE 1024
+
+#define DBG(...) debug(__FILE__, __LINE__, __VA_ARGS__)
+
+#define FAIL_IF_WITH_CODE(exp, msg) \
+  if (exp) {                        \
+    perror(msg);                    \
+    exit(EXIT_FAILURE);             \
+  }
+
+#define FAIL_IF(exp, msg) \
+  if (exp) {              \
+    printf(msg);          \
+    printf("\n");         \
+    exit(EXIT_FAILURE);   \
+  }
+
+using namespace std;
+
+struct Job {
+  int index;
+  string command;
+};
+
+struct JobResult {
+  int status;  // Wait status, or -1 when the job could not start.
+  bool timed_out;
+  size_t bytes;
+  double seconds;
+};
+
+struct BatchConfig {
+  int workers;
+  const char *output_dir;
+  struct winsize ws;
+  int timeout_sec;  // 0 for none.
+};
+
+BatchConfig config;
+vector<JobResult> results;
+mutex print_lock;
+
+void debug(const char *file_name, int line_no, const char *msg, ...) {
+  int f = open("pty.log", O_CREAT | O_APPEND | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  FAIL_IF_WITH_CODE(f == -1, "Cannot open debug file");
+
+  int fmt_len;
+
+  va_list args;
+  va_start(args, msg);
+
+  char fmt_buf[DEBUG_BUF_SIZE];
+  const char *debug_fmt = "[\x1b[93m%s\x1b[39m:\x1b[96m%d\x1b[0m] %s\n";
+  fmt_len = snprintf(fmt_buf, DEBUG_BUF_SIZE, debug_fmt, file_name, line_no, msg);
+  FAIL_IF(fmt_len >= DEBUG_BUF_SIZE, "Debug fmt buffer overflow.");
+
+  char buf[DEBUG_BUF_SIZE];
+
+  int len = vsnprintf(buf, DEBUG_BUF_SIZE, fmt_buf, args);
+  FAIL_IF(len >= DEBUG_BUF_SIZE, "Debug buffer overflow.");
+
+  FAIL_IF_WITH_CODE(write(f, buf, strlen(buf)) == -1, "Cannot write to debug file");
+
+  va_end(args);
+
+  close(f);
+}
+
+// What `stty sane` gives a fresh terminal, minus echo: nobody types into a batch job.
+void synthetic_termios(struct termios *t) {
+  memset(t, 0, sizeof(*t));
+
+  t->c_iflag = ICRNL | IXON | IUTF8;
+  t->c_oflag = OPOST | ONLCR;
+  t->c_cflag = CS8 | CREAD | HUPCL;
+  t->c_lflag = ISIG | ICANON | IEXTEN | ECHOE | ECHOK;
+
+  t->c_cc[VINTR] = 0x03;
+  t->c_cc[VQUIT] = 0x1c;
+  t->c_cc[VERASE] = 0x7f;
+  t->c_cc[VKILL] = 0x15;
+  t->c_cc[VEOF] = 0x04;
+  t->c_cc[VSTART] = 0x11;
+  t->c_cc[VSTOP] = 0x13;
+  t->c_cc[VSUSP] = 0x1a;
+  t->c_cc[VMIN] = 1;
+  t->c_cc[VTIME] = 0;
+
+  cfsetispeed(t, B38400);
+  cfsetospeed(t, B38400);
+}
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, buf, len);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+
+    buf += written;
+    len -= written;
+  }
+
+  return true;
+}
+
+// Runs one command under a fresh PTY and copies everything it prints to its recording until the slave side is gone.
+JobResult run_job(const Job &job, const struct termios *tio, char *read_buf) {
+  JobResult result = {-1, false, 0, 0};
+  double started = now_seconds();
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/job-%d.out", config.output_dir, job.index);
+  int record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (record_fd == -1) {
+    DBG("Job %d: cannot open %s: %s.", job.index, path, strerror(errno));
+    return result;
+  }
+
+  // posix_spawn: no copy of this process per job, however many workers are mid-job.
+  const char *argv[] = {"sh", "-c", job.command.c_str(), nullptr};
+  termy::SpawnOptions options{};
+  options.argv = argv;
+  options.termios = tio;
+  options.winsize = config.ws;
+  termy::PtySession session;
+  termy::Error err = termy::PtySession::spawn(options, &session);
+  if (!err.ok()) {
+    DBG("Job %d: cannot spawn: %s: %s.", job.index, err.op, strerror(err.code));
+    close(record_fd);
+    return result;
+  }
+
+  double deadline = config.timeout_sec > 0 ? started + config.timeout_sec : 0;
+
+  for (;;) {
+    int wait_ms = -1;
+    if (deadline > 0) {
+      double left = deadline - now_seconds();
+      wait_ms = left > 0 ? (int)(left * 1000) + 1 : 0;
+    }
+
+    struct pollfd pfd = {session.fd(), POLLIN, 0};
+    int ready = poll(&pfd, 1, wait_ms);
+    if (ready == -1 && errno == EINTR) continue;
+
+    if (ready == 0) {
+      DBG("Job %d: timed out.", job.index);
+      result.timed_out = true;
+      session.signal(SIGKILL);  // The whole session, not only sh.
+      break;
+    }
+
+    termy::IoResult got = session.read(read_buf, READ_BUF_SIZE);
+    if (got.would_block) continue;
+    if (got.hangup || !got.error.ok()) break;  // Hangup once every slave fd is closed.
+
+    if (!write_all(record_fd, read_buf, got.bytes)) {
+      DBG("Job %d: cannot write recording: %s.", job.index, strerror(errno));
+      session.signal(SIGKILL);
+      break;
+    }
+    result.bytes += got.bytes;
+  }
+
+  pid_t child_pid = session.pid();
+  session.close();
+  close(record_fd);
+  if (!session.try_wait(&result.status)) waitpid(child_pid, &result.status, 0);
+  result.seconds = now_seconds() - started;
+  return result;
+}
+
+void report(const Job &job, const JobResult &r) {
+  lock_guard<mutex> guard(print_lock);
+
+  if (r.status == -1) {
+    printf("job %d: failed to start: %s\n", job.index, job.command.c_str());
+  } else if (r.timed_out) {
+    printf("job %d: timed out after %.2fs (%zu bytes): %s\n", job.index, r.seconds, r.bytes, job.command.c_str());
+  } else if (WIFEXITED(r.status)) {
+    printf("job %d: exit %d in %.2fs (%zu bytes): %s\n", job.index, WEXITSTATUS(r.status), r.seconds, r.bytes,
+           job.command.c_str());
+  } else {
+    printf("job %d: signal %d in %.2fs (%zu bytes): %s\n", job.index, WTERMSIG(r.status), r.seconds, r.bytes,
+           job.command.c_str());
+  }
+  fflush(stdout);
+}
+
+vector<Job> load_jobs(const char *path) {
+  FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  FAIL_IF_WITH_CODE(f == nullptr, "Error: cannot open job list");
+
+  // One command per line however long it is, a piece of one never runs as a job of its own.
+  vector<Job> jobs;
+  char *line = nullptr;
+  size_t line_cap = 0;
+  while (getline(&line, &line_cap, f) != -1) {
+    size_t len = strcspn(line, "\r\n");
+    line[len] = '\0';
+    if (len == 0 || line[0] == '#') continue;
+
+    jobs.push_back(Job{(int)jobs.size(), line});
+  }
+  FAIL_IF_WITH_CODE(ferror(f), "Error: cannot read job list");
+
+  free(line);
+  if (f != stdin) fclose(f);
+  return jobs;
+}
+
+void usage() {
+  printf("Usage: batch [-j workers] [-o output-dir] [-s COLSxROWS] [-t timeout-sec] <job-list | ->\n");
+  exit(EXIT_FAILURE);
+}
+
+// Headless: never touches the caller's terminal, so it runs the same from CI, cron or a pipe.
+int main(int argc, char **argv) {
+  config.workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  config.output_dir = "batch-output";
+  memset(&config.ws, 0, sizeof(config.ws));
+  config.ws.ws_col = 80;
+  config.ws.ws_row = 24;
+  config.timeout_sec = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:o:s:t:")) != -1) {
+    switch (opt) {
+      case 'j':
+        config.workers = atoi(optarg);
+        break;
+      case 'o':
+        config.output_dir = optarg;
+        break;
+      case 's': {
+        unsigned cols, rows;
+        if (sscanf(optarg, "%ux%u", &cols, &rows) != 2) usage();
+        config.ws.ws_col = cols;
+        config.ws.ws_row = rows;
+        break;
+      }
+      case 't':
+        config.timeout_sec = atoi(optarg);
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind >= argc || config.workers < 1) usage();
+
+  vector<Job> jobs = load_jobs(argv[optind]);
+  if (jobs.empty()) exit(EXIT_SUCCESS);
+  if ((size_t)config.workers > jobs.size()) config.workers = (int)jobs.size();
+
+  FAIL_IF_WITH_CODE(mkdir(config.output_dir, 0755) == -1 && errno != EEXIST, "Error: cannot create output dir");
+
+  struct termios tio;
+  synthetic_termios(&tio);
+
+  results.resize(jobs.size());
+  StealQueue<Job> queue(config.workers);
+  queue.push_all(jobs);
+
+  atomic<int> failed(0);
+  run_workers(config.workers, [&](int worker) {
+    vector<char> read_buf(READ_BUF_SIZE);
+    Job job;
+    while (queue.pop(worker, &job)) {
+      JobResult r = run_job(job, &tio, read_buf.data());
+      results[job.index] = r;
+      if (r.status == -1 || r.timed_out || !WIFEXITED(r.status) || WEXITSTATUS(r.status) != 0) failed++;
+      report(job, r);
+    }
+  });
+
+  printf("%zu jobs, %d failed, recordings in %s/\n", jobs.size(), failed.load(), config.output_dir);
+  exit(failed.load() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,159 @@
+#ifndef COLLAPSE_H_
+#define COLLAPSE_H_
+
+// Redraw collapsing for the recording sink. Progress bars and spinners redraw one line over and over with '\r', and
+// a CI job's recording can be mostly those redraws. With collapsing on, a line only keeps the state it was first
+// drawn in and the state it ended in; the redraws in between are dropped and an APC sequence takes their place,
+// `ESC _ termy-collapsed redraws=N ms=M ESC \`, which terminals and `scriptreplay` ignore and search.h strips.
+// What the terminal sees is not touched, only the recording.
+//
+// A redrawn line is held back from its first bare '\r' (one not followed by '\n') until it ends with '\n'. When
+// a dropped state was longer than the final one, the longest of them is kept in front of the final one, so the
+// remnants an unerased longer state leaves on the screen stay in the recording. A line that stops redrawing for
+// COLLAPSE_IDLE_SECS goes back to being written straight through: shells redraw their prompt with '\r' too, and
+// typing into it should keep its timing.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#define COLLAPSE_ENV "TERMY_COLLAPSE"
+#define COLLAPSE_IDLE_SECS 0.5
+#define COLLAPSE_HOLD_MAX 65536  // A single redraw longer than this is written through, it is no progress bar.
+#define COLLAPSE_SUMMARY_MAX 64
+
+struct Collapser {
+  bool enabled;
+
+  bool cr_pending;  // The last byte was a '\r', whether it was bare depends on the next one.
+  bool redrawing;   // The current line had a bare '\r', `held` is its latest state.
+  std::string held;
+  std::string longest;  // The longest dropped state.
+  size_t redraws;
+  double first_redraw;
+  double last_redraw;
+
+  std::string out;
+};
+
+// Enabled by $TERMY_COLLAPSE=1.
+static inline void collapse_init(Collapser *c) {
+  const char *v = getenv(COLLAPSE_ENV);
+  c->enabled = v != nullptr && atoi(v) != 0;
+  c->cr_pending = false;
+  c->redrawing = false;
+  c->redraws = 0;
+}
+
+// Writes what the held line collapsed to and goes back to writing through.
+static inline void collapse_release(Collapser *c) {
+  if (c->redraws > 0) {
+    if (c->longest.size() > c->held.size()) c->out += c->longest;
+
+    char summary[COLLAPSE_SUMMARY_MAX];
+    int len = snprintf(summary, sizeof(summary), "\x1b_termy-collapsed redraws=%zu ms=%.0f\x1b\\", c->redraws,
+                       (c->last_redraw - c->first_redraw) * 1e3);
+    c->out.append(summary, len);
+  }
+  c->out += c->held;
+
+  c->held.clear();
+  c->longest.clear();
+  c->redrawing = false;
+  c->redraws = 0;
+}
+
+// The byte after a '\r' decides: a '\n' ends the line, anything else starts a redraw.
+static inline void collapse_after_cr(Collapser *c, uint8_t b, double now) {
+  c->cr_pending = false;
+  if (b == '\n') {
+    if (c->redrawing) {
+      c->held += '\r';
+      collapse_release(c);
+    } else {
+      c->out += '\r';
+    }
+    return;
+  }
+
+  if (!c->redrawing) {
+    c->redrawing = true;
+    c->first_redraw = now;
+  } else {
+    if (c->held.size() > c->longest.size()) c->longest.swap(c->held);
+    c->redraws++;
+  }
+  c->held.assign(1, '\r');
+  c->last_redraw = now;
+}
+
+// Feeds the next chunk of (redacted) output. Returns how many bytes to record are ready at `*out`, valid until the
+// next call. Passes everything straight through when disabled.
+static inline size_t collapse_feed(Collapser *c, const char *chunk, size_t len, double now, const char **out) {
+  if (!c->enabled) {
+    *out = chunk;
+    return len;
+  }
+
+  c->out.clear();
+  if (c->redrawing && !c->cr_pending && now - c->last_redraw >= COLLAPSE_IDLE_SECS) collapse_release(c);
+
+  const char *p = chunk;
+  const char *end = chunk + len;
+  while (p < end) {
+    if (c->cr_pending) collapse_after_cr(c, (uint8_t)*p, now);
+
+    if (!c->redrawing) {
+      // Written through up to the next '\r'.
+      const char *cr = (const char *)memchr(p, '\r', end - p);
+      const char *stop = cr != nullptr ? cr : end;
+      c->out.append(p, stop - p);
+      if (cr == nullptr) break;
+      c->cr_pending = true;
+      p = cr + 1;
+      continue;
+    }
+
+    const char *q = p;
+    while (q < end && *q != '\r' && *q != '\n') q++;
+    c->held.append(p, q - p);
+    p = q;
+    if (p == end) break;
+
+    if (*p == '\r') {
+      c->cr_pending = true;
+    } else {
+      collapse_release(c);
+      c->out += '\n';
+    }
+    p++;
+
+    if (c->held.size() > COLLAPSE_HOLD_MAX) collapse_release(c);
+  }
+
+  if (c->held.size() > COLLAPSE_HOLD_MAX) collapse_release(c);
+  *out = c->out.data();
+  return c->out.size();
+}
+
+// Releases a held line at the end of the stream.
+static inline size_t collapse_finish(Collapser *c, const char **out) {
+  c->out.clear();
+  if (c->cr_pending) {
+    if (c->redrawing) {
+      c->held += '\r';
+    } else {
+      c->out += '\r';
+    }
+    c->cr_pending = false;
+  }
+  if (c->redrawing) collapse_release(c);
+  *out = c->out.data();
+  return c->out.size();
+}
+
+#endif  // COLLAPSE_H_
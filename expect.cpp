@@ -0,0 +1,488 @@
+#include "expect.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <algorithm>
+
+// Each DFA state carries a full 256-entry table, so this caps the cache at a few MB. Pathological pattern sets that
+// keep producing new states just rebuild what the current input needs.
+#define MAX_DFA_STATES 4096
+#define EXPECT_READ_BUF_SIZE 4096
+
+namespace termy {
+
+// Recursive descent over the regex subset, emitting Thompson fragments straight into the NFA.
+class Expect::Parser {
+ public:
+  Parser(Expect *ex, const std::string &src) : ex_(ex), src_(src), pos_(0) {}
+
+  bool parse(Frag *out) {
+    return alternation(out) && pos_ == src_.size();
+  }
+
+ private:
+  bool at_end() const {
+    return pos_ >= src_.size();
+  }
+
+  char peek() const {
+    return src_[pos_];
+  }
+
+  Frag epsilon() {
+    int s = ex_->add_state(NfaState::kSplit);
+    return Frag{s, {{s, 0}}};
+  }
+
+  Frag bytes(const std::bitset<256> &set) {
+    int s = ex_->add_state(NfaState::kBytes);
+    ex_->nfa_[s].bytes = set;
+    return Frag{s, {{s, 0}}};
+  }
+
+  bool alternation(Frag *out) {
+    if (!concatenation(out)) return false;
+
+    while (!at_end() && peek() == '|') {
+      pos_++;
+      Frag rhs;
+      if (!concatenation(&rhs)) return false;
+
+      int s = ex_->add_state(NfaState::kSplit);
+      ex_->nfa_[s].out = out->start;
+      ex_->nfa_[s].out1 = rhs.start;
+      out->start = s;
+      out->outs.insert(out->outs.end(), rhs.outs.begin(), rhs.outs.end());
+    }
+
+    return true;
+  }
+
+  bool concatenation(Frag *out) {
+    bool empty = true;
+
+    while (!at_end() && peek() != '|' && peek() != ')') {
+      Frag next;
+      if (!repetition(&next)) return false;
+
+      if (empty) {
+        *out = next;
+        empty = false;
+      } else {
+        ex_->patch(*out, next.start);
+        out->outs = next.outs;
+      }
+    }
+
+    if (empty) *out = epsilon();
+    return true;
+  }
+
+  bool repetition(Frag *out) {
+    if (!atom(out)) return false;
+
+    while (!at_end() && (peek() == '*' || peek() == '+' || peek() == '?')) {
+      char op = src_[pos_++];
+      int s = ex_->add_state(NfaState::kSplit);
+      ex_->nfa_[s].out = out->start;
+
+      if (op == '*') {
+        ex_->patch(*out, s);
+        *out = Frag{s, {{s, 1}}};
+      } else if (op == '+') {
+        ex_->patch(*out, s);
+        out->outs = {{s, 1}};
+      } else {
+        out->start = s;
+        out->outs.push_back({s, 1});
+      }
+    }
+
+    return true;
+  }
+
+  bool atom(Frag *out) {
+    char c = src_[pos_++];
+    std::bitset<256> set;
+
+    switch (c) {
+      case '(':
+        if (!alternation(out) || at_end() || peek() != ')') return false;
+        pos_++;
+        return true;
+      case '[':
+        if (!char_class(&set)) return false;
+        break;
+      case '.':
+        set.set();
+        set.reset('\n');
+        break;
+      case '\\':
+        if (!escape(&set, nullptr)) return false;
+        break;
+      case '*':
+      case '+':
+      case '?':
+      case ')':
+        return false;
+      default:
+        set.set((uint8_t)c);
+    }
+
+    *out = bytes(set);
+    return true;
+  }
+
+  // Adds the escape's bytes to `set`. Sets `single` to the byte when it stands for exactly one, so it can start or end
+  // a range.
+  bool escape(std::bitset<256> *set, int *single) {
+    if (at_end()) return false;
+    char c = src_[pos_++];
+    int byte = -1;
+    std::bitset<256> escaped;  // Negated on its own, `[a\D]` still has the `a`.
+
+    switch (c) {
+      case 'd':
+      case 'D':
+        for (int b = '0'; b <= '9'; b++) escaped.set(b);
+        break;
+      case 'w':
+      case 'W':
+        for (int b = 0; b < 256; b++) {
+          if ((b >= '0' && b <= '9') || (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z') || b == '_') escaped.set(b);
+        }
+        break;
+      case 's':
+      case 'S':
+        for (const char *b = " \t\n\r\f\v"; *b != '\0'; b++) escaped.set((uint8_t)*b);
+        break;
+      case 'n':
+        byte = '\n';
+        break;
+      case 'r':
+        byte = '\r';
+        break;
+      case 't':
+        byte = '\t';
+        break;
+      case 'f':
+        byte = '\f';
+        break;
+      case 'v':
+        byte = '\v';
+        break;
+      case 'x': {
+        if (pos_ + 2 > src_.size()) return false;
+        byte = 0;
+        for (int i = 0; i < 2; i++) {
+          char h = src_[pos_++];
+          int v;
+          if (h >= '0' && h <= '9') {
+            v = h - '0';
+          } else if (h >= 'a' && h <= 'f') {
+            v = h - 'a' + 10;
+          } else if (h >= 'A' && h <= 'F') {
+            v = h - 'A' + 10;
+          } else {
+            return false;
+          }
+          byte = byte * 16 + v;
+        }
+        break;
+      }
+      default:
+        byte = (uint8_t)c;
+    }
+
+    if (c == 'D' || c == 'W' || c == 'S') escaped.flip();
+    if (byte != -1) escaped.set(byte);
+    *set |= escaped;
+    if (single != nullptr) *single = byte;
+    return true;
+  }
+
+  bool char_class(std::bitset<256> *set) {
+    bool negate = !at_end() && peek() == '^';
+    if (negate) pos_++;
+
+    bool first = true;
+    while (!at_end() && (peek() != ']' || first)) {
+      first = false;
+      int lo;
+      char c = src_[pos_++];
+      if (c == '\\') {
+        if (!escape(set, &lo)) return false;
+        if (lo == -1) continue;
+      } else {
+        lo = (uint8_t)c;
+        set->set(lo);
+      }
+
+      // A '-' right before ']' is literal.
+      if (pos_ + 1 < src_.size() && peek() == '-' && src_[pos_ + 1] != ']') {
+        pos_++;
+        int hi;
+        char h = src_[pos_++];
+        if (h == '\\') {
+          std::bitset<256> ignored;
+          if (!escape(&ignored, &hi) || hi == -1) return false;
+        } else {
+          hi = (uint8_t)h;
+        }
+        if (hi < lo) return false;
+        for (int b = lo; b <= hi; b++) set->set(b);
+      }
+    }
+
+    if (at_end()) return false;  // Unterminated.
+    pos_++;
+
+    if (negate) set->flip();
+    return true;
+  }
+
+  Expect *ex_;
+  const std::string &src_;
+  size_t pos_;
+};
+
+Expect::Expect() : mark_gen_(0), start_(-1), current_(-1), offset_(0) {}
+
+int Expect::add_state(NfaState::Kind kind) {
+  nfa_.push_back(NfaState{kind, {}, -1, -1, -1});
+  return (int)nfa_.size() - 1;
+}
+
+void Expect::patch(const Frag &frag, int target) {
+  for (const std::pair<int, int> &dangling : frag.outs) {
+    NfaState &s = nfa_[dangling.first];
+    (dangling.second == 0 ? s.out : s.out1) = target;
+  }
+}
+
+void Expect::add_pattern(const Frag &frag) {
+  int m = add_state(NfaState::kMatch);
+  nfa_[m].pattern = (int)pattern_starts_.size();
+  patch(frag, m);
+  pattern_starts_.push_back(frag.start);
+
+  flush_cache();
+  current_ = -1;
+}
+
+int Expect::add_literal(const std::string &literal) {
+  int start = -1;
+  int prev = -1;
+
+  for (char c : literal) {
+    int s = add_state(NfaState::kBytes);
+    nfa_[s].bytes.set((uint8_t)c);
+    if (prev == -1) {
+      start = s;
+    } else {
+      nfa_[prev].out = s;
+    }
+    prev = s;
+  }
+
+  Frag frag;
+  if (prev == -1) {
+    start = prev = add_state(NfaState::kSplit);
+  }
+  frag.start = start;
+  frag.outs = {{prev, 0}};
+
+  int id = (int)pattern_starts_.size();
+  add_pattern(frag);
+  return id;
+}
+
+Error Expect::add_regex(const std::string &regex, int *id) {
+  size_t nfa_size = nfa_.size();
+  Frag frag;
+  Parser parser(this, regex);
+
+  if (!parser.parse(&frag)) {
+    nfa_.resize(nfa_size);
+    return Error{EINVAL, "regex syntax"};
+  }
+
+  *id = (int)pattern_starts_.size();
+  add_pattern(frag);
+  return Error{0, nullptr};
+}
+
+// Follows splits from `from`, keeping only the states that matter for the next step: byte tests and matches.
+void Expect::closure(const std::vector<int> &from, std::vector<int> *into) {
+  if (mark_.size() < nfa_.size()) mark_.resize(nfa_.size(), 0);
+  if (++mark_gen_ == 0) {
+    std::fill(mark_.begin(), mark_.end(), 0);
+    mark_gen_ = 1;
+  }
+
+  std::vector<int> stack(from);
+  while (!stack.empty()) {
+    int s = stack.back();
+    stack.pop_back();
+    if (s == -1 || mark_[s] == mark_gen_) continue;
+    mark_[s] = mark_gen_;
+
+    const NfaState &state = nfa_[s];
+    if (state.kind == NfaState::kSplit) {
+      stack.push_back(state.out1);
+      stack.push_back(state.out);
+    } else {
+      into->push_back(s);
+    }
+  }
+}
+
+int Expect::dfa_state_for(std::vector<int> nfa) {
+  std::sort(nfa.begin(), nfa.end());
+
+  auto found = dstate_index_.find(nfa);
+  if (found != dstate_index_.end()) return found->second;
+
+  DfaState d;
+  std::fill(d.next, d.next + 256, -1);
+  d.match = -1;
+  for (const std::vector<int> *set : {&nfa, &start_nfa_}) {
+    for (int s : *set) {
+      if (nfa_[s].kind == NfaState::kMatch && (d.match == -1 || nfa_[s].pattern < d.match)) d.match = nfa_[s].pattern;
+    }
+  }
+  d.nfa = nfa;
+
+  int id = (int)dstates_.size();
+  dstates_.push_back(std::move(d));
+  dstate_index_.emplace(std::move(nfa), id);
+  return id;
+}
+
+int Expect::start_state() {
+  if (start_ == -1) {
+    start_nfa_.clear();
+    closure(pattern_starts_, &start_nfa_);
+    in_start_.assign(nfa_.size(), 0);
+    for (int s : start_nfa_) in_start_[s] = 1;
+    start_ = dfa_state_for(std::vector<int>());
+  }
+  return start_;
+}
+
+// Computes a missing transition. Every state implicitly holds every pattern start, which is what makes the search
+// unanchored: literals end up in the same shape as an Aho-Corasick automaton, built only as far as the output goes.
+// The starts are left out of the stored sets, so those grow with the patterns in progress, not with all of them.
+int Expect::step(int dstate, uint8_t b) {
+  std::vector<int> moved;
+  for (const std::vector<int> *set : {&dstates_[dstate].nfa, &start_nfa_}) {
+    for (int s : *set) {
+      const NfaState &state = nfa_[s];
+      if (state.kind == NfaState::kBytes && state.bytes[b]) moved.push_back(state.out);
+    }
+  }
+
+  std::vector<int> reached;
+  closure(moved, &reached);
+  std::vector<int> nfa;
+  for (int s : reached) {
+    if (!in_start_[s]) nfa.push_back(s);
+  }
+
+  if (dstates_.size() >= MAX_DFA_STATES) {
+    flush_cache();
+    return dfa_state_for(std::move(nfa));
+  }
+
+  int next = dfa_state_for(std::move(nfa));
+  dstates_[dstate].next[b] = next;
+  return next;
+}
+
+void Expect::flush_cache() {
+  dstates_.clear();
+  dstate_index_.clear();
+  start_ = -1;
+}
+
+bool Expect::feed(const char *buf, size_t len, ExpectMatch *match) {
+  int d = current_ != -1 ? current_ : start_state();
+
+  for (size_t i = 0; i < len; i++) {
+    uint8_t b = (uint8_t)buf[i];
+    int next = dstates_[d].next[b];
+    if (next == -1) next = step(d, b);
+    d = next;
+
+    if (dstates_[d].match != -1) {
+      match->pattern = dstates_[d].match;
+      match->end = offset_ + i + 1;
+      match->consumed = i + 1;
+      offset_ += i + 1;
+      current_ = start_state();
+      return true;
+    }
+  }
+
+  offset_ += len;
+  current_ = d;
+  return false;
+}
+
+void Expect::reset() {
+  current_ = -1;
+  unread_.clear();
+}
+
+namespace {
+
+int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+}  // namespace
+
+Error expect(PtySession *session, Expect *ex, int timeout_ms, ExpectMatch *match, std::string *transcript) {
+  // Output that arrived with the previous match comes first.
+  if (!ex->unread_.empty()) {
+    std::string pending;
+    pending.swap(ex->unread_);
+    if (ex->feed(pending.data(), pending.size(), match)) {
+      ex->unread_.assign(pending, match->consumed, std::string::npos);
+      return Error{0, nullptr};
+    }
+  }
+
+  int64_t deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : -1;
+  char buf[EXPECT_READ_BUF_SIZE];
+
+  for (;;) {
+    IoResult got = session->read(buf, sizeof(buf));
+    if (!got.error.ok()) return got.error;
+    if (got.hangup) return Error{EPIPE, "expect"};
+
+    if (got.bytes > 0) {
+      if (transcript != nullptr) transcript->append(buf, got.bytes);
+      if (ex->feed(buf, got.bytes, match)) {
+        ex->unread_.assign(buf + match->consumed, got.bytes - match->consumed);
+        return Error{0, nullptr};
+      }
+      continue;
+    }
+
+    int wait_ms = -1;
+    if (deadline != -1) {
+      wait_ms = (int)std::max<int64_t>(deadline - now_ms(), 0);
+      if (wait_ms == 0) return Error{ETIMEDOUT, "expect"};
+    }
+
+    struct pollfd pfd = {session->fd(), POLLIN, 0};
+    if (poll(&pfd, 1, wait_ms) == -1 && errno != EINTR) return Error{errno, "poll"};
+  }
+}
+
+}  // namespace termy
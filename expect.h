@@ -0,0 +1,102 @@
+#ifndef EXPECT_H_
+#define EXPECT_H_
+
+// Streaming expect for libtermy. Any number of literal and regex patterns are compiled into one NFA and searched with
+// a lazily built DFA: every byte of output costs one table lookup once its transition has been seen, no matter how
+// many patterns there are, and matches are found across read() boundaries without keeping the output around.
+//
+// Regex syntax is a byte-oriented subset: literals, `.`, `[a-z]`/`[^...]` classes, `\d \w \s \D \W \S`,
+// `\n \r \t \xHH`, escaped metacharacters, `( )`, `|`, `* + ?`. No anchors and no counted repetition: the stream has
+// no beginning worth anchoring to.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bitset>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "termy.h"
+
+namespace termy {
+
+struct ExpectMatch {
+  int pattern;      // Id returned by add_literal/add_regex.
+  uint64_t end;     // Stream offset just past the match.
+  size_t consumed;  // Bytes of the fed chunk up to and including the match.
+};
+
+class Expect {
+ public:
+  Expect();
+
+  // Adding a pattern forgets partial matches and the DFA built so far.
+  int add_literal(const std::string &literal);
+  Error add_regex(const std::string &regex, int *id);
+
+  // Feeds the next chunk of output. Stops at the first match, with `match->consumed` telling how much of `buf` was
+  // used; feed the rest again to keep going. The search restarts after each match, like expect forgetting its buffer.
+  bool feed(const char *buf, size_t len, ExpectMatch *match);
+
+  // Forgets partial matches, for example after sending input that makes earlier output irrelevant.
+  void reset();
+
+  size_t dfa_states() const {
+    return dstates_.size();
+  }
+
+ private:
+  struct NfaState {
+    enum Kind { kBytes, kSplit, kMatch } kind;
+    std::bitset<256> bytes;
+    int out;
+    int out1;  // Second branch of a split, -1 when unused.
+    int pattern;
+  };
+
+  struct DfaState {
+    int next[256];  // -1 until computed.
+    int match;      // Lowest matching pattern id, -1 for none.
+    std::vector<int> nfa;  // Beyond the pattern starts.
+  };
+
+  struct Frag {
+    int start;
+    std::vector<std::pair<int, int>> outs;  // (state, 0 for out / 1 for out1) left dangling.
+  };
+
+  class Parser;
+
+  int add_state(NfaState::Kind kind);
+  void patch(const Frag &frag, int target);
+  void add_pattern(const Frag &frag);
+  void closure(const std::vector<int> &from, std::vector<int> *into);
+  int dfa_state_for(std::vector<int> nfa);
+  int start_state();
+  int step(int dstate, uint8_t b);
+  void flush_cache();
+
+  friend Error expect(PtySession *session, Expect *ex, int timeout_ms, ExpectMatch *match, std::string *transcript);
+
+  std::vector<NfaState> nfa_;
+  std::vector<int> pattern_starts_;
+  std::vector<DfaState> dstates_;
+  std::map<std::vector<int>, int> dstate_index_;
+  std::vector<int> start_nfa_;     // Closure of the pattern starts, implied in every DFA state and kept out of `nfa`.
+  std::vector<uint8_t> in_start_;  // Per NFA state, whether it is in `start_nfa_`.
+  std::vector<uint32_t> mark_;
+  uint32_t mark_gen_;
+  int start_;    // DFA state with nothing matched so far, -1 when it needs building.
+  int current_;  // -1 maps to start.
+  uint64_t offset_;
+  std::string unread_;  // Read by expect() past the last match, fed first next time.
+};
+
+// Reads from `session` into `ex` until a pattern matches, the child hangs up or `timeout_ms` passes (-1 waits
+// forever). Everything read is appended to `transcript` when it is not null.
+Error expect(PtySession *session, Expect *ex, int timeout_ms, ExpectMatch *match, std::string *transcript);
+
+}  // namespace termy
+
+#endif  // EXPECT_H_
@@ -0,0 +1,440 @@
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "screen.h"
+#include "search.h"
+#include "steal.h"
+
+#define EXPORT_PIECE_BYTES (8u << 20)     // Emulated speculatively on one core.
+#define EXPORT_KEYFRAME_BYTES (64u << 10)  // Distance between the keyframes a piece records.
+#define EXPORT_DEFAULT_COLS 80
+#define EXPORT_DEFAULT_ROWS 24
+
+#define FAIL_IF_WITH_CODE(exp, msg) \
+  if (exp) {                        \
+    perror(msg);                    \
+    exit(EXIT_FAILURE);             \
+  }
+
+#define FAIL_IF(exp, msg) \
+  if (exp) {              \
+    printf(msg);          \
+    printf("\n");         \
+    exit(EXIT_FAILURE);   \
+  }
+
+using namespace std;
+
+// Renders recordings as a transcript: every row that scrolls off the top of the screen, then the screen at the end,
+// as plain text or HTML.
+//
+// Emulation is serial by nature, every byte depends on the screen the bytes before it left. Typescripts carry no
+// keyframes to restart from, so the exporter makes its own: the recording is cut into EXPORT_PIECE_BYTES pieces at
+// line ends and every piece is emulated on its own core from a blank screen, recording a keyframe (a hash of the
+// whole emulator state and how many rows had scrolled off) every EXPORT_KEYFRAME_BYTES. The stitch, in order, runs a
+// piece again from the real end state of the one before, only until the state matches one of the piece's keyframes:
+// from there on both runs are the same emulation and the speculative rows are used as they are. Output that scrolls
+// converges within a screenful, so the serial part is a few kilobytes per piece. A piece that never converges, a
+// full-screen program keeping a static frame say, is simply emulated twice.
+
+enum ExportFormat { EXPORT_TEXT, EXPORT_HTML };
+
+struct Keyframe {
+  size_t offset;  // Into the piece.
+  size_t rows;    // Rows scrolled off by then.
+  uint64_t hash;
+};
+
+struct Recording {
+  string path;
+  const char *data;
+  size_t size;
+  size_t data_start;  // After the header line.
+};
+
+struct Piece {
+  size_t recording;
+  size_t start;
+  size_t end;
+
+  bool done;
+  vector<string> rows;
+  vector<Keyframe> keyframes;
+  Screen end_state;
+};
+
+struct ExportConfig {
+  ExportFormat format;
+  int rows;
+  int cols;
+  int workers;
+};
+
+ExportConfig config;
+vector<Recording> recordings;
+vector<Piece> pieces;
+mutex stitch_lock;
+size_t next_stitch;
+Screen truth;  // The real state at the start of piece `next_stitch`.
+size_t total_rows;
+uint64_t restitched_bytes;  // Emulated a second time to reach a keyframe.
+
+uint32_t palette_rgb(uint32_t index) {
+  static const uint32_t base[16] = {0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+                                    0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff};
+  static const uint32_t steps[6] = {0, 95, 135, 175, 215, 255};
+  if (index < 16) return base[index];
+  if (index < 232) {
+    index -= 16;
+    return steps[index / 36] << 16 | steps[index / 6 % 6] << 8 | steps[index % 6];
+  }
+  uint32_t gray = 8 + (index - 232) * 10;
+  return gray << 16 | gray << 8 | gray;
+}
+
+// CSS colour for `color`, empty for the default.
+string css_color(uint32_t color) {
+  if (COLOR_KIND(color) == COLOR_DEFAULT) return string();
+  uint32_t rgb = COLOR_KIND(color) == COLOR_PALETTE ? palette_rgb(color & 0xff) : color & 0xffffff;
+  char buf[8];
+  snprintf(buf, sizeof(buf), "#%06x", rgb);
+  return buf;
+}
+
+void append_html_open(const Style &st, string *out) {
+  string fg = css_color(st.fg);
+  string bg = css_color(st.bg);
+  if (st.attrs & ATTR_REVERSE) {
+    fg.swap(bg);
+    if (fg.empty()) fg = "var(--bg)";
+    if (bg.empty()) bg = "var(--fg)";
+  }
+
+  out->append("<span style=\"");
+  if (!fg.empty()) out->append("color:" + fg + ";");
+  if (!bg.empty()) out->append("background:" + bg + ";");
+  if (st.attrs & ATTR_BOLD) out->append("font-weight:bold;");
+  if (st.attrs & ATTR_DIM) out->append("opacity:.6;");
+  if (st.attrs & ATTR_ITALIC) out->append("font-style:italic;");
+  if (st.attrs & ATTR_UNDERLINE) out->append("text-decoration:underline;");
+  out->append("\">");
+}
+
+void append_html_char(uint32_t cp, string *out) {
+  switch (cp) {
+    case '&':
+      out->append("&amp;");
+      break;
+    case '<':
+      out->append("&lt;");
+      break;
+    case '>':
+      out->append("&gt;");
+      break;
+    default:
+      screen_append_utf8(out, cp);
+  }
+}
+
+void render_row(const Screen *s, int row, string *out) {
+  const Cell *line = screen_row(s, row);
+
+  // Trailing blanks go, unless a background colour makes them visible.
+  int width = s->cols;
+  while (width > 0 && (line[width - 1].cp == 0 || line[width - 1].cp == ' ') &&
+         (config.format == EXPORT_TEXT || s->styles.styles[line[width - 1].style].bg == COLOR_DEFAULT)) {
+    width--;
+  }
+
+  if (config.format == EXPORT_TEXT) {
+    for (int c = 0; c < width; c++) screen_append_utf8(out, line[c].cp);
+    out->push_back('\n');
+    return;
+  }
+
+  uint16_t open = STYLE_DEFAULT;
+  for (int c = 0; c < width; c++) {
+    if (line[c].style != open) {
+      if (open != STYLE_DEFAULT) out->append("</span>");
+      const Style &st = s->styles.styles[line[c].style];
+      open = style_equal(st, Style{}) ? STYLE_DEFAULT : line[c].style;
+      if (open != STYLE_DEFAULT) append_html_open(st, out);
+    }
+    append_html_char(line[c].cp, out);
+  }
+  if (open != STYLE_DEFAULT) out->append("</span>");
+  out->push_back('\n');
+}
+
+void collect_row(void *ctx, const Screen *s, int row) {
+  vector<string> *rows = (vector<string> *)ctx;
+  rows->emplace_back();
+  render_row(s, row, &rows->back());
+}
+
+static inline uint64_t mix(uint64_t h, uint64_t v) {
+  h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+  return h;
+}
+
+uint64_t hash_style(uint64_t h, const Screen *s, const Style &st) {
+  h = mix(h, (uint64_t)st.fg << 32 | st.bg);
+  h = mix(h, st.attrs);
+  if (st.link != 0) h = mix(h, hash<string>()(s->styles.links[st.link]));
+  return h;
+}
+
+uint64_t hash_cells(uint64_t h, const Screen *s, const vector<Cell> &cells) {
+  uint16_t last_style = STYLE_DEFAULT;
+  uint64_t style_hash = hash_style(0, s, s->styles.styles[STYLE_DEFAULT]);
+  for (const Cell &c : cells) {
+    if (c.style != last_style) {  // Style indices differ between runs, what they stand for does not.
+      last_style = c.style;
+      style_hash = hash_style(0, s, s->styles.styles[c.style]);
+    }
+    h = mix(h, c.cp);
+    h = mix(h, style_hash);
+  }
+  return h;
+}
+
+// Everything the rest of the stream could depend on. Equal hashes, equal futures.
+uint64_t state_hash(const Screen *s) {
+  uint64_t h = 0;
+  h = hash_cells(h, s, s->cells);
+  h = hash_cells(h, s, s->alt_saved);
+  h = mix(h, (uint64_t)s->cur_row << 32 | (uint32_t)s->cur_col);
+  h = mix(h, (uint64_t)s->saved_row << 32 | (uint32_t)s->saved_col);
+  h = mix(h, (uint64_t)s->scroll_top << 32 | (uint32_t)s->scroll_bottom);
+  h = mix(h, s->wrap_pending | s->cursor_visible << 1 | s->autowrap << 2 | s->alt_active << 3);
+  h = hash_style(h, s, s->pen);
+  h = hash_style(h, s, s->saved_pen);
+
+  h = mix(h, s->state);
+  if (s->state != PARSER_GROUND) {
+    h = mix(h, (uint64_t)s->n_params << 16 | (uint8_t)s->private_marker << 8 | (uint8_t)s->intermediate);
+    for (int i = 0; i < s->n_params; i++) h = mix(h, s->params[i]);
+    h = mix(h, s->string_is_osc);
+    h = mix(h, hash<string>()(s->osc));
+  }
+  h = mix(h, (uint64_t)s->utf8.need << 32 | s->utf8.cp);
+  return h;
+}
+
+// The speculative run, on a worker.
+void emulate_piece(Piece *piece) {
+  const Recording &rec = recordings[piece->recording];
+
+  Screen s;
+  screen_init(&s, config.rows, config.cols);
+  s.scroll_off = collect_row;
+  s.scroll_off_ctx = &piece->rows;
+
+  for (size_t off = piece->start;;) {
+    piece->keyframes.push_back(Keyframe{off - piece->start, piece->rows.size(), state_hash(&s)});
+    if (off == piece->end) break;
+    size_t len = piece->end - off < EXPORT_KEYFRAME_BYTES ? piece->end - off : EXPORT_KEYFRAME_BYTES;
+    screen_feed(&s, rec.data + off, len);
+    off += len;
+  }
+
+  s.scroll_off = nullptr;
+  piece->end_state = move(s);
+}
+
+// Runs `piece` from the real state until it meets the speculative run, and writes its rows. Under `stitch_lock`.
+void stitch_piece(Piece *piece) {
+  const Recording &rec = recordings[piece->recording];
+  vector<string> rows;
+  truth.scroll_off = collect_row;
+  truth.scroll_off_ctx = &rows;
+
+  bool converged = false;
+  size_t from_row = 0;
+  size_t off = piece->start;
+  for (const Keyframe &k : piece->keyframes) {
+    screen_feed(&truth, rec.data + off, piece->start + k.offset - off);
+    off = piece->start + k.offset;
+    if (state_hash(&truth) == k.hash) {
+      restitched_bytes += k.offset;
+      converged = true;
+      from_row = k.rows;
+      break;
+    }
+  }
+
+  for (const string &row : rows) fwrite(row.data(), 1, row.size(), stdout);
+  total_rows += rows.size();
+  if (converged) {
+    for (size_t i = from_row; i < piece->rows.size(); i++) {
+      fwrite(piece->rows[i].data(), 1, piece->rows[i].size(), stdout);
+    }
+    total_rows += piece->rows.size() - from_row;
+    truth = move(piece->end_state);
+  } else {
+    restitched_bytes += piece->end - piece->start;
+  }
+  truth.scroll_off = nullptr;
+
+  vector<string>().swap(piece->rows);
+  vector<Keyframe>().swap(piece->keyframes);
+}
+
+// Cuts every recording into pieces ending at line ends.
+void plan_pieces() {
+  for (size_t r = 0; r < recordings.size(); r++) {
+    const Recording &rec = recordings[r];
+    size_t start = rec.data_start;
+    while (start < rec.size) {
+      size_t end = rec.size;
+      if (rec.size - start > EXPORT_PIECE_BYTES) {
+        const char *newline =
+            (const char *)memchr(rec.data + start + EXPORT_PIECE_BYTES, '\n', rec.size - start - EXPORT_PIECE_BYTES);
+        if (newline != nullptr) end = newline + 1 - rec.data;
+      }
+      pieces.emplace_back();
+      pieces.back().recording = r;
+      pieces.back().start = start;
+      pieces.back().end = end;
+      pieces.back().done = false;
+      start = end;
+    }
+  }
+}
+
+void open_recording(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  FAIL_IF_WITH_CODE(fd == -1, "Error: cannot open recording");
+  struct stat st;
+  FAIL_IF_WITH_CODE(fstat(fd, &st) == -1, "Error: cannot stat recording");
+
+  Recording rec;
+  rec.path = path;
+  rec.size = st.st_size;
+  rec.data = nullptr;
+  if (rec.size > 0) {
+    void *map = mmap(nullptr, rec.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    FAIL_IF_WITH_CODE(map == MAP_FAILED, "Error: cannot map recording");
+    rec.data = (const char *)map;
+  }
+  close(fd);
+
+  uint32_t session;
+  uint64_t start_ms;
+  rec.data_start = search_parse_header(rec.data, rec.size, &session, &start_ms);
+  recordings.push_back(rec);
+}
+
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void usage() {
+  printf("Usage: export [-f text|html] [-s COLSxROWS] [-j workers] <segment>...\n");
+  printf("  segments are emulated as one stream, in the order given\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  config.format = EXPORT_TEXT;
+  config.cols = EXPORT_DEFAULT_COLS;
+  config.rows = EXPORT_DEFAULT_ROWS;
+  config.workers = cpus > 0 ? (int)cpus : 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:s:j:")) != -1) {
+    switch (opt) {
+      case 'f':
+        if (strcmp(optarg, "text") == 0) {
+          config.format = EXPORT_TEXT;
+        } else if (strcmp(optarg, "html") == 0) {
+          config.format = EXPORT_HTML;
+        } else {
+          usage();
+        }
+        break;
+      case 's':
+        if (sscanf(optarg, "%dx%d", &config.cols, &config.rows) != 2) usage();
+        break;
+      case 'j':
+        config.workers = atoi(optarg);
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind >= argc || config.workers < 1 || config.cols < 1 || config.rows < 1) usage();
+
+  double start = now_ms();
+  for (int i = optind; i < argc; i++) open_recording(argv[i]);
+  plan_pieces();
+
+  if (config.format == EXPORT_HTML) {
+    printf("<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><style>:root{--fg:#d4d4d4;--bg:#1e1e1e}"
+           "body{color:var(--fg);background:var(--bg)}</style></head><body><pre>\n");
+  }
+
+  screen_init(&truth, config.rows, config.cols);
+  StealQueue<size_t> queue(config.workers);
+  size_t per_worker = (pieces.size() + config.workers - 1) / config.workers;
+  for (size_t i = pieces.size(); i-- > 0;) queue.push((int)(i / per_worker), i);
+
+  run_workers(config.workers, [&](int worker) {
+    size_t index;
+    while (queue.pop(worker, &index)) {
+      emulate_piece(&pieces[index]);
+
+      lock_guard<mutex> guard(stitch_lock);
+      pieces[index].done = true;
+      for (; next_stitch < pieces.size() && pieces[next_stitch].done; next_stitch++) {
+        stitch_piece(&pieces[next_stitch]);
+      }
+    }
+  });
+
+  // The screen as the recording left it, without the empty rows below the last line.
+  int last = truth.rows;
+  string row;
+  while (last > 0) {
+    row.clear();
+    render_row(&truth, last - 1, &row);
+    if (row != "\n") break;
+    last--;
+  }
+  for (int r = 0; r < last; r++) {
+    row.clear();
+    render_row(&truth, r, &row);
+    fwrite(row.data(), 1, row.size(), stdout);
+  }
+
+  if (config.format == EXPORT_HTML) printf("</pre></body></html>\n");
+
+  uint64_t total_bytes = 0;
+  for (const Recording &rec : recordings) total_bytes += rec.size;
+  double elapsed = now_ms() - start;
+  fprintf(stderr, "-- %zu rows from %zu pieces, %.1f MB in %.1f ms (%.0f MB/s, %d workers), %.1f KB emulated twice\n",
+          total_rows + last, pieces.size(), total_bytes / 1e6, elapsed, elapsed > 0 ? total_bytes / 1e3 / elapsed : 0.0,
+          config.workers, restitched_bytes / 1e3);
+
+  for (const Recording &rec : recordings) {
+    if (rec.data != nullptr) munmap((void *)rec.data, rec.size);
+  }
+  return EXIT_SUCCESS;
+}
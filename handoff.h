@@ -0,0 +1,334 @@
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+// Handing live sessions from one process image to the next, for the server's hot upgrade. The state is a flat
+// binary image written field by field; plain structs (cells, styles, decoder and filter state) go in as their
+// bytes, so both sides have to agree on their layout, which `handoff_layout` checks. The file descriptors go
+// separately, as SCM_RIGHTS over a SOCK_SEQPACKET socket. The state itself would not fit the socket buffer, it goes
+// in a memfd passed as the first descriptor.
+//
+// A descriptor in flight keeps its file open, so a master PTY passed this way never hangs up its shell, even when
+// the sending process execs and its own descriptors close.
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "query.h"
+#include "screen.h"
+
+#define HANDOFF_MAGIC 0x74686f66  // "thof"
+#define HANDOFF_VERSION 2         // Bump when a saved field is added, dropped or changes meaning.
+#define HANDOFF_FDS_PER_MSG 250   // The kernel's SCM_MAX_FD is 253.
+
+// Changes with the version and with the size of every struct saved as bytes.
+static inline uint32_t handoff_layout() {
+  uint32_t h = HANDOFF_VERSION;
+  size_t sizes[] = {sizeof(Cell), sizeof(Style), sizeof(Utf8Decoder), sizeof(QueryFilter), sizeof(ParserState)};
+  for (size_t size : sizes) h = h * 31 + (uint32_t)size;
+  return h;
+}
+
+static inline void handoff_put(std::string *out, const void *v, size_t len) {
+  out->append((const char *)v, len);
+}
+
+// Length-prefixed.
+static inline void handoff_put_bytes(std::string *out, const void *v, size_t len) {
+  uint32_t n = (uint32_t)len;
+  handoff_put(out, &n, sizeof(n));
+  handoff_put(out, v, len);
+}
+
+template <typename T>
+static inline void handoff_put_vector(std::string *out, const std::vector<T> &v) {
+  handoff_put_bytes(out, v.data(), v.size() * sizeof(T));
+}
+
+// Reads fail soft: past the end or after one failure every read leaves zeroes and `ok` false.
+struct HandoffReader {
+  const char *p;
+  const char *end;
+  bool ok;
+};
+
+static inline bool handoff_get(HandoffReader *r, void *v, size_t len) {
+  if (!r->ok || (size_t)(r->end - r->p) < len) {
+    r->ok = false;
+    memset(v, 0, len);
+    return false;
+  }
+  memcpy(v, r->p, len);
+  r->p += len;
+  return true;
+}
+
+static inline bool handoff_get_bytes(HandoffReader *r, std::string *out) {
+  uint32_t n = 0;
+  out->clear();
+  if (!handoff_get(r, &n, sizeof(n)) || (size_t)(r->end - r->p) < n) return r->ok = false;
+  out->assign(r->p, n);
+  r->p += n;
+  return true;
+}
+
+template <typename T>
+static inline bool handoff_get_vector(HandoffReader *r, std::vector<T> *v) {
+  uint32_t n = 0;
+  v->clear();
+  if (!handoff_get(r, &n, sizeof(n)) || n % sizeof(T) != 0 || (size_t)(r->end - r->p) < n) return r->ok = false;
+  v->resize(n / sizeof(T));
+  memcpy(v->data(), r->p, n);
+  r->p += n;
+  return true;
+}
+
+// Everything but the dirty flags, which start all set, and `scroll_off`, which belongs to the owner.
+static inline void handoff_put_screen(std::string *out, const Screen *s) {
+  handoff_put(out, &s->rows, sizeof(s->rows));
+  handoff_put(out, &s->cols, sizeof(s->cols));
+  handoff_put_vector(out, s->cells);
+  handoff_put_vector(out, s->alt_saved);
+
+  handoff_put(out, &s->cur_row, sizeof(s->cur_row));
+  handoff_put(out, &s->cur_col, sizeof(s->cur_col));
+  handoff_put(out, &s->wrap_pending, sizeof(s->wrap_pending));
+  handoff_put(out, &s->saved_row, sizeof(s->saved_row));
+  handoff_put(out, &s->saved_col, sizeof(s->saved_col));
+  handoff_put(out, &s->saved_pen, sizeof(s->saved_pen));
+  handoff_put(out, &s->scroll_top, sizeof(s->scroll_top));
+  handoff_put(out, &s->scroll_bottom, sizeof(s->scroll_bottom));
+  handoff_put(out, &s->pen, sizeof(s->pen));
+
+  // The style hash and the link lookup are rebuilt from these.
+  handoff_put_vector(out, s->styles.styles);
+  handoff_put_vector(out, s->styles.free_ids);
+  uint32_t n_links = (uint32_t)s->styles.links.size();
+  handoff_put(out, &n_links, sizeof(n_links));
+  for (const std::string &link : s->styles.links) handoff_put_bytes(out, link.data(), link.size());
+  handoff_put_vector(out, s->styles.free_links);
+  handoff_put(out, &s->cells_written, sizeof(s->cells_written));
+
+  handoff_put(out, &s->cursor_visible, sizeof(s->cursor_visible));
+  handoff_put(out, &s->autowrap, sizeof(s->autowrap));
+  handoff_put(out, &s->alt_active, sizeof(s->alt_active));
+
+  handoff_put(out, &s->state, sizeof(s->state));
+  handoff_put(out, s->params, sizeof(s->params));
+  handoff_put(out, &s->n_params, sizeof(s->n_params));
+  handoff_put(out, &s->private_marker, sizeof(s->private_marker));
+  handoff_put(out, &s->intermediate, sizeof(s->intermediate));
+  handoff_put(out, &s->string_is_osc, sizeof(s->string_is_osc));
+  handoff_put_bytes(out, s->osc.data(), s->osc.size());
+  handoff_put(out, &s->utf8, sizeof(s->utf8));
+
+  handoff_put(out, &s->answer_queries, sizeof(s->answer_queries));
+  handoff_put(out, &s->default_fg, sizeof(s->default_fg));
+  handoff_put(out, &s->default_bg, sizeof(s->default_bg));
+  handoff_put_bytes(out, s->replies.data(), s->replies.size());
+}
+
+// Returns false on a truncated or inconsistent image, `s` is then not usable.
+static inline bool handoff_get_screen(HandoffReader *r, Screen *s) {
+  handoff_get(r, &s->rows, sizeof(s->rows));
+  handoff_get(r, &s->cols, sizeof(s->cols));
+  handoff_get_vector(r, &s->cells);
+  handoff_get_vector(r, &s->alt_saved);
+  if (!r->ok || s->rows <= 0 || s->cols <= 0 || s->cells.size() != (size_t)s->rows * s->cols) return false;
+
+  handoff_get(r, &s->cur_row, sizeof(s->cur_row));
+  handoff_get(r, &s->cur_col, sizeof(s->cur_col));
+  handoff_get(r, &s->wrap_pending, sizeof(s->wrap_pending));
+  handoff_get(r, &s->saved_row, sizeof(s->saved_row));
+  handoff_get(r, &s->saved_col, sizeof(s->saved_col));
+  handoff_get(r, &s->saved_pen, sizeof(s->saved_pen));
+  handoff_get(r, &s->scroll_top, sizeof(s->scroll_top));
+  handoff_get(r, &s->scroll_bottom, sizeof(s->scroll_bottom));
+  handoff_get(r, &s->pen, sizeof(s->pen));
+
+  StyleTable *t = &s->styles;
+  handoff_get_vector(r, &t->styles);
+  handoff_get_vector(r, &t->free_ids);
+  uint32_t n_links = 0;
+  handoff_get(r, &n_links, sizeof(n_links));
+  t->links.clear();
+  for (uint32_t i = 0; i < n_links && r->ok; i++) {
+    t->links.emplace_back();
+    handoff_get_bytes(r, &t->links.back());
+  }
+  handoff_get_vector(r, &t->free_links);
+  handoff_get(r, &s->cells_written, sizeof(s->cells_written));
+  if (!r->ok || t->styles.empty() || t->styles.size() > STYLE_MAX || t->links.empty()) return false;
+
+  std::vector<uint8_t> free_style(t->styles.size(), 0);
+  for (uint16_t id : t->free_ids) {
+    if (id >= free_style.size()) return false;
+    free_style[id] = 1;
+  }
+  memset(t->hash, 0, sizeof(t->hash));
+  t->live = 0;
+  for (size_t id = 0; id < t->styles.size(); id++) {
+    if (free_style[id]) continue;
+    style_hash_insert(t, (uint16_t)id);
+    t->live++;
+  }
+  t->link_ids.clear();
+  for (size_t id = 1; id < t->links.size(); id++) {
+    if (!t->links[id].empty()) t->link_ids[t->links[id]] = (uint16_t)id;  // Freed links are cleared.
+  }
+
+  handoff_get(r, &s->cursor_visible, sizeof(s->cursor_visible));
+  handoff_get(r, &s->autowrap, sizeof(s->autowrap));
+  handoff_get(r, &s->alt_active, sizeof(s->alt_active));
+
+  handoff_get(r, &s->state, sizeof(s->state));
+  handoff_get(r, s->params, sizeof(s->params));
+  handoff_get(r, &s->n_params, sizeof(s->n_params));
+  handoff_get(r, &s->private_marker, sizeof(s->private_marker));
+  handoff_get(r, &s->intermediate, sizeof(s->intermediate));
+  handoff_get(r, &s->string_is_osc, sizeof(s->string_is_osc));
+  handoff_get_bytes(r, &s->osc);
+  handoff_get(r, &s->utf8, sizeof(s->utf8));
+
+  handoff_get(r, &s->answer_queries, sizeof(s->answer_queries));
+  handoff_get(r, &s->default_fg, sizeof(s->default_fg));
+  handoff_get(r, &s->default_bg, sizeof(s->default_bg));
+  handoff_get_bytes(r, &s->replies);
+
+  s->dirty.assign(s->rows, 1);
+  s->any_dirty = true;
+  s->pen_id = -1;
+  s->scroll_off = nullptr;
+  s->scroll_off_ctx = nullptr;
+  return r->ok;
+}
+
+// Sends `state` and then `fds` down `sock`. The first message carries the number of descriptors that follow,
+// the memfd with the state included.
+static inline bool handoff_send(int sock, const std::string &state, const std::vector<int> &fds) {
+  int memfd = memfd_create("termy-handoff", MFD_CLOEXEC);
+  if (memfd == -1) return false;
+
+  for (size_t done = 0; done < state.size();) {
+    ssize_t written = write(memfd, state.data() + done, state.size() - done);
+    if (written == -1 && errno == EINTR) continue;
+    if (written <= 0) {
+      int prev_errno = errno;
+      close(memfd);
+      errno = prev_errno;
+      return false;
+    }
+    done += written;
+  }
+
+  std::vector<int> all(1, memfd);
+  all.insert(all.end(), fds.begin(), fds.end());
+  uint32_t total = (uint32_t)all.size();
+
+  for (size_t i = 0; i < all.size(); i += HANDOFF_FDS_PER_MSG) {
+    size_t n = all.size() - i < HANDOFF_FDS_PER_MSG ? all.size() - i : HANDOFF_FDS_PER_MSG;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MSG)];
+    memset(control, 0, sizeof(control));
+
+    struct iovec iov = {&total, sizeof(total)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), &all[i], sizeof(int) * n);
+
+    ssize_t sent;
+    while ((sent = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+    }
+    if (sent == -1) {
+      int prev_errno = errno;
+      close(memfd);
+      errno = prev_errno;
+      return false;
+    }
+  }
+
+  close(memfd);  // The message in flight holds its own reference.
+  return true;
+}
+
+struct Handoff {
+  std::vector<int> fds;  // In the order they were sent, the memfd not included.
+  const char *state;
+  size_t state_len;
+};
+
+// Receives what `handoff_send` sent, the descriptors with close-on-exec set. The state stays mapped until
+// `handoff_release`.
+static inline bool handoff_receive(int sock, Handoff *h) {
+  h->fds.clear();
+  h->state = nullptr;
+  h->state_len = 0;
+
+  uint32_t total = 1;
+  while (h->fds.size() < total) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MSG)];
+    struct iovec iov = {&total, sizeof(total)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (received == -1 && errno == EINTR) continue;
+    if (received != sizeof(total) || (msg.msg_flags & MSG_CTRUNC)) {
+      errno = received == -1 ? errno : EPROTO;
+      return false;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+      size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const unsigned char *data = CMSG_DATA(cmsg);
+      for (size_t i = 0; i < n; i++) {
+        int fd;
+        memcpy(&fd, data + i * sizeof(int), sizeof(int));
+        h->fds.push_back(fd);
+      }
+    }
+  }
+
+  int memfd = h->fds[0];
+  h->fds.erase(h->fds.begin());
+  struct stat st;
+  void *map = fstat(memfd, &st) == 0 && st.st_size > 0
+                  ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, memfd, 0)
+                  : MAP_FAILED;
+  close(memfd);
+  if (map == MAP_FAILED) return false;
+
+  h->state = (const char *)map;
+  h->state_len = st.st_size;
+  return true;
+}
+
+static inline void handoff_release(Handoff *h) {
+  if (h->state != nullptr) munmap((void *)h->state, h->state_len);
+  h->state = nullptr;
+  h->state_len = 0;
+}
+
+#endif  // HANDOFF_H_
@@ -0,0 +1,253 @@
+#define _XOPEN_SOURCE 600
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "recorder.h"
+#include "search.h"
+
+#define DEFAULT_BASE "output"  // try2's SCRIPT_BASE.
+#define TIME_BUF_SIZE 32
+
+#define FAIL_IF_WITH_CODE(exp, msg) \
+  if (exp) {                        \
+    perror(msg);                    \
+    exit(EXIT_FAILURE);             \
+  }
+
+#define FAIL_IF(exp, msg) \
+  if (exp) {              \
+    printf(msg);          \
+    printf("\n");         \
+    exit(EXIT_FAILURE);   \
+  }
+
+using namespace std;
+
+struct Segment {
+  string base;  // The session's, with the directory.
+  unsigned index;
+
+  bool operator<(const Segment &other) const {
+    return base != other.base ? base < other.base : index < other.index;
+  }
+};
+
+// The segments of every session recorded under `base`, or of `base` itself when it names one session. By session,
+// then ascending.
+vector<Segment> list_segments(const char *base) {
+  string dir = ".";
+  string prefix;
+  const char *name = base;
+  const char *slash = strrchr(base, '/');
+  if (slash != nullptr) {
+    dir = slash == base ? "/" : string(base, slash - base);
+    prefix = string(base, slash - base + 1);
+    name = slash + 1;
+  }
+
+  vector<Segment> segments;
+  DIR *d = opendir(dir.c_str());
+  FAIL_IF_WITH_CODE(d == nullptr, "Error: cannot list the recording directory");
+
+  size_t name_len = strlen(name);
+  struct dirent *entry;
+  while ((entry = readdir(d)) != nullptr) {
+    int pid;
+    size_t base_len;
+    unsigned index;
+    const char *suffix = recorder_match_file(entry->d_name, name, &pid, &base_len, &index);
+    if (suffix != nullptr && suffix[0] == '\0') {
+      segments.push_back(Segment{prefix + string(entry->d_name, base_len), index});
+      continue;
+    }
+
+    suffix = entry->d_name + name_len;
+    if (strncmp(entry->d_name, name, name_len) != 0 || suffix[0] != '.' || strspn(suffix + 1, "0123456789") != 6 ||
+        suffix[7] != '\0') {
+      continue;
+    }
+    segments.push_back(Segment{base, (unsigned)strtoul(suffix + 1, nullptr, 10)});
+  }
+  closedir(d);
+
+  sort(segments.begin(), segments.end());
+  return segments;
+}
+
+uint64_t file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Indexes every segment whose index is missing or older than the segment, a segment still being recorded included.
+int build(const char *base) {
+  vector<Segment> segments = list_segments(base);
+  int built = 0;
+  double start = now_ms();
+
+  for (const Segment &segment : segments) {
+    char path[RECORDER_PATH_MAX];
+    char timing_path[RECORDER_PATH_MAX];
+    char index_path[RECORDER_PATH_MAX + 8];
+    snprintf(path, sizeof(path), RECORDER_SEGMENT_FMT, segment.base.c_str(), segment.index);
+    snprintf(timing_path, sizeof(timing_path), RECORDER_TIMING_FMT, segment.base.c_str(), segment.index);
+    snprintf(index_path, sizeof(index_path), SEARCH_INDEX_FMT, path);
+
+    SearchIndex idx;
+    if (search_index_open(index_path, &idx)) {
+      bool current = idx.header->covered == file_size(path);
+      search_index_close(&idx);
+      if (current) continue;
+    }
+
+    if (!search_index_build(path, access(timing_path, R_OK) == 0 ? timing_path : nullptr, index_path)) {
+      fprintf(stderr, "Error: cannot index %s: %s\n", path, strerror(errno));
+      continue;
+    }
+    built++;
+  }
+
+  printf("-- %d of %zu segments indexed in %.1f ms\n", built, segments.size(), now_ms() - start);
+  return EXIT_SUCCESS;
+}
+
+void format_time(const SearchHeader *h, uint32_t line_ms, char *out) {
+  if (h->start_ms == 0) {
+    snprintf(out, TIME_BUF_SIZE, "-");
+    return;
+  }
+
+  uint64_t ms = h->start_ms + line_ms;
+  time_t secs = (time_t)(ms / 1000);
+  struct tm tm;
+  size_t len = strftime(out, TIME_BUF_SIZE, "%Y-%m-%d %H:%M:%S", localtime_r(&secs, &tm));
+  snprintf(out + len, TIME_BUF_SIZE - len, ".%03u", (unsigned)(ms % 1000));
+}
+
+// Prints every indexed line containing `text`, ignoring ASCII case: session, time, segment:line and the line.
+int query(const char *base, const char *text) {
+  string needle(text);
+  for (char &c : needle) c = search_fold(c);
+
+  vector<Segment> segments = list_segments(base);
+  double start = now_ms();
+  size_t matches = 0;
+  size_t checked = 0;
+  size_t total = 0;
+  size_t unindexed = 0;
+  size_t outdated = 0;
+  vector<uint32_t> blocks;
+  string folded;
+  string line;
+
+  for (const Segment &segment : segments) {
+    char path[RECORDER_PATH_MAX];
+    char index_path[RECORDER_PATH_MAX + 8];
+    snprintf(path, sizeof(path), RECORDER_SEGMENT_FMT, segment.base.c_str(), segment.index);
+    snprintf(index_path, sizeof(index_path), SEARCH_INDEX_FMT, path);
+
+    SearchIndex idx;
+    if (!search_index_open(index_path, &idx)) {
+      unindexed++;
+      continue;
+    }
+
+    const SearchHeader *h = idx.header;
+    uint64_t size = file_size(path);
+    if (size < h->covered) {  // The segment was recorded over since, the index is of something else.
+      outdated++;
+      search_index_close(&idx);
+      continue;
+    }
+    if (size > h->covered) outdated++;
+
+    total += h->n_blocks;
+    search_candidate_blocks(&idx, needle.data(), needle.size(), &blocks);
+    if (blocks.empty() || h->covered == 0) {
+      search_index_close(&idx);
+      continue;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    void *map = fd != -1 ? mmap(nullptr, h->covered, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (fd != -1) close(fd);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "Error: cannot read %s: %s\n", path, strerror(errno));
+      search_index_close(&idx);
+      continue;
+    }
+
+    const char *data = (const char *)map;
+    for (uint32_t b : blocks) {
+      checked++;
+      for (uint32_t i = idx.block_lines[b]; i < idx.block_lines[b + 1]; i++) {
+        search_line_text(data + idx.line_offsets[i], data + idx.line_offsets[i + 1], &folded, &line);
+        if (folded.find(needle) == string::npos) continue;
+
+        while (!line.empty() && line.back() == '\n') line.pop_back();
+        char when[TIME_BUF_SIZE];
+        format_time(h, idx.line_ms[i], when);
+        printf("%u  %s  %06u:%u  %s\n", h->session, when, segment.index, i + 1, line.c_str());
+        matches++;
+      }
+    }
+
+    munmap(map, h->covered);
+    search_index_close(&idx);
+  }
+
+  fprintf(stderr, "-- %zu matches in %.2f ms, %zu of %zu blocks read", matches, now_ms() - start, checked, total);
+  if (unindexed > 0 || outdated > 0) {
+    fprintf(stderr, ", %zu segments unindexed, %zu changed since indexed: run `index build`", unindexed, outdated);
+  }
+  fprintf(stderr, "\n");
+  return EXIT_SUCCESS;
+}
+
+void usage() {
+  printf("Usage: index build [base] | index query [-b base] <text>\n");
+  printf("  base defaults to \"%s\", the segments are base-PID-START.NNNNNN, one set per session\n", DEFAULT_BASE);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) usage();
+
+  if (strcmp(argv[1], "build") == 0) {
+    if (argc > 3) usage();
+    return build(argc == 3 ? argv[2] : DEFAULT_BASE);
+  }
+
+  if (strcmp(argv[1], "query") == 0) {
+    const char *base = DEFAULT_BASE;
+    int arg = 2;
+    if (argc > arg + 1 && strcmp(argv[arg], "-b") == 0) {
+      base = argv[arg + 1];
+      arg += 2;
+    }
+    FAIL_IF(argc != arg + 1 || argv[arg][0] == '\0', "Usage: index query [-b base] <text>");
+    return query(base, argv[arg]);
+  }
+
+  usage();
+}
@@ -0,0 +1,571 @@
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "predict.h"
+#include "screen.h"
+#include "termy.h"
+
+#define READ_BUF_SIZE 65536
+#define DEBUG_BUF_SIZE 1024
+#define MAX_EVENTS 256
+
+#define MUX_PREFIX_KEY 0x01  // ^A
+#define MUX_MIN_PANE_ROWS 2
+#define MUX_MIN_PANE_COLS 8
+#define MUX_SPARE_SHELLS 1  // Started ahead of time, a new pane's prompt is usually already waiting.
+
+#define DBG(...) debug(__FILE__, __LINE__, __VA_ARGS__)
+
+#define FAIL_IF_WITH_CODE(exp, msg) \
+  if (exp) {                        \
+    perror(msg);                    \
+    exit(EXIT_FAILURE);             \
+  }
+
+#define FAIL_IF(exp, msg) \
+  if (exp) {              \
+    printf(msg);          \
+    printf("\n");         \
+    exit(EXIT_FAILURE);   \
+  }
+
+using namespace std;
+
+// One shell running in its own PTY and drawn into a tile of the outer terminal. An idle pane costs its screen grid and
+// an epoll registration, nothing is polled or allocated for it until the child writes something.
+struct Pane {
+  int id;
+  termy::PtySession session;  // Reaped through `try_wait` only, so its pid is never another process's.
+  Screen screen;
+  Predictor predictor;  // Local echo for keys typed into the pane.
+  std::string input;     // For the master, what it did not take yet goes out on EPOLLOUT.
+  bool watching_out;
+
+  // Tile geometry on the outer terminal, 0-based. The title bar sits on `top`, the content below it.
+  int top;
+  int left;
+  int rows;
+  int cols;
+};
+
+struct termios tty_orig;
+struct winsize outer_winsize;
+termy::SpawnOptions shell_options;
+termy::ShellPool *shell_pool;
+vector<termy::PtySession> hung_up;  // Shells of closed panes not reaped yet.
+int epoll_fd;
+vector<Pane *> panes;
+size_t focused = 0;
+int next_pane_id = 1;
+bool frame_dirty = true;
+char read_buf[READ_BUF_SIZE];  // Shared by every pane, data is consumed by the screen model right away.
+
+volatile sig_atomic_t got_sigwinch = 0;
+volatile sig_atomic_t got_sigchld = 0;
+
+void debug(const char *file_name, int line_no, const char *msg, ...) {
+  int f = open("pty.log", O_CREAT | O_APPEND | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  FAIL_IF_WITH_CODE(f == -1, "Cannot open debug file");
+
+  int fmt_len;
+
+  va_list args;
+  va_start(args, msg);
+
+  char fmt_buf[DEBUG_BUF_SIZE];
+  const char *debug_fmt = "[\x1b[93m%s\x1b[39m:\x1b[96m%d\x1b[0m] %s\n";
+  fmt_len = snprintf(fmt_buf, DEBUG_BUF_SIZE, debug_fmt, file_name, line_no, msg);
+  FAIL_IF(fmt_len >= DEBUG_BUF_SIZE, "Debug fmt buffer overflow.");
+
+  char buf[DEBUG_BUF_SIZE];
+
+  int len = vsnprintf(buf, DEBUG_BUF_SIZE, fmt_buf, args);
+  FAIL_IF(len >= DEBUG_BUF_SIZE, "Debug buffer overflow.");
+
+  FAIL_IF_WITH_CODE(write(f, buf, strlen(buf)) == -1, "Cannot write to debug file");
+
+  va_end(args);
+
+  close(f);
+}
+
+static void tty_reset(void) {
+  const char *restore = "\x1b[0m\x1b[?25h\x1b[H\x1b[2J";
+  write(STDOUT_FILENO, restore, strlen(restore));
+
+  if (tcsetattr(STDIN_FILENO, TCSANOW, &tty_orig) == -1) {
+    printf("Error: failed resetting tty.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+int tty_set_raw(int fd, struct termios *prev_termios) {
+  struct termios t;
+
+  if (tcgetattr(fd, &t) == -1) {
+    printf("Error: cannot get tty config.\n");
+    return -1;
+  }
+
+  if (prev_termios != nullptr) {
+    *prev_termios = t;
+  }
+
+  t.c_lflag &= ~(ICANON | ISIG | IEXTEN | ECHO);
+  t.c_iflag &= ~(BRKINT | ICRNL | IGNBRK | IGNCR | INLCR | INPCK | ISTRIP | IXON | PARMRK);
+
+  t.c_oflag &= ~OPOST;
+
+  t.c_cc[VMIN] = 1;
+  t.c_cc[VTIME] = 0;
+
+  if (tcsetattr(fd, TCSAFLUSH, &t) == -1) {
+    return -1;
+  }
+
+  return 0;
+}
+
+void sig_handler(int sig_no) {
+  if (sig_no == SIGWINCH) got_sigwinch = 1;
+  if (sig_no == SIGCHLD) got_sigchld = 1;
+}
+
+// The signals stay blocked outside of `epoll_pwait`, so they can only interrupt the loop while it is idle.
+void setup_signal_handlers(sigset_t *wait_mask) {
+  struct sigaction sa {
+    0
+  };
+
+  sa.sa_flags = 0;
+  sa.sa_handler = &sig_handler;
+
+  FAIL_IF_WITH_CODE(sigaction(SIGWINCH, &sa, nullptr) == -1, "Error: cannot set signal handlers");
+  FAIL_IF_WITH_CODE(sigaction(SIGCHLD, &sa, nullptr) == -1, "Error: cannot set signal handlers");
+
+  sigset_t block_mask;
+  sigemptyset(&block_mask);
+  sigaddset(&block_mask, SIGWINCH);
+  sigaddset(&block_mask, SIGCHLD);
+  FAIL_IF_WITH_CODE(sigprocmask(SIG_BLOCK, &block_mask, wait_mask) == -1, "Error: cannot block signals");
+
+  sigdelset(wait_mask, SIGWINCH);
+  sigdelset(wait_mask, SIGCHLD);
+
+  DBG("Signal handlers set.");
+}
+
+void write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, buf, len);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) {  // A busy child, wait until its PTY drains.
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        poll(&pfd, 1, -1);
+        continue;
+      }
+
+      perror("Error: invalid write");
+      exit(EXIT_FAILURE);
+    }
+
+    buf += written;
+    len -= written;
+  }
+}
+
+void pane_update_events(Pane *p) {
+  bool want_out = !p->input.empty();
+  if (want_out == p->watching_out) return;
+
+  struct epoll_event ev {
+    0
+  };
+  ev.events = EPOLLIN | (want_out ? (uint32_t)EPOLLOUT : 0);
+  ev.data.ptr = p;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, p->session.fd(), &ev);
+  p->watching_out = want_out;
+}
+
+// Writes as much of the pending input as the master takes now. A child that does not read only holds up itself.
+void pane_flush(Pane *p) {
+  size_t done = 0;
+  while (done < p->input.size()) {
+    ssize_t written = write(p->session.fd(), p->input.data() + done, p->input.size() - done);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      break;  // EAGAIN waits for EPOLLOUT, anything else shows up as EIO on the next read.
+    }
+    done += written;
+  }
+  p->input.erase(0, done);
+  pane_update_events(p);
+}
+
+void pane_write(Pane *p, const char *buf, size_t len) {
+  p->input.append(buf, len);
+  pane_flush(p);
+}
+
+// Query replies queue with the keys. A child that keeps asking without reading gets no more of them once the
+// queue is past QUERY_REPLY_BACKLOG, they are dropped rather than piled up.
+void pane_reply(Pane *p) {
+  std::string *replies = &p->screen.replies;
+  if (p->input.size() + replies->size() <= QUERY_REPLY_BACKLOG) {
+    pane_write(p, replies->data(), replies->size());
+  } else {
+    DBG("Pane %d is not reading, dropped %zu reply bytes.", p->id, replies->size());
+  }
+  replies->clear();
+}
+
+// Tiles panes into a near-square grid. The last grid row shares its width between whatever panes are left over.
+bool layout(size_t pane_count, vector<Pane *> *targets) {
+  int term_rows = outer_winsize.ws_row;
+  int term_cols = outer_winsize.ws_col;
+  int grid_cols = (int)ceil(sqrt((double)pane_count));
+  int grid_rows = (int)((pane_count + grid_cols - 1) / grid_cols);
+
+  if (term_rows / grid_rows - 1 < MUX_MIN_PANE_ROWS || term_cols / grid_cols - 1 < MUX_MIN_PANE_COLS) {
+    return false;
+  }
+
+  if (targets == nullptr) return true;
+
+  for (size_t i = 0; i < targets->size(); i++) {
+    Pane *p = (*targets)[i];
+    int grid_row = (int)(i / grid_cols);
+    int grid_col = (int)(i % grid_cols);
+    int in_this_row = grid_row == grid_rows - 1 ? (int)(pane_count - (size_t)grid_row * grid_cols) : grid_cols;
+
+    int tile_rows = term_rows / grid_rows;
+    int tile_cols = term_cols / in_this_row;
+    p->top = grid_row * tile_rows;
+    p->left = grid_col * tile_cols;
+    if (grid_row == grid_rows - 1) tile_rows = term_rows - p->top;
+    if (grid_col == in_this_row - 1) tile_cols = term_cols - p->left;
+
+    // One row for the title bar, one column for the separator to the right.
+    p->rows = tile_rows - 1;
+    p->cols = grid_col == in_this_row - 1 ? tile_cols : tile_cols - 1;
+
+    screen_resize(&p->screen, p->rows, p->cols);
+    predict_rollback(&p->predictor, &p->screen);
+    if (p->session.valid() && !p->session.resize(p->rows, p->cols).ok()) {
+      DBG("Failed resizing pane %d.", p->id);
+    }
+  }
+
+  frame_dirty = true;
+  return true;
+}
+
+Pane *spawn_pane() {
+  if (!layout(panes.size() + 1, nullptr)) {
+    DBG("No room for another pane.");
+    return nullptr;
+  }
+
+  Pane *p = new Pane();
+  p->id = next_pane_id++;
+  p->watching_out = false;
+  screen_init(&p->screen, MUX_MIN_PANE_ROWS, MUX_MIN_PANE_COLS);
+  p->screen.answer_queries = true;  // Panes are drawn from the model, no query would reach the outer terminal.
+  predict_init(&p->predictor);
+  panes.push_back(p);
+  layout(panes.size(), &panes);
+
+  // A spare shell if there is one, spawned without forking us otherwise. Either way non-blocking already.
+  termy::Error err = shell_pool->take(p->rows, p->cols, &p->session);
+  if (!err.ok()) {
+    errno = err.code;
+    perror("Error: cannot start pane shell");
+    exit(EXIT_FAILURE);
+  }
+
+  struct epoll_event ev {
+    0
+  };
+  ev.events = EPOLLIN;
+  ev.data.ptr = p;
+  FAIL_IF_WITH_CODE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p->session.fd(), &ev) == -1, "Error: cannot watch master pty");
+
+  DBG("Pane %d started, pid: %d, fd: %d.", p->id, p->session.pid(), p->session.fd());
+  return p;
+}
+
+void close_pane(Pane *p) {
+  DBG("Pane %d closed.", p->id);
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p->session.fd(), nullptr);
+  p->session.signal(SIGHUP);  // Refused once the shell was reaped.
+  p->session.close();
+  if (!p->session.try_wait(nullptr)) hung_up.push_back(std::move(p->session));
+
+  for (size_t i = 0; i < panes.size(); i++) {
+    if (panes[i] == p) {
+      panes.erase(panes.begin() + i);
+      if (focused > i || focused >= panes.size()) focused = focused > 0 ? focused - 1 : 0;
+      break;
+    }
+  }
+
+  delete p;
+  if (!panes.empty()) layout(panes.size(), &panes);
+}
+
+void draw_frame(string *out) {
+  char buf[64];
+  out->append("\x1b[0m\x1b[2J");
+
+  for (size_t i = 0; i < panes.size(); i++) {
+    Pane *p = panes[i];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH%s", p->top + 1, p->left + 1, i == focused ? "\x1b[7m" : "");
+    out->append(buf, len);
+
+    int title_len = snprintf(buf, sizeof(buf), " %d: pid %d ", p->id, p->session.pid());
+    int width = p->cols + (p->left + p->cols < outer_winsize.ws_col ? 1 : 0);
+    for (int c = 0; c < width; c++) out->push_back(c < title_len ? buf[c] : '-');
+    out->append("\x1b[0m");
+
+    if (p->left + p->cols < outer_winsize.ws_col) {
+      for (int r = 0; r < p->rows; r++) {
+        len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH|", p->top + 2 + r, p->left + p->cols + 1);
+        out->append(buf, len);
+      }
+    }
+
+    screen_mark_dirty(&p->screen, 0, p->screen.rows - 1);
+  }
+}
+
+// Paints only the rows that changed since the last render, so a flood in one pane does not repaint the others.
+void render() {
+  string out;
+  char buf[32];
+
+  if (frame_dirty) {
+    draw_frame(&out);
+    frame_dirty = false;
+  }
+
+  for (Pane *p : panes) {
+    if (!p->screen.any_dirty) continue;
+
+    Style last{};
+    out.append("\x1b[0m");
+    for (int r = 0; r < p->screen.rows; r++) {
+      if (!p->screen.dirty[r]) continue;
+
+      int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", p->top + 2 + r, p->left + 1);
+      out.append(buf, len);
+      screen_render_row(&p->screen, r, p->cols, &out, &last);
+    }
+    if (last.link != 0) screen_append_link(&p->screen, 0, &out);  // A hyperlink must not run into the frame.
+    screen_clear_dirty(&p->screen);
+  }
+
+  for (Pane *p : panes) predict_render(&p->predictor, p->top + 1, p->left, &out);
+
+  if (!panes.empty()) {
+    Pane *p = panes[focused];
+    bool predicted = predict_visible(&p->predictor);  // The cursor goes where the guesses end.
+    int row = predicted ? p->predictor.row : p->screen.cur_row;
+    int col = predicted ? p->predictor.col : p->screen.cur_col;
+    int len = snprintf(buf, sizeof(buf), "\x1b[0m\x1b[%d;%dH", p->top + 2 + row, p->left + 1 + col);
+    out.append(buf, len);
+    out.append(p->screen.cursor_visible ? "\x1b[?25h" : "\x1b[?25l");
+  }
+
+  write_all(STDOUT_FILENO, out.data(), out.size());
+}
+
+void send_keys(Pane *p, const char *buf, size_t len) {
+  predict_keys(&p->predictor, &p->screen, p->session.fd(), buf, len);
+  pane_write(p, buf, len);
+}
+
+// Returns false when the user asked to quit. Keys go to the focused pane unless they follow the prefix key.
+bool handle_stdin(const char *buf, ssize_t len) {
+  static bool prefix_seen = false;
+  ssize_t pass_from = 0;
+
+  for (ssize_t i = 0; i < len; i++) {
+    if (!prefix_seen && buf[i] != MUX_PREFIX_KEY) continue;
+
+    Pane *p = panes[focused];
+    if (i > pass_from) send_keys(p, buf + pass_from, i - pass_from);
+    pass_from = i + 1;
+
+    if (!prefix_seen) {
+      prefix_seen = true;
+      continue;
+    }
+    prefix_seen = false;
+
+    switch (buf[i]) {
+      case MUX_PREFIX_KEY:
+        send_keys(p, buf + i, 1);
+        break;
+      case 'c':
+        if (spawn_pane() != nullptr) focused = panes.size() - 1;
+        break;
+      case 'n':
+        focused = (focused + 1) % panes.size();
+        frame_dirty = true;
+        break;
+      case 'p':
+        focused = (focused + panes.size() - 1) % panes.size();
+        frame_dirty = true;
+        break;
+      case 'x':
+        p->session.signal(SIGHUP);
+        break;
+      case 'q':
+        return false;
+    }
+  }
+
+  if (len > pass_from && !prefix_seen) send_keys(panes[focused], buf + pass_from, len - pass_from);
+  return true;
+}
+
+// Pane by pane rather than waitpid(-1): that would also take the spare shells from under the pool, and a pane's pid
+// could be handed out again while the pane still signals it.
+void reap_children() {
+  int status;
+  for (Pane *p : panes) {
+    if (p->session.try_wait(&status)) DBG("Pane %d shell exited, status: %d.", p->id, status);
+  }
+
+  for (size_t i = 0; i < hung_up.size();) {
+    if (hung_up[i].try_wait(nullptr)) {
+      hung_up.erase(hung_up.begin() + i);
+    } else {
+      i++;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int initial_panes = argc > 1 ? atoi(argv[1]) : 2;
+  FAIL_IF(initial_panes < 1, "Usage: mux [pane-count]");
+
+  FAIL_IF_WITH_CODE(tcgetattr(STDIN_FILENO, &tty_orig) == -1, "Cannot fetch current tty settings");
+  FAIL_IF_WITH_CODE(ioctl(STDIN_FILENO, TIOCGWINSZ, &outer_winsize) < 0, "Cannot get current tty winsize");
+  FAIL_IF(!layout(initial_panes, nullptr), "Error: terminal too small for that many panes.");
+
+  shell_options = termy::SpawnOptions{};
+  shell_options.termios = &tty_orig;
+  shell_pool = new termy::ShellPool(shell_options, MUX_SPARE_SHELLS);
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  FAIL_IF_WITH_CODE(epoll_fd == -1, "Error: cannot create epoll instance");
+
+  sigset_t wait_mask;
+  setup_signal_handlers(&wait_mask);
+
+  for (int i = 0; i < initial_panes; i++) spawn_pane();
+
+  tty_set_raw(STDIN_FILENO, nullptr);
+  FAIL_IF_WITH_CODE(atexit(tty_reset) != 0, "Error: cannot set exit handler");
+
+  struct epoll_event ev {
+    0
+  };
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  FAIL_IF_WITH_CODE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == -1, "Error: cannot watch stdin");
+
+  struct epoll_event events[MAX_EVENTS];
+  bool running = true;
+
+  while (running && !panes.empty()) {
+    render();
+
+    // Pending guesses have to be settled even when the echo never comes.
+    bool guessing = false;
+    for (Pane *p : panes) guessing |= !p->predictor.pending.empty();
+
+    int n = epoll_pwait(epoll_fd, events, MAX_EVENTS, guessing ? PREDICT_TICK_MS : -1, &wait_mask);
+    if (n == -1 && errno != EINTR) {
+      perror("Error: epoll wait failed");
+      exit(EXIT_FAILURE);
+    }
+
+    vector<Pane *> closed;
+    for (int i = 0; i < n; i++) {
+      Pane *p = (Pane *)events[i].data.ptr;
+
+      if (p == nullptr) {  // STDIN --> focused PTY
+        ssize_t read_len = read(STDIN_FILENO, read_buf, READ_BUF_SIZE);
+        if (read_len <= 0 || !handle_stdin(read_buf, read_len)) running = false;
+        continue;
+      }
+
+      if (events[i].events & EPOLLOUT) pane_flush(p);
+      if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+
+      // PTY --> screen model. One read per wakeup keeps a flooding pane from starving the rest.
+      ssize_t read_len = read(p->session.fd(), read_buf, READ_BUF_SIZE);
+      if (read_len > 0) {
+        screen_feed(&p->screen, read_buf, read_len);
+        if (!p->screen.replies.empty()) pane_reply(p);
+        predict_check(&p->predictor, &p->screen, predict_now_ms());
+      } else if (read_len == 0 || (errno != EAGAIN && errno != EINTR)) {
+        closed.push_back(p);  // EIO once the last slave fd is gone.
+      }
+    }
+
+    for (Pane *p : closed) close_pane(p);
+
+    if (guessing) {
+      double now = predict_now_ms();
+      for (Pane *p : panes) predict_check(&p->predictor, &p->screen, now);
+    }
+
+    if (got_sigchld) {
+      got_sigchld = 0;
+      reap_children();
+    }
+
+    if (got_sigwinch) {
+      got_sigwinch = 0;
+      FAIL_IF_WITH_CODE(ioctl(STDIN_FILENO, TIOCGWINSZ, &outer_winsize) < 0, "Cannot get current tty winsize");
+      // Drop panes from the end until the rest fit.
+      while (panes.size() > 1 && !layout(panes.size(), nullptr)) close_pane(panes.back());
+      layout(panes.size(), &panes);
+    }
+
+    // After the keys that took a spare shell were handled, not in their way.
+    if (shell_pool->idle() < MUX_SPARE_SHELLS) {
+      termy::Error err = shell_pool->fill();
+      if (!err.ok()) DBG("Cannot start a spare shell: %s: %s.", err.op, strerror(err.code));
+    }
+  }
+
+  while (!panes.empty()) close_pane(panes.back());
+  delete shell_pool;  // Hangs up the spare shells.
+
+  exit(EXIT_SUCCESS);
+}
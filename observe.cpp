@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+#define READ_BUF_SIZE 65536
+#define IDLE_SLEEP_MIN_NS 200000     // 0.2ms
+#define IDLE_SLEEP_MAX_NS 20000000  // 20ms
+
+#define FAIL_IF_WITH_CODE(exp, msg) \
+  if (exp) {                        \
+    perror(msg);                    \
+    exit(EXIT_FAILURE);             \
+  }
+
+#define FAIL_IF(exp, msg) \
+  if (exp) {              \
+    printf(msg);          \
+    printf("\n");         \
+    exit(EXIT_FAILURE);   \
+  }
+
+using namespace std;
+
+volatile sig_atomic_t stop = 0;
+
+void sig_stop(int) {
+  stop = 1;
+}
+
+// Attaches to a running termy's output ring and copies what it sees to stdout. The writer never waits for us, when
+// we cannot keep up we either skip to the live edge or, with --drop, give up.
+int main(int argc, char **argv) {
+  FAIL_IF(argc < 2, "Usage: observe <ring-name> [--drop]");
+
+  RingLagPolicy policy = argc > 2 && strcmp(argv[2], "--drop") == 0 ? RING_LAG_DROP : RING_LAG_SKIP;
+
+  Ring *ring = ring_open(argv[1]);
+  FAIL_IF_WITH_CODE(ring == nullptr, "Error: cannot open ring");
+
+  int slot = ring_join(ring);
+  FAIL_IF_WITH_CODE(slot == -1, "Error: no free reader slot");
+
+  signal(SIGINT, sig_stop);
+  signal(SIGTERM, sig_stop);
+  signal(SIGPIPE, SIG_IGN);  // A closed stdout ends the loop, the slot is still given back.
+
+  char buf[READ_BUF_SIZE];
+  long idle_ns = IDLE_SLEEP_MIN_NS;
+  uint64_t reported_skip = 0;
+  int exit_code = EXIT_SUCCESS;
+
+  while (!stop) {
+    ssize_t read_len = ring_read(ring, slot, buf, READ_BUF_SIZE, policy);
+
+    if (read_len == -1) {
+      if (errno == ENOLINK) {
+        fprintf(stderr, "\r\n[observe: dropped, could not keep up]\r\n");
+        exit_code = EXIT_FAILURE;
+      }
+      break;  // EPIPE: termy is done.
+    }
+
+    uint64_t skipped = ring->header->readers[slot].skipped.load(std::memory_order_relaxed);
+    if (skipped != reported_skip) {
+      fprintf(stderr, "\r\n[observe: skipped %llu bytes]\r\n", (unsigned long long)(skipped - reported_skip));
+      reported_skip = skipped;
+    }
+
+    if (read_len == 0) {
+      // Nothing new. Poll with backoff, waking us up would cost the writer a syscall.
+      struct timespec ts = {0, idle_ns};
+      nanosleep(&ts, nullptr);
+      idle_ns = idle_ns * 2 > IDLE_SLEEP_MAX_NS ? IDLE_SLEEP_MAX_NS : idle_ns * 2;
+      continue;
+    }
+
+    idle_ns = IDLE_SLEEP_MIN_NS;
+    ssize_t written = write(STDOUT_FILENO, buf, read_len);
+    if (written == -1 && errno == EPIPE) break;  // `observe ... | head` has all it wanted.
+    if (written != read_len) {
+      printf("Error: invalid write len to stdout.\n");
+      exit_code = EXIT_FAILURE;
+      break;
+    }
+  }
+
+  ring_leave(ring, slot);
+  ring_close(ring);
+  return exit_code;
+}
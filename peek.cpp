@@ -0,0 +1,70 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "screen.h"
+#include "snapshot.h"
+
+#define FAIL_IF_WITH_CODE(exp, msg) \
+  if (exp) {                        \
+    perror(msg);                    \
+    exit(EXIT_FAILURE);             \
+  }
+
+#define FAIL_IF(exp, msg) \
+  if (exp) {              \
+    printf(msg);          \
+    printf("\n");         \
+    exit(EXIT_FAILURE);   \
+  }
+
+using namespace std;
+
+// Prints what a running termy has on screen right now, without talking to it. In colour on a terminal, as plain text
+// otherwise.
+int main(int argc, char **argv) {
+  FAIL_IF(argc < 2, "Usage: peek <snapshot-name>");
+
+  Snapshot *snap = snapshot_open(argv[1]);
+  FAIL_IF_WITH_CODE(snap == nullptr, "Error: cannot open snapshot");
+
+  SnapshotHeader meta;
+  vector<Cell> cells;
+  vector<Style> styles;
+  FAIL_IF(!snapshot_read(snap, &meta, &cells, &styles), "Error: snapshot kept changing, try again.");
+  bool colour = isatty(STDOUT_FILENO);
+
+  string line;
+  for (uint32_t r = 0; r < meta.rows; r++) {
+    line.clear();
+    size_t end = 0;  // Past the last cell that shows, blanks with a background included.
+    Style last{};
+    bool styled = false;
+    for (uint32_t c = 0; c < meta.cols; c++) {
+      const Cell &cell = cells[(size_t)r * meta.cols + c];
+      const Style &st = colour && cell.style < styles.size() ? styles[cell.style] : last;
+      if (!style_equal(st, last)) {
+        screen_append_sgr(&line, st);
+        last = st;
+        styled = true;
+      }
+      screen_append_utf8(&line, cell.cp);
+      if ((cell.cp != 0 && cell.cp != ' ') || st.bg != COLOR_DEFAULT || st.attrs & ATTR_REVERSE) end = line.size();
+    }
+
+    line.resize(end);
+    if (styled) line.append("\x1b[0m");
+    printf("%s\n", line.c_str());
+  }
+
+  printf("-- %ux%u, cursor %u,%u%s, version %llu\n", meta.cols, meta.rows, meta.cur_row + 1, meta.cur_col + 1,
+         meta.flags & SNAPSHOT_ALT_SCREEN ? ", alternate screen" : "", (unsigned long long)meta.version);
+
+  snapshot_close(snap);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,216 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+// Buffer pool for output that has to outlive the loop iteration that read it. Memory comes in slabs of fixed-size
+// chunks, and a chunk is carved up arena style: `pool_reserve` hands out the free tail of the chunk being filled, a
+// `read()` lands there directly, and `pool_commit` turns the bytes it got into a reference counted `BufRef`. Sinks
+// that keep a chunk take a reference instead of a copy, the chunk goes back to the free list when the last one is
+// dropped.
+//
+// A new slab is only allocated when every chunk is taken. Once the pool has grown to the working set the hot path
+// does no malloc at all, `pool_stats` shows whether it got there.
+//
+// Not thread safe: the pool and every reference into it belong to one thread.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#define POOL_CHUNK_SIZE (256 * 1024)
+#define POOL_SLAB_CHUNKS 16
+
+struct PoolChunk {
+  PoolChunk *next_free;
+  char *data;
+  uint32_t refs;
+  uint32_t fill;  // Bytes handed out so far, only meaningful while the chunk is being filled.
+};
+
+struct BufRef {
+  PoolChunk *chunk;
+  char *data;
+  uint32_t len;
+};
+
+struct BufferPool {
+  size_t chunk_size;
+  PoolChunk *free_list;
+  PoolChunk *filling;  // Where `pool_reserve` carves from, the pool holds one reference on it.
+  std::vector<void *> slabs;
+
+  // Occupancy.
+  size_t chunks_total;
+  size_t chunks_in_use;
+  size_t chunks_peak;
+  size_t slab_grows;  // Slabs allocated after `pool_init`, each one was a malloc on the hot path.
+};
+
+// Adds one slab of free chunks. Returns false when out of memory.
+static inline bool pool_grow(BufferPool *p, size_t n_chunks) {
+  char *slab = (char *)malloc(n_chunks * (sizeof(PoolChunk) + p->chunk_size));
+  if (slab == nullptr) return false;
+
+  PoolChunk *chunks = (PoolChunk *)slab;
+  char *data = slab + n_chunks * sizeof(PoolChunk);
+  for (size_t i = 0; i < n_chunks; i++) {
+    chunks[i].data = data + i * p->chunk_size;
+    chunks[i].refs = 0;
+    chunks[i].fill = 0;
+    chunks[i].next_free = p->free_list;
+    p->free_list = &chunks[i];
+  }
+
+  p->slabs.push_back(slab);
+  p->chunks_total += n_chunks;
+  return true;
+}
+
+static inline bool pool_init(BufferPool *p, size_t chunk_size, size_t initial_chunks) {
+  p->chunk_size = chunk_size;
+  p->free_list = nullptr;
+  p->filling = nullptr;
+  p->chunks_total = 0;
+  p->chunks_in_use = 0;
+  p->chunks_peak = 0;
+  p->slab_grows = 0;
+  return pool_grow(p, initial_chunks);
+}
+
+// Every reference must have been dropped.
+static inline void pool_free(BufferPool *p) {
+  for (void *slab : p->slabs) free(slab);
+  p->slabs.clear();
+  p->free_list = nullptr;
+  p->filling = nullptr;
+}
+
+static inline void buf_ref(BufRef *ref) {
+  ref->chunk->refs++;
+}
+
+static inline void pool_release_chunk(BufferPool *p, PoolChunk *chunk) {
+  if (--chunk->refs > 0) return;
+
+  chunk->next_free = p->free_list;
+  p->free_list = chunk;
+  p->chunks_in_use--;
+}
+
+static inline void buf_unref(BufferPool *p, BufRef *ref) {
+  pool_release_chunk(p, ref->chunk);
+  ref->chunk = nullptr;
+}
+
+// At least `min_len` writable bytes, `*avail` gets how many there are. Nothing is handed out until `pool_commit`, the
+// next reserve returns the same bytes again. Returns nullptr when out of memory.
+static inline char *pool_reserve(BufferPool *p, size_t min_len, size_t *avail) {
+  PoolChunk *chunk = p->filling;
+
+  // Nobody else holds on to the chunk anymore, start over at its beginning while it is still hot in the cache.
+  if (chunk != nullptr && chunk->refs == 1) chunk->fill = 0;
+
+  if (chunk == nullptr || p->chunk_size - chunk->fill < min_len) {
+    if (p->free_list == nullptr) {
+      if (!pool_grow(p, POOL_SLAB_CHUNKS)) return nullptr;
+      p->slab_grows++;
+    }
+
+    if (chunk != nullptr) pool_release_chunk(p, chunk);
+    chunk = p->free_list;
+    p->free_list = chunk->next_free;
+    chunk->refs = 1;
+    chunk->fill = 0;
+    p->filling = chunk;
+
+    p->chunks_in_use++;
+    if (p->chunks_in_use > p->chunks_peak) p->chunks_peak = p->chunks_in_use;
+  }
+
+  *avail = p->chunk_size - chunk->fill;
+  return chunk->data + chunk->fill;
+}
+
+// The first `len` bytes of the last reserve, with one reference for the caller.
+static inline BufRef pool_commit(BufferPool *p, size_t len) {
+  PoolChunk *chunk = p->filling;
+  BufRef ref = {chunk, chunk->data + chunk->fill, (uint32_t)len};
+  chunk->fill += len;
+  chunk->refs++;
+  return ref;
+}
+
+static inline int pool_stats(const BufferPool *p, char *buf, size_t buf_len) {
+  return snprintf(buf, buf_len, "pool: %zu/%zu chunks of %zu KiB in use, peak %zu, grew %zu times\n",
+                  p->chunks_in_use, p->chunks_total, p->chunk_size / 1024, p->chunks_peak, p->slab_grows);
+}
+
+// FIFO of references, e.g. a socket backlog. The ring of slots only grows, a queue that reached its working size
+// stays allocation free.
+struct BufQueue {
+  BufRef *items;
+  size_t cap;  // Power of two.
+  size_t head;
+  size_t count;
+  size_t bytes;  // Not yet sent, `sent` already subtracted.
+  size_t sent;   // Of the front reference.
+};
+
+static inline void buf_queue_init(BufQueue *q) {
+  q->items = nullptr;
+  q->cap = 0;
+  q->head = 0;
+  q->count = 0;
+  q->bytes = 0;
+  q->sent = 0;
+}
+
+// Takes over the caller's reference.
+static inline void buf_queue_push(BufQueue *q, BufRef ref) {
+  if (q->count == q->cap) {
+    size_t new_cap = q->cap == 0 ? 16 : 2 * q->cap;
+    BufRef *items = (BufRef *)malloc(new_cap * sizeof(BufRef));
+    if (items == nullptr) abort();
+    for (size_t i = 0; i < q->count; i++) items[i] = q->items[(q->head + i) & (q->cap - 1)];
+    free(q->items);
+    q->items = items;
+    q->cap = new_cap;
+    q->head = 0;
+  }
+
+  q->items[(q->head + q->count) & (q->cap - 1)] = ref;
+  q->count++;
+  q->bytes += ref.len;
+}
+
+static inline BufRef *buf_queue_at(BufQueue *q, size_t i) {
+  return &q->items[(q->head + i) & (q->cap - 1)];
+}
+
+// Marks `len` bytes from the front as sent, dropping the references that are done.
+static inline void buf_queue_consume(BufferPool *p, BufQueue *q, size_t len) {
+  q->bytes -= len;
+  len += q->sent;
+  while (q->count > 0 && len >= q->items[q->head].len) {
+    len -= q->items[q->head].len;
+    buf_unref(p, &q->items[q->head]);
+    q->head = (q->head + 1) & (q->cap - 1);
+    q->count--;
+  }
+  q->sent = len;
+}
+
+static inline void buf_queue_free(BufferPool *p, BufQueue *q) {
+  while (q->count > 0) {
+    buf_unref(p, &q->items[q->head]);
+    q->head = (q->head + 1) & (q->cap - 1);
+    q->count--;
+  }
+  free(q->items);
+  buf_queue_init(q);
+}
+
+#endif  // POOL_H_
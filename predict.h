@@ -0,0 +1,157 @@
+#ifndef PREDICT_H_
+#define PREDICT_H_
+
+// Predictive local echo, after mosh. A printable key is guessed to echo at the cursor; the guess is drawn right away,
+// underlined, and confirmed or rolled back once the program's real output shows up in the screen model.
+//
+// Guesses are only drawn once echo has been seen to work: the first epoch is tentative and becomes visible when one of
+// its guesses is confirmed. A guess that was not echoed in time (vim's `j`, a shell busy with something else) rolls
+// back everything pending and starts a new tentative epoch. Nothing is drawn while the
+// real echo is faster than PREDICT_SHOW_MS anyway, and nothing is guessed while the slave has echo off in canonical
+// mode (password prompts) or the alternate screen is up (full-screen TUIs).
+
+#include <termios.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "screen.h"
+
+#define PREDICT_SHOW_MS 20.0          // Echo latency from which guesses are drawn.
+#define PREDICT_MIN_TIMEOUT_MS 250.0  // A guess gets at least this long to be echoed, or 4 round-trips if longer.
+#define PREDICT_TICK_MS 50            // How often pending guesses are checked while no output arrives.
+
+struct Guess {
+  int row;
+  int col;
+  uint32_t cp;
+  double sent_ms;
+};
+
+struct Predictor {
+  std::vector<Guess> pending;
+  int row;  // Where the next guess goes.
+  int col;
+  bool stalled;    // A key that was not guessed went out, no more guesses until output shows where it led.
+  bool confirmed;  // Echo worked in this epoch, its guesses are drawn.
+  double srtt_ms;  // Smoothed echo latency.
+};
+
+static inline double predict_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static inline void predict_init(Predictor *p) {
+  p->pending.clear();
+  p->stalled = false;
+  p->confirmed = false;
+  p->srtt_ms = 0;
+}
+
+static inline bool predict_visible(const Predictor *p) {
+  return p->confirmed && p->srtt_ms >= PREDICT_SHOW_MS && !p->pending.empty();
+}
+
+// Drops every pending guess, the rows they were drawn on are repainted from the model.
+static inline void predict_rollback(Predictor *p, Screen *s) {
+  for (const Guess &g : p->pending) {
+    if (g.row < s->rows) screen_mark_dirty(s, g.row, g.row);
+  }
+  p->pending.clear();
+  p->stalled = false;
+  p->confirmed = false;
+}
+
+// Whether guessing makes sense for what runs on the slave right now. On Linux the master reports the slave's termios.
+static inline bool predict_enabled(const Screen *s, int master_fd) {
+  if (s->alt_active) return false;
+
+  struct termios tio;
+  if (tcgetattr(master_fd, &tio) == -1) return false;
+  return (tio.c_lflag & ECHO) != 0 || (tio.c_lflag & ICANON) == 0;  // Raw mode: readline echoes itself.
+}
+
+// Guesses the echo of keys about to be written to the slave.
+static inline void predict_keys(Predictor *p, Screen *s, int master_fd, const char *buf, size_t len) {
+  if (!predict_enabled(s, master_fd)) {
+    predict_rollback(p, s);
+    return;
+  }
+
+  double now = predict_now_ms();
+  for (size_t i = 0; i < len; i++) {
+    uint8_t b = (uint8_t)buf[i];
+
+    if (p->pending.empty() && !p->stalled) {
+      p->row = s->cur_row;
+      p->col = s->cur_col;
+    }
+
+    if (b == 0x1b) {  // An escape sequence moves who knows where, the rest of the read is part of it.
+      p->stalled = true;
+      return;
+    }
+
+    if ((b == 0x7f || b == '\b') && !p->stalled && !p->pending.empty()) {
+      Guess &last = p->pending.back();
+      screen_mark_dirty(s, last.row, last.row);
+      p->col = last.col;
+      p->pending.pop_back();
+      continue;
+    }
+
+    if (b < 0x20 || b >= 0x7f) {  // Enter, a control key or UTF-8: not guessed.
+      p->stalled = true;
+      continue;
+    }
+
+    if (p->stalled || p->col >= s->cols - 1) continue;  // No guessing across the wrap.
+    p->pending.push_back(Guess{p->row, p->col, b, now});
+    p->col++;
+  }
+}
+
+// Settles guesses against the model, after every output of the pane and on PREDICT_TICK_MS while any are pending. A
+// guess is confirmed once its cell holds the key and the real cursor has moved past it.
+static inline void predict_check(Predictor *p, Screen *s, double now) {
+  double timeout = 4 * p->srtt_ms > PREDICT_MIN_TIMEOUT_MS ? 4 * p->srtt_ms : PREDICT_MIN_TIMEOUT_MS;
+
+  size_t kept = 0;
+  for (size_t i = 0; i < p->pending.size(); i++) {
+    const Guess &g = p->pending[i];
+    bool past = s->cur_row > g.row || (s->cur_row == g.row && s->cur_col > g.col);
+    if (g.row < s->rows && g.col < s->cols && screen_row(s, g.row)[g.col].cp == g.cp && past) {
+      double sample = now - g.sent_ms;
+      p->srtt_ms = p->srtt_ms == 0 ? sample : (7 * p->srtt_ms + sample) / 8;
+      p->confirmed = true;
+      screen_mark_dirty(s, g.row, g.row);
+      continue;
+    }
+
+    if (now - g.sent_ms > timeout) {
+      predict_rollback(p, s);
+      return;
+    }
+    p->pending[kept++] = g;
+  }
+  p->pending.resize(kept);
+  if (kept == 0) p->stalled = false;
+}
+
+// Draws the pending guesses of a pane whose content starts at (`top`, `left`) of the outer terminal, 0-based.
+static inline void predict_render(const Predictor *p, int top, int left, std::string *out) {
+  if (!predict_visible(p)) return;
+
+  char buf[32];
+  for (const Guess &g : p->pending) {
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH\x1b[0;4m", top + g.row + 1, left + g.col + 1);
+    out->append(buf, len);
+    screen_append_utf8(out, g.cp);
+  }
+  out->append("\x1b[0m");
+}
+
+#endif  // PREDICT_H_
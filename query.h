@@ -0,0 +1,226 @@
+#ifndef QUERY_H_
+#define QUERY_H_
+
+// Terminal queries termy answers itself instead of asking the real terminal: status and cursor position reports
+// (DSR), primary and secondary device attributes (DA), the text area size (XTWINOPS 18 and 19) and, once the default
+// colours are known, OSC 10/11. The screen model has everything the answers need, see `Screen::replies`, and over SSH
+// every query that does not leave the host saves a round-trip.
+//
+// Where the raw output also goes on to a terminal, that terminal would answer a second time. `query_filter` cuts the
+// queries the model answers out of that stream. A query split across two reads is held back until it is complete; a
+// held back sequence that turns out to be something else comes out again in front of the next chunk.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define QUERY_MAX_LEN 16  // No query is longer, `ESC ] 1 1 ; ? ESC \` is 8 bytes.
+#define QUERY_OSC_MAX 4   // "10;?" and "11;?".
+#define QUERY_REPLY_BACKLOG 4096  // Reply bytes held for a child that does not read, later replies are dropped.
+
+enum QueryKind {
+  QUERY_NONE,
+  QUERY_STATUS,       // CSI 5 n
+  QUERY_CURSOR,       // CSI 6 n
+  QUERY_CURSOR_DEC,   // CSI ? 6 n
+  QUERY_DA1,          // CSI c
+  QUERY_DA2,          // CSI > c
+  QUERY_TEXT_SIZE,    // CSI 18 t
+  QUERY_SCREEN_SIZE,  // CSI 19 t
+};
+
+// Which query a CSI without intermediates is, from its private marker, parameters and final byte.
+static inline QueryKind query_csi_kind(char marker, int n_params, int p0, uint8_t final) {
+  if (n_params > 1) return QUERY_NONE;
+
+  switch (final) {
+    case 'n':
+      if (marker == 0 && p0 == 5) return QUERY_STATUS;
+      if (marker == 0 && p0 == 6) return QUERY_CURSOR;
+      if (marker == '?' && p0 == 6) return QUERY_CURSOR_DEC;
+      break;
+    case 'c':
+      if (p0 != 0) break;
+      if (marker == 0) return QUERY_DA1;
+      if (marker == '>') return QUERY_DA2;
+      break;
+    case 't':
+      if (marker == 0 && p0 == 18) return QUERY_TEXT_SIZE;
+      if (marker == 0 && p0 == 19) return QUERY_SCREEN_SIZE;
+      break;
+  }
+  return QUERY_NONE;
+}
+
+// 10 or 11 for a default foreground or background colour query, 0 for any other OSC payload.
+static inline int query_osc_color(const char *payload, size_t len) {
+  if (len != 4 || payload[0] != '1' || payload[2] != ';' || payload[3] != '?') return 0;
+  if (payload[1] == '0') return 10;
+  if (payload[1] == '1') return 11;
+  return 0;
+}
+
+// Parses an X11 colour spec as terminals report it, `rgb:R/G/B` with 1 to 4 hex digits per channel, into 0xRRGGBB.
+static inline bool query_parse_color(const char *spec, uint32_t *rgb) {
+  if (strncmp(spec, "rgb:", 4) != 0) return false;
+  spec += 4;
+
+  uint32_t color = 0;
+  for (int i = 0; i < 3; i++) {
+    char *end;
+    unsigned long v = strtoul(spec, &end, 16);
+    int digits = (int)(end - spec);
+    if (digits < 1 || digits > 4 || (i < 2 && *end != '/')) return false;
+
+    unsigned long max = (1ul << (4 * digits)) - 1;
+    color = color << 8 | (uint32_t)((v * 255 + max / 2) / max);
+    spec = end + 1;
+  }
+
+  *rgb = color;
+  return true;
+}
+
+enum QueryFilterState {
+  QUERY_FILTER_GROUND,
+  QUERY_FILTER_ESCAPE,
+  QUERY_FILTER_CSI,
+  QUERY_FILTER_OSC,
+  QUERY_FILTER_OSC_ESC,
+};
+
+enum QueryVerdict { QUERY_MORE, QUERY_MATCH, QUERY_MISS };
+
+struct QueryFilter {
+  bool colors;  // Also cut OSC 10/11, only when the model knows the default colours.
+
+  QueryFilterState state;
+  size_t seq_len;  // Bytes of the candidate sequence so far.
+  char marker;
+  int n_params;
+  int p0;
+  char osc[QUERY_OSC_MAX];
+  size_t osc_len;
+
+  char held[QUERY_MAX_LEN];  // Start of a candidate the previous chunk ended in.
+  size_t held_len;
+  char released[QUERY_MAX_LEN];  // Held bytes that were no query after all, they go out before the chunk.
+  size_t released_len;
+};
+
+static inline void query_filter_init(QueryFilter *f, bool colors) {
+  f->colors = colors;
+  f->state = QUERY_FILTER_GROUND;
+  f->held_len = 0;
+  f->released_len = 0;
+}
+
+static inline QueryVerdict query_filter_step(QueryFilter *f, uint8_t b) {
+  if (++f->seq_len >= QUERY_MAX_LEN) return QUERY_MISS;
+
+  switch (f->state) {
+    case QUERY_FILTER_ESCAPE:
+      if (b == '[') {
+        f->state = QUERY_FILTER_CSI;
+        f->marker = 0;
+        f->n_params = 0;
+        f->p0 = 0;
+        return QUERY_MORE;
+      }
+      if (b == ']' && f->colors) {
+        f->state = QUERY_FILTER_OSC;
+        f->osc_len = 0;
+        return QUERY_MORE;
+      }
+      return QUERY_MISS;
+
+    case QUERY_FILTER_CSI:
+      if (b >= '0' && b <= '9') {
+        f->n_params = 1;
+        if (f->p0 < 100000) f->p0 = f->p0 * 10 + (b - '0');
+        return QUERY_MORE;
+      }
+      if ((b == '?' || b == '>') && f->seq_len == 3) {
+        f->marker = b;
+        return QUERY_MORE;
+      }
+      if (b >= 0x40 && b <= 0x7e) {
+        return query_csi_kind(f->marker, f->n_params, f->p0, b) != QUERY_NONE ? QUERY_MATCH : QUERY_MISS;
+      }
+      return QUERY_MISS;  // A second parameter, an intermediate or a control: none of ours.
+
+    case QUERY_FILTER_OSC:
+      if (b == 0x07) return query_osc_color(f->osc, f->osc_len) != 0 ? QUERY_MATCH : QUERY_MISS;
+      if (b == 0x1b) {
+        f->state = QUERY_FILTER_OSC_ESC;
+        return QUERY_MORE;
+      }
+      if (f->osc_len == QUERY_OSC_MAX) return QUERY_MISS;
+      f->osc[f->osc_len++] = (char)b;
+      return QUERY_MORE;
+
+    case QUERY_FILTER_OSC_ESC:
+      return b == '\\' && query_osc_color(f->osc, f->osc_len) != 0 ? QUERY_MATCH : QUERY_MISS;
+
+    case QUERY_FILTER_GROUND:
+      break;
+  }
+  return QUERY_MISS;
+}
+
+// Copies `len` bytes from `in` to `out` without the queries in them and returns how many that left. `out` may be
+// `in`. Afterwards `released` holds what has to be written before `out`, usually nothing.
+static inline size_t query_filter(QueryFilter *f, const char *in, size_t len, char *out) {
+  f->released_len = 0;
+  size_t n = 0;
+  size_t start = 0;  // Where the candidate begins in `out`, a candidate carried over from the last chunk begins at 0.
+
+  size_t i = 0;
+  while (i < len) {
+    if (f->state == QUERY_FILTER_GROUND) {
+      const char *esc = (const char *)memchr(in + i, 0x1b, len - i);
+      size_t run = esc == nullptr ? len - i : (size_t)(esc - (in + i));
+      if (out + n != in + i) memmove(out + n, in + i, run);
+      n += run;
+      i += run;
+      if (esc == nullptr) break;
+
+      start = n;
+      out[n++] = 0x1b;
+      i++;
+      f->state = QUERY_FILTER_ESCAPE;
+      f->seq_len = 1;
+      continue;
+    }
+
+    uint8_t b = (uint8_t)in[i++];
+    out[n++] = (char)b;
+    QueryVerdict verdict = query_filter_step(f, b);
+    if (verdict == QUERY_MORE) continue;
+
+    if (verdict == QUERY_MATCH) {
+      n = start;
+    } else if (f->held_len > 0) {
+      memcpy(f->released, f->held, f->held_len);
+      f->released_len = f->held_len;
+    }
+    f->held_len = 0;
+    f->state = QUERY_FILTER_GROUND;
+
+    if (verdict == QUERY_MISS && b == 0x1b) {  // The sequence was cut short by the start of the next one.
+      start = n - 1;
+      f->state = QUERY_FILTER_ESCAPE;
+      f->seq_len = 1;
+    }
+  }
+
+  if (f->state != QUERY_FILTER_GROUND) {
+    memcpy(f->held + f->held_len, out + start, n - start);
+    f->held_len += n - start;
+    n = start;
+  }
+  return n;
+}
+
+#endif  // QUERY_H_
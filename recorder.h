@@ -0,0 +1,514 @@
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+// Segmented recording: output-PID-START.000000, output-PID-START.000001, ... each capped by size and optionally by
+// age, with the oldest ones deleted once there are too many or they take too much space. PID and START (seconds since
+// the epoch) make the names the session's own, several sessions can record next to each other under one base.
+// Retention counts what finished sessions left under the base along with this session's segments, so recordings
+// outlive the run that made them until newer ones push them out. Sessions still running keep their own.
+// Segments are preallocated with fallocate so a long session gets a few large extents instead of thousands of small
+// ones.
+//
+// Everything that touches the filesystem besides write() runs on a helper thread: it opens and preallocates the next
+// segment ahead of time, and trims, closes and deletes the old ones. Rotating from the relay loop is a pointer swap
+// under a lock nobody holds across a syscall. If the next segment is not ready yet the current one just keeps
+// growing past its cap for a moment.
+//
+// With timing on, every segment is a typescript `scriptreplay` can play on its own: it opens with the usual header
+// line and comes with a `.timing` file of "delay bytes" lines. The caller passes one timestamp per chunk, the timing
+// lines are buffered and written at most about once a second. The header is written along with a segment's first
+// chunk, so its time is when that chunk came in and not when the helper happened to prepare the file; it also names
+// the session, the recording process's pid.
+//
+// With indexing on as well, the helper builds a segment's search index (search.h) once the segment is closed.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "search.h"
+
+#define RECORDER_PATH_MAX 512
+#define RECORDER_BASE_MAX (RECORDER_PATH_MAX - 32)  // Leaves room for the segment suffixes.
+#define RECORDER_SESSION_FMT "%s-%d-%llu"          // Base, pid, start.
+#define RECORDER_SEGMENT_FMT "%s.%06u"
+#define RECORDER_TIMING_FMT "%s.%06u.timing"
+#define RECORDER_TIMING_BUF_SIZE 4096
+#define RECORDER_TIMING_LINE_MAX 48
+#define RECORDER_TIMING_FLUSH_SECS 1.0
+#define RECORDER_DEFAULT_SEGMENT_BYTES (64ull << 20)
+#define RECORDER_DEFAULT_SEGMENT_SECS 0  // No age cap.
+#define RECORDER_DEFAULT_KEEP_SEGMENTS 16
+#define RECORDER_DEFAULT_KEEP_BYTES (1ull << 30)
+
+struct RecorderConfig {
+  const char *base;        // Segment files are `base`-PID-START.NNNNNN.
+  uint64_t segment_bytes;  // Rotate after this much, also the preallocation size.
+  int segment_secs;        // Rotate after this long, 0 for never.
+  int keep_segments;       // Closed segments kept under the base, 0 for no limit.
+  uint64_t keep_bytes;     // Bytes of closed segments kept under the base, 0 for no limit.
+  bool timing;             // Header line and `.timing` side file per segment.
+  bool index;              // Search index per closed segment, needs timing for the line times.
+};
+
+struct RecorderSegment {
+  int fd;
+  int timing_fd;  // -1 without timing.
+  unsigned index;
+  uint64_t written;  // Header included, 0 until the first chunk.
+};
+
+// A closed segment retention counts, this session's or one a finished session left under the same base.
+struct RecorderClosed {
+  char base[RECORDER_BASE_MAX];
+  unsigned long long start;  // The session's, orders the sessions.
+  int pid;
+  unsigned index;
+  uint64_t bytes;
+};
+
+struct Recorder {
+  RecorderConfig config;
+  char base[RECORDER_BASE_MAX];  // This session's, the configured base with the pid and start time.
+
+  // Relay thread only.
+  RecorderSegment current;
+  time_t current_opened;
+  double last_event;  // Timestamp of the last chunk, the next delay counts from here.
+  double last_timing_flush;
+  char timing_buf[RECORDER_TIMING_BUF_SIZE];
+  size_t timing_len;
+
+  // Shared with the helper thread, under `lock`.
+  std::mutex lock;
+  std::condition_variable wake;
+  RecorderSegment next;
+  bool next_ready;
+  std::vector<RecorderSegment> retiring;
+  bool stopping;
+  int error;  // First failure on the helper thread, errno value.
+
+  // Helper thread only.
+  unsigned next_index;
+  std::deque<RecorderClosed> closed;  // Oldest first.
+  uint64_t closed_bytes;
+
+  std::thread helper;
+};
+
+// Defaults, overridden by $TERMY_SEGMENT_BYTES, $TERMY_SEGMENT_SECS, $TERMY_KEEP_SEGMENTS, $TERMY_KEEP_BYTES and
+// $TERMY_INDEX.
+static inline void recorder_config_from_env(RecorderConfig *c, const char *base) {
+  c->base = base;
+  c->timing = true;
+  c->index = false;
+  c->segment_bytes = RECORDER_DEFAULT_SEGMENT_BYTES;
+  c->segment_secs = RECORDER_DEFAULT_SEGMENT_SECS;
+  c->keep_segments = RECORDER_DEFAULT_KEEP_SEGMENTS;
+  c->keep_bytes = RECORDER_DEFAULT_KEEP_BYTES;
+
+  const char *v;
+  if ((v = getenv("TERMY_SEGMENT_BYTES")) != nullptr && strtoull(v, nullptr, 10) > 0) {
+    c->segment_bytes = strtoull(v, nullptr, 10);
+  }
+  if ((v = getenv("TERMY_SEGMENT_SECS")) != nullptr) c->segment_secs = atoi(v);
+  if ((v = getenv("TERMY_KEEP_SEGMENTS")) != nullptr) c->keep_segments = atoi(v);
+  if ((v = getenv("TERMY_KEEP_BYTES")) != nullptr) c->keep_bytes = strtoull(v, nullptr, 10);
+  if ((v = getenv("TERMY_INDEX")) != nullptr) c->index = atoi(v) != 0;
+}
+
+static inline void recorder_segment_path(const Recorder *rec, unsigned index, char *path) {
+  snprintf(path, RECORDER_PATH_MAX, RECORDER_SEGMENT_FMT, rec->base, index);
+}
+
+static inline void recorder_timing_path(const Recorder *rec, unsigned index, char *path) {
+  snprintf(path, RECORDER_PATH_MAX, RECORDER_TIMING_FMT, rec->base, index);
+}
+
+// `base` is this session's or an earlier one's, whose timing was not necessarily configured like this one's.
+static inline void recorder_unlink_segment(const char *base, unsigned index) {
+  char path[RECORDER_PATH_MAX];
+  char index_path[RECORDER_PATH_MAX + 8];
+  snprintf(path, sizeof(path), RECORDER_SEGMENT_FMT, base, index);
+  unlink(path);
+  snprintf(index_path, sizeof(index_path), SEARCH_INDEX_FMT, path);
+  unlink(index_path);  // Built by the helper or by `index build`, either way it goes with the segment.
+  snprintf(path, sizeof(path), RECORDER_TIMING_FMT, base, index);
+  unlink(path);
+}
+
+static inline time_t recorder_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+// Returns false with errno set.
+static inline bool recorder_open_segment(Recorder *rec, unsigned index, RecorderSegment *seg) {
+  char path[RECORDER_PATH_MAX];
+  recorder_segment_path(rec, index, path);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  if (fd == -1) return false;
+
+  // KEEP_SIZE reserves the extents without moving EOF, readers only ever see what was written. Not every filesystem
+  // can do it, recording works without.
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, rec->config.segment_bytes) == -1 && errno != EOPNOTSUPP &&
+      errno != ENOSYS) {
+    int prev_errno = errno;
+    close(fd);
+    errno = prev_errno;
+    return false;
+  }
+
+  seg->fd = fd;
+  seg->timing_fd = -1;
+  seg->index = index;
+  seg->written = 0;
+
+  if (rec->config.timing) {
+    recorder_timing_path(rec, index, path);
+    seg->timing_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                          S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (seg->timing_fd == -1) {
+      int prev_errno = errno;
+      close(fd);
+      errno = prev_errno;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// scriptreplay skips the first line of the typescript, search.h reads the session and start time from it. Relay
+// thread, right before the segment's first chunk. Returns false with errno set.
+static inline bool recorder_write_header(Recorder *rec) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  struct tm tm;
+  char header[160];
+  size_t len = strftime(header, sizeof(header), "Script started on %Y-%m-%d %H:%M:%S%z", localtime_r(&ts.tv_sec, &tm));
+  len += snprintf(header + len, sizeof(header) - len, " [termy session=%d start=%llu]\n", (int)getpid(),
+                  (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+
+  for (size_t done = 0; done < len;) {
+    ssize_t written = write(rec->current.fd, header + done, len - done);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    done += written;
+  }
+  rec->current.written = len;
+  return true;
+}
+
+// Matches a file of some session recording under `name`: name-PID-START.NNNNNN, optionally with a suffix. Returns
+// the suffix ("" for the segment itself) and sets the session's pid, the length of its base and the segment index,
+// or returns nullptr.
+static inline const char *recorder_match_file(const char *file, const char *name, int *pid, size_t *base_len,
+                                              unsigned *index) {
+  size_t name_len = strlen(name);
+  if (strncmp(file, name, name_len) != 0 || file[name_len] != '-') return nullptr;
+
+  const char *p = file + name_len + 1;
+  size_t digits = strspn(p, "0123456789");
+  if (digits == 0 || p[digits] != '-') return nullptr;
+  *pid = atoi(p);
+  p += digits + 1;
+  digits = strspn(p, "0123456789");
+  if (digits == 0 || p[digits] != '.') return nullptr;
+  p += digits;
+
+  if (strspn(p + 1, "0123456789") != 6) return nullptr;
+  *base_len = p - file;
+  *index = (unsigned)strtoul(p + 1, nullptr, 10);
+  return p + 7;
+}
+
+// Deletes the oldest closed segments, earlier sessions' first, until the configured counts are met. Helper thread.
+static inline void recorder_trim(Recorder *rec) {
+  const RecorderConfig &c = rec->config;
+  while (!rec->closed.empty() && ((c.keep_segments > 0 && rec->closed.size() > (size_t)c.keep_segments) ||
+                                  (c.keep_bytes > 0 && rec->closed_bytes > c.keep_bytes))) {
+    recorder_unlink_segment(rec->closed.front().base, rec->closed.front().index);
+    rec->closed_bytes -= rec->closed.front().bytes;
+    rec->closed.pop_front();
+  }
+}
+
+// Puts the segments sessions that are no longer running left under the same base ahead of this session's, oldest
+// first. A running session's files, whichever process records them, are left to that session. Helper thread.
+static inline void recorder_find_earlier(Recorder *rec) {
+  char dir[RECORDER_PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", rec->config.base);
+  char *slash = strrchr(dir, '/');
+  const char *name = slash != nullptr ? slash + 1 : dir;
+  if (slash != nullptr) *slash = '\0';
+  const char *dir_path = slash != nullptr ? (dir[0] != '\0' ? dir : "/") : ".";
+
+  DIR *d = opendir(dir_path);
+  if (d == nullptr) return;
+
+  std::vector<RecorderClosed> earlier;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != nullptr) {
+    RecorderClosed seg;
+    size_t base_len;
+    const char *suffix = recorder_match_file(entry->d_name, name, &seg.pid, &base_len, &seg.index);
+    if (suffix == nullptr || suffix[0] != '\0') continue;  // The side files go along with their segment.
+    if (seg.pid == getpid() || kill(seg.pid, 0) == 0 || errno != ESRCH) continue;  // EPERM: running as someone else.
+
+    struct stat st;
+    if (fstatat(dirfd(d), entry->d_name, &st, 0) == -1) continue;
+    seg.bytes = st.st_size;
+
+    int len = snprintf(seg.base, sizeof(seg.base), "%s%s%.*s", slash != nullptr ? dir : "",
+                       slash != nullptr ? "/" : "", (int)base_len, entry->d_name);
+    if (len >= (int)sizeof(seg.base)) continue;  // Not one this recorder could have written.
+    seg.start = strtoull(strrchr(seg.base, '-') + 1, nullptr, 10);
+    earlier.push_back(seg);
+  }
+  closedir(d);
+
+  std::sort(earlier.begin(), earlier.end(), [](const RecorderClosed &a, const RecorderClosed &b) {
+    if (a.start != b.start) return a.start < b.start;
+    if (a.pid != b.pid) return a.pid < b.pid;
+    return a.index < b.index;
+  });
+  for (const RecorderClosed &seg : earlier) {
+    rec->closed.push_back(seg);
+    rec->closed_bytes += seg.bytes;
+  }
+}
+
+// Releases the unused part of the preallocation, then applies retention. Helper thread.
+static inline void recorder_retire(Recorder *rec, RecorderSegment seg) {
+  if (ftruncate(seg.fd, seg.written) == -1 && rec->error == 0) rec->error = errno;
+  close(seg.fd);
+  if (seg.timing_fd != -1) close(seg.timing_fd);
+
+  // The relay keeps going into the next segment meanwhile. A failed index only costs `index build` a segment more.
+  if (rec->config.index && seg.written > 0) {
+    char path[RECORDER_PATH_MAX];
+    char timing_path[RECORDER_PATH_MAX];
+    char index_path[RECORDER_PATH_MAX + 8];
+    recorder_segment_path(rec, seg.index, path);
+    recorder_timing_path(rec, seg.index, timing_path);
+    snprintf(index_path, sizeof(index_path), SEARCH_INDEX_FMT, path);
+    search_index_build(path, rec->config.timing ? timing_path : nullptr, index_path);
+  }
+
+  RecorderClosed closed;
+  snprintf(closed.base, sizeof(closed.base), "%s", rec->base);
+  closed.start = 0;  // Unused for this session's, they are always the newest.
+  closed.pid = getpid();
+  closed.index = seg.index;
+  closed.bytes = seg.written;
+  rec->closed.push_back(closed);
+  rec->closed_bytes += seg.written;
+  recorder_trim(rec);
+}
+
+static inline void recorder_helper(Recorder *rec) {
+  recorder_find_earlier(rec);
+  recorder_trim(rec);
+
+  std::unique_lock<std::mutex> guard(rec->lock);
+
+  for (;;) {
+    rec->wake.wait(guard, [rec] { return rec->stopping || !rec->next_ready || !rec->retiring.empty(); });
+
+    std::vector<RecorderSegment> retiring;
+    retiring.swap(rec->retiring);
+    bool prepare = !rec->next_ready && !rec->stopping;
+    bool stopping = rec->stopping;
+
+    guard.unlock();
+
+    for (const RecorderSegment &seg : retiring) recorder_retire(rec, seg);
+
+    RecorderSegment next;
+    bool prepared = prepare && recorder_open_segment(rec, rec->next_index, &next);
+    int prepare_errno = errno;
+
+    guard.lock();
+
+    if (prepared) {
+      rec->next = next;
+      rec->next_ready = true;
+      rec->next_index++;
+    } else if (prepare && rec->error == 0) {
+      rec->error = prepare_errno;
+    }
+
+    if (stopping && rec->retiring.empty()) return;
+
+    // A failed open is retried on the next rotation instead of spinning.
+    if (prepare && !prepared) {
+      rec->wake.wait(guard, [rec] { return rec->stopping || !rec->retiring.empty(); });
+    }
+  }
+}
+
+// Returns nullptr with errno set.
+static inline Recorder *recorder_open(const RecorderConfig *config) {
+  Recorder *rec = new Recorder();
+  rec->config = *config;
+  rec->next_ready = false;
+  rec->stopping = false;
+  rec->error = 0;
+  rec->closed_bytes = 0;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  snprintf(rec->base, sizeof(rec->base), RECORDER_SESSION_FMT, config->base, (int)getpid(),
+           (unsigned long long)ts.tv_sec);
+
+  if (!recorder_open_segment(rec, 0, &rec->current)) {
+    int prev_errno = errno;
+    delete rec;
+    errno = prev_errno;
+    return nullptr;
+  }
+  rec->current_opened = recorder_now();
+  rec->last_event = 0;
+  rec->last_timing_flush = 0;
+  rec->timing_len = 0;
+  rec->next_index = 1;
+
+  rec->helper = std::thread(recorder_helper, rec);
+  return rec;
+}
+
+static inline bool recorder_should_rotate(const Recorder *rec) {
+  return rec->current.written >= rec->config.segment_bytes ||
+         (rec->config.segment_secs > 0 && recorder_now() - rec->current_opened >= rec->config.segment_secs);
+}
+
+static inline char *recorder_format_uint(char *p, uint64_t v, int min_digits) {
+  char digits[20];
+  int n = 0;
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v != 0 || n < min_digits);
+  while (n > 0) *p++ = digits[--n];
+  return p;
+}
+
+// "%.6f %zu\n" by hand, snprintf with a double costs more than the rest of the chunk's bookkeeping.
+static inline size_t recorder_format_timing(char *out, double delay, size_t bytes) {
+  uint64_t us = delay > 0 ? (uint64_t)(delay * 1e6 + 0.5) : 0;
+  char *p = recorder_format_uint(out, us / 1000000, 1);
+  *p++ = '.';
+  p = recorder_format_uint(p, us % 1000000, 6);
+  *p++ = ' ';
+  p = recorder_format_uint(p, bytes, 1);
+  *p++ = '\n';
+  return p - out;
+}
+
+// Returns false with errno set.
+static inline bool recorder_flush_timing(Recorder *rec) {
+  size_t len = rec->timing_len;
+  rec->timing_len = 0;
+  return len == 0 || write(rec->current.timing_fd, rec->timing_buf, len) == (ssize_t)len;
+}
+
+// Swaps in the prepared segment if there is one. Never waits for the helper, and never holds the lock it takes
+// across a syscall.
+static inline void recorder_rotate(Recorder *rec) {
+  std::unique_lock<std::mutex> guard(rec->lock);
+  if (!rec->next_ready) return;
+  guard.unlock();
+
+  // Only this thread clears `next_ready`, the segment stays there. The old segment's timing has to land in its own
+  // file. A failure here shows up in the next flush instead.
+  if (rec->config.timing) recorder_flush_timing(rec);
+
+  guard.lock();
+  rec->retiring.push_back(rec->current);
+  rec->current = rec->next;
+  rec->current_opened = recorder_now();
+  rec->next_ready = false;
+  rec->wake.notify_one();
+}
+
+// Writes all of `buf`, splitting it at the segment boundary. `now` is the chunk's timestamp in seconds, taken once
+// by the caller for all of the chunk's writes. Returns false with errno set.
+static inline bool recorder_write(Recorder *rec, const char *buf, size_t len, double now) {
+  while (len > 0) {
+    if (recorder_should_rotate(rec)) recorder_rotate(rec);
+    if (rec->config.timing && rec->current.written == 0 && !recorder_write_header(rec)) return false;
+
+    size_t n = len;
+    uint64_t cap = rec->config.segment_bytes;
+    if (rec->current.written < cap && cap - rec->current.written < n) n = cap - rec->current.written;
+
+    ssize_t written = write(rec->current.fd, buf, n);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+
+    rec->current.written += written;
+    buf += written;
+    len -= written;
+
+    if (rec->config.timing) {
+      if (rec->timing_len > RECORDER_TIMING_BUF_SIZE - RECORDER_TIMING_LINE_MAX && !recorder_flush_timing(rec)) {
+        return false;
+      }
+      rec->timing_len += recorder_format_timing(rec->timing_buf + rec->timing_len, now - rec->last_event, written);
+      rec->last_event = now;
+    }
+  }
+
+  if (rec->config.timing && now - rec->last_timing_flush >= RECORDER_TIMING_FLUSH_SECS) {
+    rec->last_timing_flush = now;
+    if (!recorder_flush_timing(rec)) return false;
+  }
+
+  return true;
+}
+
+// Flushes the current segment through retention, drops the prepared one and stops the helper.
+static inline void recorder_close(Recorder *rec) {
+  if (rec->config.timing) recorder_flush_timing(rec);
+
+  {
+    std::lock_guard<std::mutex> guard(rec->lock);
+    rec->retiring.push_back(rec->current);
+    rec->stopping = true;
+    rec->wake.notify_one();
+  }
+  rec->helper.join();
+
+  if (rec->next_ready) {
+    close(rec->next.fd);
+    if (rec->next.timing_fd != -1) close(rec->next.timing_fd);
+    recorder_unlink_segment(rec->base, rec->next.index);
+  }
+
+  delete rec;
+}
+
+#endif  // RECORDER_H_
@@ -0,0 +1,388 @@
+#ifndef REDACT_H_
+#define REDACT_H_
+
+// Secret redaction for the recording sink. Output is cut into runs at whitespace and control bytes (which includes
+// ESC, so escape sequences split runs too), and a run is masked with '*' when:
+//   - it contains a known prefix ("ghp_", "AKIA", "password=", ...) at a word boundary: everything after the prefix
+//     is masked, and when the prefix ends the run ("Bearer", "password:") the next run on the same line is masked;
+//   - or it holds a long run of base64-ish characters with high entropy and mixed letters and digits.
+// Masking keeps the length, so cursor movement and timing in the recording stay intact.
+//
+// A 16-byte SIMD pass finds the separators and the places where the leading bytes of some prefix occur. With SSSE3
+// that is a nibble-table shuffle in the style of the Teddy literal matcher, so the cost hardly depends on the number
+// of prefixes; plain SSE2 compares the first two bytes against each prefix. Short runs without a candidate, which is nearly all
+// terminal output, never get a closer look. The incomplete run at the end of a chunk is
+// held back until its end shows up, so secrets split across reads are still found.
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define REDACT_HAVE_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
+#define REDACT_MAX_PREFIXES 32
+#define REDACT_PREFIX_MAX_LEN 32
+#define REDACT_MAX_RUN 256        // Longer runs are judged in pieces instead of held back any further.
+#define REDACT_ENTROPY_MIN_LEN 20
+#define REDACT_ENTROPY_MAX_BITS 4.0
+#define REDACT_TEDDY_BYTES 3  // Leading prefix bytes the prefilter looks at, also the shortest prefix allowed.
+#define REDACT_PREFIXES_ENV "TERMY_REDACT_PREFIXES"
+
+static const char *const redact_default_prefixes[] = {
+    "ghp_",   "gho_",      "ghs_",      "ghu_",    "github_pat_", "glpat-", "xoxb-",   "xoxp-",      "AKIA",
+    "sk-",    "sk_live_",  "npm_",      "Bearer",  "password=",   "password:", "passwd=", "secret=", "token=",
+    "api_key=", "apikey=", "access_key=",
+};
+
+struct Redactor {
+  char prefixes[REDACT_MAX_PREFIXES][REDACT_PREFIX_MAX_LEN];
+  uint8_t prefix_lens[REDACT_MAX_PREFIXES];
+  int n_prefixes;
+  uint8_t first_pairs[REDACT_MAX_PREFIXES][2];  // Distinct leading byte pairs of the prefixes, folded with 0x20.
+  int n_first_pairs;
+  bool is_first_byte[256];
+
+  // Per leading byte, low and high nibble to the set of prefixes (mod 8) that may start with it.
+  alignas(16) uint8_t teddy_lo[REDACT_TEDDY_BYTES][16];
+  alignas(16) uint8_t teddy_hi[REDACT_TEDDY_BYTES][16];
+  bool use_ssse3;
+
+  bool mask_next_run;  // A prefix ended its run, the value follows after the whitespace.
+  bool after_esc;      // The held back run starts right after an ESC.
+
+  char *buf;  // Held back run + the current chunk.
+  size_t cap;
+  size_t held_start;
+  size_t held_len;
+};
+
+static inline bool redact_is_token_byte(uint8_t b) {
+  return (b >= '0' && b <= '9') || (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z') || b == '_' || b == '-' ||
+         b == '+' || b == '/' || b == '=';
+}
+
+static inline bool redact_is_alnum(uint8_t b) {
+  return (b >= '0' && b <= '9') || (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z');
+}
+
+static inline uint8_t redact_lower(uint8_t b) {
+  return b >= 'A' && b <= 'Z' ? b | 0x20 : b;
+}
+
+static inline void redact_add_prefix(Redactor *r, const char *prefix, size_t len) {
+  if (len < REDACT_TEDDY_BYTES || len >= REDACT_PREFIX_MAX_LEN || r->n_prefixes == REDACT_MAX_PREFIXES) return;
+
+  // Separators never make it into a run, a prefix holding one could not match.
+  for (size_t i = 0; i < len; i++) {
+    if ((uint8_t)prefix[i] <= ' ') return;
+  }
+
+  memcpy(r->prefixes[r->n_prefixes], prefix, len);
+  r->prefix_lens[r->n_prefixes] = len;
+
+  uint8_t first = (uint8_t)prefix[0] | 0x20;
+  uint8_t second = (uint8_t)prefix[1] | 0x20;
+  r->is_first_byte[first] = true;
+
+  uint8_t bucket = 1 << (r->n_prefixes % 8);
+  for (int k = 0; k < REDACT_TEDDY_BYTES; k++) {
+    uint8_t folded = (uint8_t)prefix[k] | 0x20;
+    r->teddy_lo[k][folded & 0xf] |= bucket;
+    r->teddy_hi[k][folded >> 4] |= bucket;
+  }
+  r->n_prefixes++;
+
+  for (int i = 0; i < r->n_first_pairs; i++) {
+    if (r->first_pairs[i][0] == first && r->first_pairs[i][1] == second) return;
+  }
+  r->first_pairs[r->n_first_pairs][0] = first;
+  r->first_pairs[r->n_first_pairs][1] = second;
+  r->n_first_pairs++;
+}
+
+// `max_chunk` is the largest chunk ever fed. Extra prefixes come from $TERMY_REDACT_PREFIXES, comma separated.
+static inline bool redactor_init(Redactor *r, size_t max_chunk) {
+  memset(r, 0, sizeof(*r));
+
+  for (const char *prefix : redact_default_prefixes) redact_add_prefix(r, prefix, strlen(prefix));
+
+  const char *extra = getenv(REDACT_PREFIXES_ENV);
+  while (extra != nullptr && *extra != '\0') {
+    const char *comma = strchr(extra, ',');
+    size_t len = comma != nullptr ? (size_t)(comma - extra) : strlen(extra);
+    redact_add_prefix(r, extra, len);
+    extra = comma != nullptr ? comma + 1 : nullptr;
+  }
+
+#ifdef REDACT_HAVE_SSSE3
+  r->use_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+
+  // The classifiers look a few bytes past each 16-byte block.
+  r->cap = REDACT_MAX_RUN + max_chunk;
+  r->buf = (char *)calloc(r->cap + REDACT_TEDDY_BYTES, 1);
+  return r->buf != nullptr;
+}
+
+static inline void redactor_free(Redactor *r) {
+  free(r->buf);
+  r->buf = nullptr;
+}
+
+static inline void redact_mask(char *begin, char *end) {
+  if (begin < end) memset(begin, '*', end - begin);
+}
+
+// Random base64 and hex keys score close to log2 of their length, words and identifiers well below.
+static inline bool redact_high_entropy(const char *s, size_t len) {
+  int counts[256] = {0};
+  bool upper = false, lower = false, digit = false;
+
+  for (size_t i = 0; i < len; i++) {
+    uint8_t b = (uint8_t)s[i];
+    counts[b]++;
+    upper |= b >= 'A' && b <= 'Z';
+    lower |= b >= 'a' && b <= 'z';
+    digit |= b >= '0' && b <= '9';
+  }
+
+  // Paths and hex digests rarely mix all three, tokens nearly always do.
+  if (!(digit && upper && lower)) return false;
+
+  double bits = 0;
+  for (int b = 0; b < 256; b++) {
+    if (counts[b] == 0) continue;
+    double p = (double)counts[b] / len;
+    bits -= p * log2(p);
+  }
+
+  double threshold = fmin(REDACT_ENTROPY_MAX_BITS, 0.9 * log2((double)len));
+  return bits >= threshold;
+}
+
+static inline bool redact_prefix_at(const Redactor *r, const char *s, size_t len, int *prefix_len) {
+  if (len < REDACT_TEDDY_BYTES) return false;
+
+  // The same bucket tables as the SIMD pass narrow it down to the prefixes sharing the leading nibbles.
+  uint8_t buckets = 0xff;
+  for (int k = 0; k < REDACT_TEDDY_BYTES; k++) {
+    uint8_t folded = (uint8_t)s[k] | 0x20;
+    buckets &= r->teddy_lo[k][folded & 0xf] & r->teddy_hi[k][folded >> 4];
+  }
+
+  for (int i = 0; buckets != 0 && i < r->n_prefixes; i++) {
+    size_t plen = r->prefix_lens[i];
+    if (plen > len || (buckets & (1 << (i % 8))) == 0) continue;
+
+    size_t j = 0;
+    while (j < plen && redact_lower((uint8_t)s[j]) == redact_lower((uint8_t)r->prefixes[i][j])) j++;
+    if (j == plen) {
+      *prefix_len = plen;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Judges one complete run. `candidate` says the prefilter saw a possible prefix start in it, `after_esc` that the
+// run opens with the tail of an escape sequence, which is skipped so "\e[32mAKIA..." still starts a word.
+static inline void redact_run(Redactor *r, char *begin, char *end, bool candidate, bool after_esc) {
+  if (after_esc && begin < end) {
+    if (*begin++ == '[') {
+      while (begin < end && (*begin < 0x40 || *begin > 0x7e)) begin++;
+      if (begin < end) begin++;
+    }
+  }
+
+  if (r->mask_next_run) {
+    r->mask_next_run = false;
+    redact_mask(begin, end);
+    return;
+  }
+
+  if (candidate) {
+    for (char *p = begin; p < end; p++) {
+      if (!r->is_first_byte[(uint8_t)*p | 0x20]) continue;
+      if (p > begin && redact_is_alnum((uint8_t)p[-1])) continue;
+
+      int prefix_len;
+      if (!redact_prefix_at(r, p, end - p, &prefix_len)) continue;
+
+      if (p + prefix_len == end) {
+        r->mask_next_run = true;
+      } else {
+        redact_mask(p + prefix_len, end);
+      }
+      return;
+    }
+  }
+
+  if (end - begin < REDACT_ENTROPY_MIN_LEN) return;
+
+  char *p = begin;
+  while (p < end) {
+    while (p < end && !redact_is_token_byte((uint8_t)*p)) p++;
+    char *token = p;
+    while (p < end && redact_is_token_byte((uint8_t)*p)) p++;
+
+    if (p - token >= REDACT_ENTROPY_MIN_LEN && redact_high_entropy(token, p - token)) redact_mask(token, p);
+  }
+}
+
+// Separator and prefix-candidate bitmasks for 16 bytes at `p`, reading a byte past them.
+static inline void redact_classify(const Redactor *r, const char *p, uint32_t *separators, uint32_t *candidates) {
+#ifdef __SSE2__
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  __m128i space = _mm_set1_epi8(' ');
+  *separators = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, space), space));
+
+  __m128i fold = _mm_set1_epi8(0x20);
+  __m128i folded = _mm_or_si128(v, fold);
+  __m128i folded_next = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 1)), fold);
+  __m128i hits = _mm_setzero_si128();
+  for (int i = 0; i < r->n_first_pairs; i++) {
+    __m128i first = _mm_cmpeq_epi8(folded, _mm_set1_epi8((char)r->first_pairs[i][0]));
+    __m128i second = _mm_cmpeq_epi8(folded_next, _mm_set1_epi8((char)r->first_pairs[i][1]));
+    hits = _mm_or_si128(hits, _mm_and_si128(first, second));
+  }
+  *candidates = _mm_movemask_epi8(hits);
+#else
+  *separators = 0;
+  *candidates = 0;
+  for (int i = 0; i < 16; i++) {
+    uint8_t b = (uint8_t)p[i];
+    if (b <= ' ') *separators |= 1u << i;
+    if (r->is_first_byte[b | 0x20]) *candidates |= 1u << i;
+  }
+#endif
+}
+
+#ifdef REDACT_HAVE_SSSE3
+// Candidates are the bytes where the nibbles of the next three bytes agree on at least one prefix bucket. Compiled
+// for SSSE3 on its own and picked at runtime, so the header still builds for any x86 target.
+__attribute__((target("ssse3"))) static inline void redact_classify_ssse3(const Redactor *r, const char *p,
+                                                                         uint32_t *separators, uint32_t *candidates) {
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  __m128i space = _mm_set1_epi8(' ');
+  *separators = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, space), space));
+
+  __m128i fold = _mm_set1_epi8(0x20);
+  __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i hits = _mm_set1_epi8((char)0xff);
+  for (int k = 0; k < REDACT_TEDDY_BYTES; k++) {
+    __m128i folded = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + k)), fold);
+    __m128i lo = _mm_and_si128(folded, nibble);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(folded, 4), nibble);
+    __m128i buckets = _mm_and_si128(_mm_shuffle_epi8(_mm_load_si128((const __m128i *)r->teddy_lo[k]), lo),
+                                    _mm_shuffle_epi8(_mm_load_si128((const __m128i *)r->teddy_hi[k]), hi));
+    hits = _mm_and_si128(hits, buckets);
+  }
+  *candidates = ~_mm_movemask_epi8(_mm_cmpeq_epi8(hits, _mm_setzero_si128())) & 0xffff;
+}
+#endif
+
+// Feeds the next chunk of output. Returns how many redacted bytes are ready at `*out`; they stay valid until the
+// next call. The run still open at the end of the chunk is kept for the next call or `redactor_finish`.
+static inline size_t redactor_feed(Redactor *r, const char *chunk, size_t len, const char **out) {
+  memmove(r->buf, r->buf + r->held_start, r->held_len);
+  memcpy(r->buf + r->held_len, chunk, len);
+  size_t n = r->held_len + len;
+
+  char *buf = r->buf;
+  size_t run_start = 0;
+  bool candidate = false;
+  bool after_esc = r->after_esc;
+
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    uint32_t separators, candidates;
+#ifdef REDACT_HAVE_SSSE3
+    if (r->use_ssse3) {
+      redact_classify_ssse3(r, buf + i, &separators, &candidates);
+    } else {
+      redact_classify(r, buf + i, &separators, &candidates);
+    }
+#else
+    redact_classify(r, buf + i, &separators, &candidates);
+#endif
+
+    // No candidate and the run from the previous block ends short: every run ending here is a plain short word, only
+    // the start of the last one matters.
+    if (candidates == 0 && !candidate && !r->mask_next_run && separators != 0 &&
+        i + __builtin_ctz(separators) - run_start < REDACT_ENTROPY_MIN_LEN) {
+      size_t last = i + 31 - __builtin_clz(separators);
+      run_start = last + 1;
+      after_esc = buf[last] == '\x1b';
+      continue;
+    }
+
+    while (separators != 0) {
+      int bit = __builtin_ctz(separators);
+      size_t pos = i + bit;
+      uint32_t before = (1u << bit) - 1;
+
+      candidate |= (candidates & before) != 0;
+      candidates &= ~before;
+      separators &= separators - 1;
+
+      // Short words with no candidate are the common case, they need no look at all.
+      if (pos > run_start && (candidate || r->mask_next_run || pos - run_start >= REDACT_ENTROPY_MIN_LEN)) {
+        redact_run(r, buf + run_start, buf + pos, candidate, after_esc);
+      }
+      if (buf[pos] == '\n' || buf[pos] == '\r') r->mask_next_run = false;
+      run_start = pos + 1;
+      candidate = false;
+      after_esc = buf[pos] == '\x1b';
+    }
+
+    candidate |= candidates != 0;
+  }
+
+  for (; i < n; i++) {
+    uint8_t b = (uint8_t)buf[i];
+    if (b > ' ') {
+      candidate |= r->is_first_byte[b | 0x20];
+      continue;
+    }
+
+    if (i > run_start) redact_run(r, buf + run_start, buf + i, candidate, after_esc);
+    if (b == '\n' || b == '\r') r->mask_next_run = false;
+    run_start = i + 1;
+    candidate = false;
+    after_esc = b == '\x1b';
+  }
+
+  if (n - run_start >= REDACT_MAX_RUN) {
+    redact_run(r, buf + run_start, buf + n, true, after_esc);
+    run_start = n;
+    after_esc = false;
+  }
+
+  r->after_esc = after_esc;
+  r->held_start = run_start;
+  r->held_len = n - run_start;
+  *out = buf;
+  return run_start;
+}
+
+// Releases the held back run at the end of the stream.
+static inline size_t redactor_finish(Redactor *r, const char **out) {
+  char *begin = r->buf + r->held_start;
+  redact_run(r, begin, begin + r->held_len, true, r->after_esc);
+
+  size_t len = r->held_len;
+  r->held_len = 0;
+  *out = begin;
+  return len;
+}
+
+#endif  // REDACT_H_
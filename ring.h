@@ -0,0 +1,262 @@
+#ifndef RING_H_
+#define RING_H_
+
+// Single-writer, many-reader byte ring in POSIX shared memory. The writer owns one cursor and never looks at the
+// readers: each reader keeps its own cursor and notices by itself when the writer lapped it. So the producer cost is
+// the same with zero or a hundred observers.
+//
+// The data area is mapped twice back to back, any span up to `capacity` bytes is contiguous in memory and a `read()`
+// can land in the ring directly, wrap or not.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+#define RING_MAGIC 0x7465726d  // "term"
+#define RING_MAX_READERS 16
+#define RING_HEADER_SIZE 4096
+#define RING_NAME_MAX 64
+
+enum RingReaderState : uint32_t {
+  RING_READER_FREE,
+  RING_READER_ACTIVE,
+  RING_READER_DROPPED,
+};
+
+enum RingLagPolicy {
+  RING_LAG_SKIP,  // Jump to the live edge and report the bytes lost.
+  RING_LAG_DROP,  // Give up the slot, the reader has to join again.
+};
+
+struct alignas(64) RingReaderSlot {
+  std::atomic<uint32_t> state;
+  std::atomic<int32_t> pid;
+  std::atomic<uint64_t> pos;      // Only for monitoring, the writer does not read it.
+  std::atomic<uint64_t> skipped;  // Bytes lost to overruns so far.
+};
+
+struct RingHeader {
+  uint32_t magic;
+  uint32_t capacity;   // Power of two, multiple of the page size.
+  uint32_t max_chunk;  // Upper bound of a single write, the writer may be filling this much past `write_pos`.
+  alignas(64) std::atomic<uint64_t> write_pos;  // Bytes ever written.
+  std::atomic<uint32_t> closed;
+  RingReaderSlot readers[RING_MAX_READERS];
+};
+
+static_assert(sizeof(RingHeader) <= RING_HEADER_SIZE, "Ring header does not fit its page.");
+
+struct Ring {
+  RingHeader *header;
+  char *data;
+  size_t map_len;
+  char name[RING_NAME_MAX];
+  bool owner;
+};
+
+// Maps header + data + data again from `fd`. Returns false with errno set.
+static inline bool ring_map(Ring *r, int fd, uint32_t capacity) {
+  r->map_len = RING_HEADER_SIZE + 2 * (size_t)capacity;
+
+  // Reserve the whole range first, then put the same pages into both halves.
+  char *base = (char *)mmap(nullptr, r->map_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) return false;
+
+  if (mmap(base, RING_HEADER_SIZE + (size_t)capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) ==
+          MAP_FAILED ||
+      mmap(base + RING_HEADER_SIZE + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+           RING_HEADER_SIZE) == MAP_FAILED) {
+    int prev_errno = errno;
+    munmap(base, r->map_len);
+    errno = prev_errno;
+    return false;
+  }
+
+  r->header = (RingHeader *)base;
+  r->data = base + RING_HEADER_SIZE;
+  return true;
+}
+
+// Writer side. `capacity` must be a power of two and a multiple of the page size.
+static inline Ring *ring_create(const char *name, uint32_t capacity, uint32_t max_chunk) {
+  if ((capacity & (capacity - 1)) != 0 || capacity % getpagesize() != 0 || max_chunk >= capacity ||
+      strlen(name) >= RING_NAME_MAX) {
+    errno = EINVAL;
+    return nullptr;
+  }
+
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd == -1) return nullptr;
+
+  Ring *r = new Ring();
+  if (ftruncate(fd, RING_HEADER_SIZE + (off_t)capacity) == -1 || !ring_map(r, fd, capacity)) {
+    int prev_errno = errno;
+    close(fd);
+    shm_unlink(name);
+    delete r;
+    errno = prev_errno;
+    return nullptr;
+  }
+  close(fd);
+
+  new (r->header) RingHeader();
+  r->header->capacity = capacity;
+  r->header->max_chunk = max_chunk;
+  r->header->write_pos.store(0, std::memory_order_relaxed);
+  r->header->closed.store(0, std::memory_order_relaxed);
+  for (RingReaderSlot &slot : r->header->readers) slot.state.store(RING_READER_FREE, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  r->header->magic = RING_MAGIC;
+
+  snprintf(r->name, RING_NAME_MAX, "%s", name);
+  r->owner = true;
+  return r;
+}
+
+// Where the next chunk goes. Up to `max_chunk` bytes may be written there before `ring_commit`.
+static inline char *ring_write_ptr(Ring *r) {
+  uint64_t pos = r->header->write_pos.load(std::memory_order_relaxed);
+  return r->data + (pos & (r->header->capacity - 1));
+}
+
+static inline void ring_commit(Ring *r, size_t len) {
+  uint64_t pos = r->header->write_pos.load(std::memory_order_relaxed);
+  r->header->write_pos.store(pos + len, std::memory_order_release);
+}
+
+// Unmaps, and for the writer also marks the ring closed and removes the name.
+static inline void ring_close(Ring *r) {
+  if (r->owner) {
+    r->header->closed.store(1, std::memory_order_release);
+    shm_unlink(r->name);
+  }
+  munmap(r->header, r->map_len);
+  delete r;
+}
+
+// Reader side.
+static inline Ring *ring_open(const char *name) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) return nullptr;
+
+  RingHeader probe;
+  if (pread(fd, &probe, sizeof(uint32_t) * 2, 0) != sizeof(uint32_t) * 2 || probe.magic != RING_MAGIC) {
+    close(fd);
+    errno = EPROTO;
+    return nullptr;
+  }
+
+  Ring *r = new Ring();
+  if (!ring_map(r, fd, probe.capacity)) {
+    int prev_errno = errno;
+    close(fd);
+    delete r;
+    errno = prev_errno;
+    return nullptr;
+  }
+  close(fd);
+
+  snprintf(r->name, RING_NAME_MAX, "%s", name);
+  r->owner = false;
+  return r;
+}
+
+// Claims a reader slot starting at the live edge. Returns the slot index or -1 when all are taken.
+static inline int ring_join(Ring *r) {
+  for (int i = 0; i < RING_MAX_READERS; i++) {
+    RingReaderSlot &slot = r->header->readers[i];
+    uint32_t state = slot.state.load(std::memory_order_relaxed);
+
+    // A taken slot is only reused once its reader has left, or died without leaving: SIGKILL, or SIGPIPE at the end of
+    // a pipeline. Pid 0 is a reader that has not stored its pid yet. Clearing the pid first keeps another joiner from
+    // freeing the slot a second time, and the writer may still drop the reader meanwhile.
+    if (state != RING_READER_FREE) {
+      int32_t pid = slot.pid.load(std::memory_order_relaxed);
+      if (pid == 0 || kill(pid, 0) == 0 || errno != ESRCH) continue;  // EPERM: running as someone else.
+      if (!slot.pid.compare_exchange_strong(pid, 0)) continue;
+      while (!slot.state.compare_exchange_weak(state, RING_READER_FREE)) {
+      }
+      state = RING_READER_FREE;
+    }
+
+    if (slot.state.compare_exchange_strong(state, RING_READER_ACTIVE)) {
+      slot.pid.store(getpid(), std::memory_order_relaxed);
+      slot.skipped.store(0, std::memory_order_relaxed);
+      slot.pos.store(r->header->write_pos.load(std::memory_order_acquire), std::memory_order_release);
+      return i;
+    }
+  }
+
+  errno = EBUSY;
+  return -1;
+}
+
+static inline void ring_leave(Ring *r, int slot) {
+  r->header->readers[slot].pid.store(0, std::memory_order_relaxed);
+  r->header->readers[slot].state.store(RING_READER_FREE, std::memory_order_release);
+}
+
+// Bytes between `pos` and the writer that may be overwritten by the time we are done copying them.
+static inline bool ring_lapped(const Ring *r, uint64_t pos, uint64_t write_pos) {
+  return write_pos + r->header->max_chunk - pos > r->header->capacity;
+}
+
+// Copies up to `len` bytes the reader has not seen yet. Returns the byte count, 0 when caught up, or -1 with errno
+// EPIPE once the writer closed the ring and everything was read, ENOLINK when the reader was dropped for lagging.
+static inline ssize_t ring_read(Ring *r, int slot_index, char *buf, size_t len, RingLagPolicy policy) {
+  RingReaderSlot &slot = r->header->readers[slot_index];
+  if (slot.state.load(std::memory_order_relaxed) != RING_READER_ACTIVE) {
+    errno = ENOLINK;
+    return -1;
+  }
+
+  uint64_t pos = slot.pos.load(std::memory_order_relaxed);
+  uint64_t write_pos = r->header->write_pos.load(std::memory_order_acquire);
+
+  for (;;) {
+    if (pos == write_pos) {
+      if (r->header->closed.load(std::memory_order_acquire) &&
+          write_pos == r->header->write_pos.load(std::memory_order_acquire)) {
+        errno = EPIPE;
+        return -1;
+      }
+      return 0;
+    }
+
+    if (!ring_lapped(r, pos, write_pos)) {
+      size_t n = write_pos - pos < len ? write_pos - pos : len;
+      memcpy(buf, r->data + (pos & (r->header->capacity - 1)), n);
+
+      // The copy raced with the writer if it has moved far enough since, the bytes may be torn. The fence keeps the
+      // copy's loads from drifting past the re-check, an acquire load alone only orders what comes after it.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint64_t after = r->header->write_pos.load(std::memory_order_relaxed);
+      if (!ring_lapped(r, pos, after)) {
+        slot.pos.store(pos + n, std::memory_order_release);
+        return n;
+      }
+      write_pos = after;
+    }
+
+    if (policy == RING_LAG_DROP) {
+      slot.state.store(RING_READER_DROPPED, std::memory_order_release);
+      errno = ENOLINK;
+      return -1;
+    }
+
+    slot.skipped.fetch_add(write_pos - pos, std::memory_order_relaxed);
+    pos = write_pos;
+    slot.pos.store(pos, std::memory_order_release);
+  }
+}
+
+#endif  // RING_H_
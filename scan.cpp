@@ -0,0 +1,382 @@
+#define _XOPEN_SOURCE 600
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ansi.h"
+#include "search.h"
+#include "steal.h"
+
+#define SCAN_CHUNK_BYTES (4u << 20)  // Per job. Big enough to stream, small enough for stealing to even out.
+#define TIME_BUF_SIZE 32
+
+#define FAIL_IF_WITH_CODE(exp, msg) \
+  if (exp) {                        \
+    perror(msg);                    \
+    exit(EXIT_FAILURE);             \
+  }
+
+#define FAIL_IF(exp, msg) \
+  if (exp) {              \
+    printf(msg);          \
+    printf("\n");         \
+    exit(EXIT_FAILURE);   \
+  }
+
+using namespace std;
+
+// Grep for recordings, without an index: every segment under the given paths is mapped and cut into
+// SCAN_CHUNK_BYTES jobs at line boundaries, and a work-stealing pool strips and searches the jobs. A job strips its
+// lines into a per-worker buffer (`ansi_strip`, 16 bytes at a time through plain text) and looks for the needle with
+// a first/last byte SSE2 prefilter, so a worker keeps up with a disk or two. Matches come out in file order, with the
+// session and time from the segment's header and timing like `index query` prints them.
+//
+// Segments are read as they are: the recorder writes plain typescript, there are no compressed blocks to unpack.
+
+struct Segment {
+  string path;
+  const char *data;
+  size_t size;
+  size_t data_start;  // After the header line.
+  uint32_t session;
+  uint64_t start_ms;
+
+  // Printer only.
+  bool timing_loaded;
+  vector<uint64_t> chunk_ends;
+  vector<uint32_t> chunk_ms;
+  uint64_t lines_before;  // Lines in the jobs of this segment printed so far.
+};
+
+struct Match {
+  uint64_t line;    // Within the job, from 0.
+  uint64_t offset;  // Of the raw line in the segment.
+  string text;
+};
+
+struct JobResult {
+  bool done;
+  uint64_t lines;
+  vector<Match> matches;
+};
+
+struct ScanJob {
+  size_t segment;
+  size_t start;
+  size_t end;
+  size_t slot;  // Into `results`, jobs print in slot order.
+};
+
+struct Needle {
+  string text;  // Folded if `fold`.
+  bool fold;
+};
+
+Needle needle;
+vector<Segment> segments;
+vector<JobResult> results;
+mutex print_lock;
+size_t next_print;
+size_t total_matches;
+
+static inline char fold_byte(char c, bool fold) {
+  return fold ? search_fold(c) : c;
+}
+
+bool literal_at(const char *p, const Needle *n) {
+  for (size_t i = 0; i < n->text.size(); i++) {
+    if (fold_byte(p[i], n->fold) != n->text[i]) return false;
+  }
+  return true;
+}
+
+#ifdef __SSE2__
+static inline __m128i fold_vector(__m128i v) {
+  __m128i upper = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8('A')), v),
+                                _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8('Z')), v));
+  return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+// First position at or after `from` where the needle starts, `len` if none. 16 candidate positions at a time are
+// checked for the needle's first and last byte at once, which rules out nearly every position without a loop.
+size_t find_literal(const Needle *n, const char *hay, size_t len, size_t from) {
+  size_t m = n->text.size();
+  if (m > len) return len;
+  size_t last = len - m;  // Last position the needle fits at.
+  size_t i = from;
+
+#ifdef __SSE2__
+  const __m128i first_byte = _mm_set1_epi8(n->text[0]);
+  const __m128i last_byte = _mm_set1_epi8(n->text[m - 1]);
+  for (; i + 16 <= last + 1; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+    if (n->fold) {
+      a = fold_vector(a);
+      b = fold_vector(b);
+    }
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first_byte), _mm_cmpeq_epi8(b, last_byte)));
+    while (mask != 0) {
+      size_t pos = i + __builtin_ctz(mask);
+      if (literal_at(hay + pos, n)) return pos;
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; i <= last; i++) {
+    if (literal_at(hay + i, n)) return i;
+  }
+  return len;
+}
+
+// Lines are short, a memchr per line costs more than looking at every byte.
+size_t count_newlines(const char *p, size_t len) {
+  size_t count = 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8('\n');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)));
+  }
+#endif
+  for (; i < len; i++) count += p[i] == '\n';
+  return count;
+}
+
+// Where the first line starting at or after `offset` begins.
+size_t line_start_from(const Segment *seg, size_t offset) {
+  if (offset <= seg->data_start) return seg->data_start;
+  if (offset >= seg->size) return seg->size;
+  const char *newline = (const char *)memchr(seg->data + offset - 1, '\n', seg->size - offset + 1);
+  return newline != nullptr ? newline + 1 - seg->data : seg->size;
+}
+
+void run_job(const ScanJob &job, string *buf, JobResult *result) {
+  const Segment *seg = &segments[job.segment];
+  size_t begin = line_start_from(seg, job.start);
+  size_t end = line_start_from(seg, job.end);
+
+  AnsiStripper strip;
+  ansi_strip_init(&strip);
+  buf->resize(end - begin);
+  size_t len = ansi_strip(&strip, seg->data + begin, end - begin, &(*buf)[0]);
+  const char *text = buf->data();
+
+  // Matches come in order, the line and raw offset counters only ever move forward.
+  size_t counted = 0;
+  uint64_t line = 0;
+  const char *raw = seg->data + begin;
+  uint64_t raw_line = 0;
+
+  for (size_t pos = find_literal(&needle, text, len, 0); pos < len;) {
+    const char *line_begin = text + pos;
+    while (line_begin > text && line_begin[-1] != '\n') line_begin--;
+    const char *newline = (const char *)memchr(text + pos, '\n', len - pos);
+    const char *line_end = newline != nullptr ? newline : text + len;
+
+    line += count_newlines(text + counted, line_begin - (text + counted));
+    counted = line_begin - text;
+    for (; raw_line < line; raw_line++) raw = (const char *)memchr(raw, '\n', seg->data + end - raw) + 1;
+
+    result->matches.push_back(Match{line, (uint64_t)(raw - seg->data), string(line_begin, line_end)});
+    if (newline == nullptr) break;
+    pos = find_literal(&needle, text, len, newline + 1 - text);
+  }
+
+  result->lines = line + count_newlines(text + counted, len - counted);
+  if (end == seg->size && end > begin && seg->data[end - 1] != '\n') result->lines++;
+}
+
+void format_time(Segment *seg, uint64_t offset, char *out) {
+  if (seg->start_ms == 0) {
+    snprintf(out, TIME_BUF_SIZE, "-");
+    return;
+  }
+
+  if (!seg->timing_loaded) {
+    string timing_path = seg->path + ".timing";
+    search_read_timing(timing_path.c_str(), seg->data_start, &seg->chunk_ends, &seg->chunk_ms);
+    seg->timing_loaded = true;
+  }
+
+  size_t chunk = upper_bound(seg->chunk_ends.begin(), seg->chunk_ends.end(), offset) - seg->chunk_ends.begin();
+  uint32_t ms = 0;
+  if (!seg->chunk_ms.empty()) ms = chunk < seg->chunk_ms.size() ? seg->chunk_ms[chunk] : seg->chunk_ms.back();
+
+  uint64_t when = seg->start_ms + ms;
+  time_t secs = (time_t)(when / 1000);
+  struct tm tm;
+  size_t len = strftime(out, TIME_BUF_SIZE, "%Y-%m-%d %H:%M:%S", localtime_r(&secs, &tm));
+  snprintf(out + len, TIME_BUF_SIZE - len, ".%03u", (unsigned)(when % 1000));
+}
+
+// Prints every finished job that is next in line. Under `print_lock`.
+void print_ready(const vector<ScanJob> &jobs) {
+  for (; next_print < results.size() && results[next_print].done; next_print++) {
+    JobResult &r = results[next_print];
+    Segment *seg = &segments[jobs[next_print].segment];
+
+    for (const Match &m : r.matches) {
+      char when[TIME_BUF_SIZE];
+      format_time(seg, m.offset, when);
+      printf("%u  %s  %s:%llu  %s\n", seg->session, when, seg->path.c_str(),
+             (unsigned long long)(seg->lines_before + m.line + 1), m.text.c_str());
+    }
+    total_matches += r.matches.size();
+    seg->lines_before += r.lines;
+    vector<Match>().swap(r.matches);
+  }
+}
+
+bool is_segment_name(const char *name) {
+  size_t len = strlen(name);
+  return len > 7 && name[len - 7] == '.' && strspn(name + len - 6, "0123456789") == 6;
+}
+
+// Recordings under `path`: the file itself, or every segment file in the directory tree.
+void collect(const string &path, bool explicit_file) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == -1) {
+    fprintf(stderr, "Error: cannot stat %s: %s\n", path.c_str(), strerror(errno));
+    return;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    DIR *d = opendir(path.c_str());
+    if (d == nullptr) {
+      fprintf(stderr, "Error: cannot list %s: %s\n", path.c_str(), strerror(errno));
+      return;
+    }
+
+    vector<string> names;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != nullptr) {
+      if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) names.push_back(entry->d_name);
+    }
+    closedir(d);
+
+    sort(names.begin(), names.end());
+    for (const string &name : names) collect(path + "/" + name, false);
+    return;
+  }
+
+  if (!S_ISREG(st.st_mode) || st.st_size == 0 || (!explicit_file && !is_segment_name(path.c_str()))) return;
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  void *map = fd != -1 ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  if (fd != -1) close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Error: cannot read %s: %s\n", path.c_str(), strerror(errno));
+    return;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  Segment seg;
+  seg.path = path;
+  seg.data = (const char *)map;
+  seg.size = st.st_size;
+  seg.data_start = search_parse_header(seg.data, seg.size, &seg.session, &seg.start_ms);
+  seg.timing_loaded = false;
+  seg.lines_before = 0;
+  segments.push_back(move(seg));
+}
+
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void usage() {
+  printf("Usage: scan [-j workers] [-i] <text> <file | dir>...\n");
+  printf("  directories are searched for segment files, NAME.NNNNNN\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int workers = cpus > 0 ? (int)cpus : 1;
+  needle.fold = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:i")) != -1) {
+    switch (opt) {
+      case 'j':
+        workers = atoi(optarg);
+        break;
+      case 'i':
+        needle.fold = true;
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind + 2 > argc || workers < 1 || argv[optind][0] == '\0') usage();
+
+  needle.text = argv[optind];
+  for (char &c : needle.text) c = fold_byte(c, needle.fold);
+
+  double start = now_ms();
+  for (int i = optind + 1; i < argc; i++) collect(argv[i], true);
+  FAIL_IF(segments.empty(), "Error: no recordings found.");
+
+  // One job per chunk, in file order; a worker starts on a contiguous run so it reads ahead sequentially.
+  vector<ScanJob> jobs;
+  uint64_t total_bytes = 0;
+  for (size_t s = 0; s < segments.size(); s++) {
+    total_bytes += segments[s].size;
+    for (size_t off = 0; off < segments[s].size; off += SCAN_CHUNK_BYTES) {
+      size_t end = segments[s].size - off > SCAN_CHUNK_BYTES ? off + SCAN_CHUNK_BYTES : segments[s].size;
+      jobs.push_back(ScanJob{s, off, end, jobs.size()});
+    }
+  }
+  results.resize(jobs.size());
+
+  // Every worker gets a contiguous run of jobs, pushed last first: it pops from the back and so walks its run
+  // forward, reading sequentially, while thieves take the far end of it.
+  StealQueue<ScanJob> queue(workers);
+  size_t per_worker = (jobs.size() + workers - 1) / workers;
+  for (size_t i = jobs.size(); i-- > 0;) queue.push((int)(i / per_worker), jobs[i]);
+
+  run_workers(workers, [&](int worker) {
+    string buf;
+    ScanJob job;
+    while (queue.pop(worker, &job)) {
+      JobResult result;
+      run_job(job, &buf, &result);
+
+      lock_guard<mutex> guard(print_lock);
+      results[job.slot] = move(result);
+      results[job.slot].done = true;
+      print_ready(jobs);
+    }
+  });
+
+  double elapsed = now_ms() - start;
+  fprintf(stderr, "-- %zu matches in %zu segments, %.1f MB in %.1f ms (%.0f MB/s, %d workers)\n", total_matches,
+          segments.size(), total_bytes / 1e6, elapsed, elapsed > 0 ? total_bytes / 1e3 / elapsed : 0.0, workers);
+
+  for (const Segment &seg : segments) munmap((void *)seg.data, seg.size);
+  return total_matches > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
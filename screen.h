@@ -0,0 +1,1018 @@
+#ifndef SCREEN_H_
+#define SCREEN_H_
+
+// Minimal VT/xterm screen model. Bytes read from a master PTY are fed in with `screen_feed` and the grid, cursor and
+// pen are updated in place. Nothing here does I/O, so one model per session is just its grid plus a few ints.
+// Queries the model can answer (see query.h) leave their replies in `replies`, the owner writes them to the master.
+//
+// A cell is 4 bytes: the codepoint and an index into the screen's style table, see style.h.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "query.h"
+#include "style.h"
+#include "utf8.h"
+
+#define SCREEN_MAX_PARAMS 16
+#define SCREEN_MAX_OSC 2048
+#define CELL_WIDE_TAIL 0x1fffff  // Right half of a wide character, the cell left of it has the codepoint.
+
+struct Cell {
+  uint32_t cp : 21;  // Codepoint, 0 for a never written (blank) cell.
+  uint32_t style : STYLE_INDEX_BITS;
+};
+
+static_assert(sizeof(Cell) == 4, "Cell is meant to stay one word.");
+
+enum ParserState {
+  PARSER_GROUND,
+  PARSER_ESCAPE,
+  PARSER_ESCAPE_INTERMEDIATE,
+  PARSER_CSI,
+  PARSER_STRING,      // OSC, DCS, APC, PM, SOS: swallowed until BEL or ST.
+  PARSER_STRING_ESC,  // Saw ESC inside a string, expecting '\' for ST.
+};
+
+struct Screen {
+  int rows;
+  int cols;
+  std::vector<Cell> cells;      // rows * cols, row-major.
+  std::vector<Cell> alt_saved;  // Primary grid while the alternate screen is active.
+  std::vector<uint8_t> dirty;   // One flag per row.
+  bool any_dirty;
+
+  int cur_row;
+  int cur_col;
+  bool wrap_pending;
+  int saved_row;
+  int saved_col;
+  Style saved_pen;
+
+  int scroll_top;
+  int scroll_bottom;
+  Style pen;
+  Style pen_interned;  // What `pen_id` was looked up for, -1 when it has to be looked up again.
+  int pen_id;
+  StyleTable styles;
+  size_t cells_written;  // Since the last sweep. Until a good part of the grid was overwritten, a sweep frees little.
+
+  bool cursor_visible;
+  bool autowrap;
+  bool alt_active;
+
+  ParserState state;
+  int params[SCREEN_MAX_PARAMS];
+  int n_params;
+  char private_marker;
+  char intermediate;
+  bool string_is_osc;
+  std::string osc;
+
+  Utf8Decoder utf8;
+
+  bool answer_queries;  // Off by default, the terminal the output goes to answers instead.
+  uint32_t default_fg;  // COLOR_RGB once known, OSC 10/11 go unanswered while COLOR_DEFAULT.
+  uint32_t default_bg;
+  std::string replies;  // For the master PTY, the owner drains it after `screen_feed`.
+
+  // Called with every row about to scroll off the top of the whole primary screen, for owners keeping a transcript.
+  void (*scroll_off)(void *ctx, const Screen *s, int row);
+  void *scroll_off_ctx;
+};
+
+// Frees the styles no cell refers to anymore. The pen and the saved pen are values, only their links have to stay.
+static inline void screen_collect_styles(Screen *s) {
+  std::vector<uint8_t> live_styles(s->styles.styles.size(), 0);
+  std::vector<uint8_t> live_links(s->styles.links.size(), 0);
+  for (const Cell &c : s->cells) live_styles[c.style] = 1;
+  for (const Cell &c : s->alt_saved) live_styles[c.style] = 1;
+  live_links[s->pen.link] = 1;
+  live_links[s->saved_pen.link] = 1;
+
+  style_collect(&s->styles, &live_styles, &live_links);
+  s->pen_id = -1;
+  s->cells_written = 0;
+}
+
+// Maps a truecolor SGR to the nearest entry of the xterm 6x6x6 colour cube.
+static inline uint8_t screen_rgb_to_palette(int r, int g, int b) {
+  auto level = [](int v) { return v < 48 ? 0 : (v < 115 ? 1 : (v - 35) / 40); };
+  return (uint8_t)(16 + 36 * level(r) + 6 * level(g) + level(b));
+}
+
+static inline uint32_t screen_quantize(uint32_t color) {
+  if (COLOR_KIND(color) != COLOR_RGB) return color;
+  return COLOR_PALETTE | screen_rgb_to_palette((color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
+}
+
+// With every index on screen at once (a truecolor gradient, say) the style settles for palette colours and no link,
+// and for the default style as a last resort.
+static inline uint16_t screen_intern(Screen *s, const Style &st) {
+  int id = style_intern(&s->styles, st);
+  if (id == -1 && s->cells_written >= s->cells.size() / 2) {
+    screen_collect_styles(s);
+    id = style_intern(&s->styles, st);
+  }
+  if (id == -1) {
+    Style nearest = {screen_quantize(st.fg), screen_quantize(st.bg), st.attrs, 0};
+    id = style_intern(&s->styles, nearest);
+  }
+  return id == -1 ? STYLE_DEFAULT : (uint16_t)id;
+}
+
+// A cell in the current pen, the lookup only happens when the pen changed.
+static inline Cell screen_pen_cell(Screen *s) {
+  if (s->pen_id == -1 || !style_equal(s->pen, s->pen_interned)) {
+    s->pen_id = screen_intern(s, s->pen);
+    s->pen_interned = s->pen;
+  }
+
+  Cell c;
+  c.cp = 0;
+  c.style = s->pen_id;
+  return c;
+}
+
+static inline Cell screen_blank(Screen *s) {
+  Style st = {COLOR_DEFAULT, s->pen.bg, 0, 0};  // Erase keeps the background colour only (BCE).
+  Cell c;
+  c.cp = 0;
+  c.style = screen_intern(s, st);
+  return c;
+}
+
+static inline Cell *screen_row(Screen *s, int row) {
+  return &s->cells[(size_t)row * s->cols];
+}
+
+static inline const Cell *screen_row(const Screen *s, int row) {
+  return &s->cells[(size_t)row * s->cols];
+}
+
+static inline void screen_mark_dirty(Screen *s, int from_row, int to_row) {
+  for (int r = from_row; r <= to_row; r++) s->dirty[r] = 1;
+  s->any_dirty = true;
+}
+
+static inline void screen_clear_dirty(Screen *s) {
+  memset(s->dirty.data(), 0, s->dirty.size());
+  s->any_dirty = false;
+}
+
+static inline void screen_fill(Screen *s, int row, int from_col, int to_col, Cell c) {
+  Cell *line = screen_row(s, row);
+  for (int i = from_col; i < to_col; i++) line[i] = c;
+  s->cells_written += to_col - from_col;
+  screen_mark_dirty(s, row, row);
+}
+
+static inline void screen_reset(Screen *s) {
+  style_table_init(&s->styles);
+  s->pen = Style{};
+  s->pen_id = -1;
+  s->cells_written = 0;
+  s->cur_row = s->cur_col = 0;
+  s->wrap_pending = false;
+  s->saved_row = s->saved_col = 0;
+  s->saved_pen = s->pen;
+  s->scroll_top = 0;
+  s->scroll_bottom = s->rows - 1;
+  s->cursor_visible = true;
+  s->autowrap = true;
+  s->alt_active = false;
+  s->alt_saved.clear();
+  s->state = PARSER_GROUND;
+  s->n_params = 0;
+  s->string_is_osc = false;
+  utf8_decoder_init(&s->utf8);
+
+  Cell blank = screen_blank(s);
+  for (Cell &c : s->cells) c = blank;
+  screen_mark_dirty(s, 0, s->rows - 1);
+}
+
+static inline void screen_init(Screen *s, int rows, int cols) {
+  s->rows = rows;
+  s->cols = cols;
+  s->cells.assign((size_t)rows * cols, Cell{});
+  s->dirty.assign(rows, 1);
+  s->answer_queries = false;
+  s->default_fg = s->default_bg = COLOR_DEFAULT;
+  s->replies.clear();
+  s->scroll_off = nullptr;
+  s->scroll_off_ctx = nullptr;
+  screen_reset(s);
+}
+
+// Copies `grid` into a `rows` x `cols` one. Shrinking keeps the bottom rows up to `cursor_row`, where the cursor and
+// prompt usually are. Returns how many rows went off the top.
+static inline int screen_resize_grid(Screen *s, std::vector<Cell> *grid, int cursor_row, int rows, int cols) {
+  std::vector<Cell> resized((size_t)rows * cols, screen_blank(s));
+  int keep_rows = rows < s->rows ? rows : s->rows;
+  int keep_cols = cols < s->cols ? cols : s->cols;
+  int skip = cursor_row >= rows ? cursor_row - rows + 1 : 0;
+  for (int r = 0; r < keep_rows && r + skip < s->rows; r++) {
+    memcpy(&resized[(size_t)r * cols], &(*grid)[(size_t)(r + skip) * s->cols], keep_cols * sizeof(Cell));
+  }
+
+  grid->swap(resized);
+  return skip;
+}
+
+static inline void screen_resize(Screen *s, int rows, int cols) {
+  if (rows == s->rows && cols == s->cols) return;
+
+  int skip = screen_resize_grid(s, &s->cells, s->cur_row, rows, cols);
+  // The primary grid behind the alternate screen keeps up, leaving the full-screen app brings back the shell.
+  if (s->alt_active && s->alt_saved.size() == (size_t)s->rows * s->cols) {
+    s->saved_row -= screen_resize_grid(s, &s->alt_saved, s->saved_row, rows, cols);  // 1049 saved it for the grid.
+  }
+  s->rows = rows;
+  s->cols = cols;
+  s->dirty.assign(rows, 1);
+  s->any_dirty = true;
+  s->cur_row -= skip;
+  if (s->cur_row >= rows) s->cur_row = rows - 1;
+  if (s->cur_col >= cols) s->cur_col = cols - 1;
+  s->wrap_pending = false;
+  s->scroll_top = 0;
+  s->scroll_bottom = rows - 1;
+}
+
+static inline void screen_scroll_up(Screen *s, int top, int bottom, int n) {
+  int height = bottom - top + 1;
+  if (n > height) n = height;
+  if (s->scroll_off != nullptr && top == 0 && bottom == s->rows - 1 && !s->alt_active) {
+    for (int r = 0; r < n; r++) s->scroll_off(s->scroll_off_ctx, s, r);
+  }
+  size_t row_bytes = (size_t)s->cols * sizeof(Cell);
+  memmove(screen_row(s, top), screen_row(s, top + n), (size_t)(height - n) * row_bytes);
+  Cell blank = screen_blank(s);
+  for (int r = bottom - n + 1; r <= bottom; r++) screen_fill(s, r, 0, s->cols, blank);
+  screen_mark_dirty(s, top, bottom);
+}
+
+static inline void screen_scroll_down(Screen *s, int top, int bottom, int n) {
+  int height = bottom - top + 1;
+  if (n > height) n = height;
+  size_t row_bytes = (size_t)s->cols * sizeof(Cell);
+  memmove(screen_row(s, top + n), screen_row(s, top), (size_t)(height - n) * row_bytes);
+  Cell blank = screen_blank(s);
+  for (int r = top; r < top + n; r++) screen_fill(s, r, 0, s->cols, blank);
+  screen_mark_dirty(s, top, bottom);
+}
+
+static inline void screen_linefeed(Screen *s) {
+  if (s->cur_row == s->scroll_bottom) {
+    screen_scroll_up(s, s->scroll_top, s->scroll_bottom, 1);
+  } else if (s->cur_row < s->rows - 1) {
+    s->cur_row++;
+  }
+}
+
+static inline void screen_reverse_index(Screen *s) {
+  if (s->cur_row == s->scroll_top) {
+    screen_scroll_down(s, s->scroll_top, s->scroll_bottom, 1);
+  } else if (s->cur_row > 0) {
+    s->cur_row--;
+  }
+}
+
+static inline void screen_move_to(Screen *s, int row, int col) {
+  s->cur_row = row < 0 ? 0 : (row >= s->rows ? s->rows - 1 : row);
+  s->cur_col = col < 0 ? 0 : (col >= s->cols ? s->cols - 1 : col);
+  s->wrap_pending = false;
+}
+
+static inline void screen_wrap(Screen *s) {
+  s->cur_col = 0;
+  screen_linefeed(s);
+  s->wrap_pending = false;
+}
+
+// Overwriting either half of a wide character blanks the other half, a terminal does not show half a glyph.
+static inline void screen_split_wide(Screen *s, Cell *line, int from_col, int to_col) {
+  if (line[from_col].cp == CELL_WIDE_TAIL && from_col > 0) line[from_col - 1].cp = 0;
+  if (to_col < s->cols && line[to_col].cp == CELL_WIDE_TAIL) line[to_col].cp = 0;
+}
+
+// Moves the cursor to `end_col`, just past what was written. Past the margin it stays in the last column.
+static inline void screen_advance(Screen *s, int end_col) {
+  if (end_col >= s->cols) {
+    s->cur_col = s->cols - 1;
+    s->wrap_pending = s->autowrap;
+  } else {
+    s->cur_col = end_col;
+  }
+}
+
+static inline void screen_put(Screen *s, uint32_t cp) {
+  if (s->wrap_pending) screen_wrap(s);
+
+  Cell *line = screen_row(s, s->cur_row);
+  Cell c = screen_pen_cell(s);
+  c.cp = cp;
+  screen_split_wide(s, line, s->cur_col, s->cur_col + 1);
+  line[s->cur_col] = c;
+  s->cells_written++;
+  screen_mark_dirty(s, s->cur_row, s->cur_row);
+  screen_advance(s, s->cur_col + 1);
+}
+
+static inline void screen_put_wide(Screen *s, uint32_t cp) {
+  if (s->cols < 2) return;
+  if (s->wrap_pending) screen_wrap(s);
+
+  // Does not fit in the last column: wraps early, or without autowrap lands one column to the left.
+  if (s->cur_col == s->cols - 1) {
+    if (s->autowrap) {
+      screen_wrap(s);
+    } else {
+      s->cur_col--;
+    }
+  }
+
+  Cell *line = screen_row(s, s->cur_row);
+  Cell c = screen_pen_cell(s);
+  screen_split_wide(s, line, s->cur_col, s->cur_col + 2);
+  c.cp = cp;
+  line[s->cur_col] = c;
+  c.cp = CELL_WIDE_TAIL;
+  line[s->cur_col + 1] = c;
+  s->cells_written += 2;
+  screen_mark_dirty(s, s->cur_row, s->cur_row);
+  screen_advance(s, s->cur_col + 2);
+}
+
+// Combining marks and other zero width codepoints are dropped, the base character stands in for the cluster.
+static inline void screen_print(Screen *s, uint32_t cp) {
+  int width = utf8_width(cp);
+  if (width == 1) {
+    screen_put(s, cp);
+  } else if (width == 2) {
+    screen_put_wide(s, cp);
+  }
+}
+
+// A run of printable ASCII, one row segment at a time instead of one cell at a time.
+static inline void screen_put_ascii(Screen *s, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    if (s->wrap_pending) screen_wrap(s);
+
+    size_t n = (size_t)(s->cols - s->cur_col);
+    if (n > len) n = len;
+
+    Cell *line = screen_row(s, s->cur_row);
+    Cell c = screen_pen_cell(s);
+    screen_split_wide(s, line, s->cur_col, s->cur_col + (int)n);
+    for (size_t i = 0; i < n; i++) {
+      c.cp = buf[i];
+      line[s->cur_col + i] = c;
+    }
+    s->cells_written += n;
+    screen_mark_dirty(s, s->cur_row, s->cur_row);
+    screen_advance(s, s->cur_col + (int)n);
+
+    buf += n;
+    len -= n;
+  }
+}
+
+// A run of complete multi-byte sequences. Wide characters with room left in the row are stored right here, the rest
+// goes through `screen_print`. Returns where the run ended.
+static inline const uint8_t *screen_put_utf8_run(Screen *s, const uint8_t *p, const uint8_t *end) {
+  Cell c = screen_pen_cell(s);
+  while (p < end && *p >= 0x80) {
+    uint32_t cp;
+    int n = utf8_decode_at(p, end, &cp);
+    if (n <= 0) break;
+    p += n;
+
+    if (s->wrap_pending || s->cur_col + 2 >= s->cols || utf8_width(cp) != 2) {
+      screen_print(s, cp);
+      c = screen_pen_cell(s);
+      continue;
+    }
+
+    Cell *line = screen_row(s, s->cur_row);
+    screen_split_wide(s, line, s->cur_col, s->cur_col + 2);
+    c.cp = cp;
+    line[s->cur_col] = c;
+    c.cp = CELL_WIDE_TAIL;
+    line[s->cur_col + 1] = c;
+    s->cur_col += 2;
+    s->cells_written += 2;
+    s->dirty[s->cur_row] = 1;
+    s->any_dirty = true;
+  }
+  return p;
+}
+
+static inline void screen_set_alt(Screen *s, bool on) {
+  if (on == s->alt_active) return;
+
+  if (on) {
+    s->alt_saved = s->cells;
+    Cell blank = screen_blank(s);
+    for (Cell &c : s->cells) c = blank;
+  } else {
+    if (s->alt_saved.size() == s->cells.size()) s->cells.swap(s->alt_saved);
+    s->alt_saved.clear();
+  }
+
+  s->alt_active = on;
+  screen_mark_dirty(s, 0, s->rows - 1);
+}
+
+static inline int screen_param(const Screen *s, int i, int def) {
+  if (i >= s->n_params || s->params[i] == 0) return def;
+  return s->params[i];
+}
+
+// SGR 0 leaves the hyperlink alone, that one only changes with OSC 8.
+static inline void screen_reset_pen(Screen *s) {
+  uint16_t link = s->pen.link;
+  s->pen = Style{};
+  s->pen.link = link;
+}
+
+static inline void screen_sgr(Screen *s) {
+  if (s->n_params == 0) {
+    screen_reset_pen(s);
+    return;
+  }
+
+  for (int i = 0; i < s->n_params; i++) {
+    int p = s->params[i];
+
+    if (p == 0) {
+      screen_reset_pen(s);
+    } else if (p == 1) {
+      s->pen.attrs |= ATTR_BOLD;
+    } else if (p == 2) {
+      s->pen.attrs |= ATTR_DIM;
+    } else if (p == 3) {
+      s->pen.attrs |= ATTR_ITALIC;
+    } else if (p == 4) {
+      s->pen.attrs |= ATTR_UNDERLINE;
+    } else if (p == 5) {
+      s->pen.attrs |= ATTR_BLINK;
+    } else if (p == 7) {
+      s->pen.attrs |= ATTR_REVERSE;
+    } else if (p == 22) {
+      s->pen.attrs &= ~(ATTR_BOLD | ATTR_DIM);
+    } else if (p == 23) {
+      s->pen.attrs &= ~ATTR_ITALIC;
+    } else if (p == 24) {
+      s->pen.attrs &= ~ATTR_UNDERLINE;
+    } else if (p == 25) {
+      s->pen.attrs &= ~ATTR_BLINK;
+    } else if (p == 27) {
+      s->pen.attrs &= ~ATTR_REVERSE;
+    } else if (p >= 30 && p <= 37) {
+      s->pen.fg = COLOR_PALETTE | (p - 30);
+    } else if (p == 39) {
+      s->pen.fg = COLOR_DEFAULT;
+    } else if (p >= 40 && p <= 47) {
+      s->pen.bg = COLOR_PALETTE | (p - 40);
+    } else if (p == 49) {
+      s->pen.bg = COLOR_DEFAULT;
+    } else if (p >= 90 && p <= 97) {
+      s->pen.fg = COLOR_PALETTE | (p - 90 + 8);
+    } else if (p >= 100 && p <= 107) {
+      s->pen.bg = COLOR_PALETTE | (p - 100 + 8);
+    } else if ((p == 38 || p == 48) && i + 1 < s->n_params) {
+      uint32_t color;
+      if (s->params[i + 1] == 5 && i + 2 < s->n_params) {
+        color = COLOR_PALETTE | (s->params[i + 2] & 0xff);
+        i += 2;
+      } else if (s->params[i + 1] == 2 && i + 4 < s->n_params) {
+        color = COLOR_RGB | (s->params[i + 2] & 0xff) << 16 | (s->params[i + 3] & 0xff) << 8 |
+                (s->params[i + 4] & 0xff);
+        i += 4;
+      } else {
+        return;
+      }
+
+      if (p == 38) {
+        s->pen.fg = color;
+      } else {
+        s->pen.bg = color;
+      }
+    }
+  }
+}
+
+static inline void screen_set_mode(Screen *s, bool on) {
+  if (s->private_marker != '?') return;
+
+  for (int i = 0; i < s->n_params; i++) {
+    switch (s->params[i]) {
+      case 7:
+        s->autowrap = on;
+        break;
+      case 25:
+        s->cursor_visible = on;
+        break;
+      case 1049:
+        if (on) {
+          s->saved_row = s->cur_row;
+          s->saved_col = s->cur_col;
+          s->saved_pen = s->pen;
+          screen_set_alt(s, true);
+        } else {
+          screen_set_alt(s, false);
+          screen_move_to(s, s->saved_row, s->saved_col);
+          s->pen = s->saved_pen;
+        }
+        break;
+      case 47:
+      case 1047:
+        screen_set_alt(s, on);
+        break;
+    }
+  }
+}
+
+// Replies as xterm gives them: a VT220 with ANSI colour, and the cursor and sizes in 1-based cells.
+static inline void screen_answer(Screen *s, QueryKind query) {
+  char reply[48];
+  int len = 0;
+  switch (query) {
+    case QUERY_STATUS:
+      len = snprintf(reply, sizeof(reply), "\x1b[0n");
+      break;
+    case QUERY_CURSOR:
+      len = snprintf(reply, sizeof(reply), "\x1b[%d;%dR", s->cur_row + 1, s->cur_col + 1);
+      break;
+    case QUERY_CURSOR_DEC:
+      len = snprintf(reply, sizeof(reply), "\x1b[?%d;%dR", s->cur_row + 1, s->cur_col + 1);
+      break;
+    case QUERY_DA1:
+      len = snprintf(reply, sizeof(reply), "\x1b[?62;22c");
+      break;
+    case QUERY_DA2:
+      len = snprintf(reply, sizeof(reply), "\x1b[>1;10;0c");
+      break;
+    case QUERY_TEXT_SIZE:
+      len = snprintf(reply, sizeof(reply), "\x1b[8;%d;%dt", s->rows, s->cols);
+      break;
+    case QUERY_SCREEN_SIZE:
+      len = snprintf(reply, sizeof(reply), "\x1b[9;%d;%dt", s->rows, s->cols);
+      break;
+    case QUERY_NONE:
+      break;
+  }
+  s->replies.append(reply, len);
+}
+
+static inline void screen_csi_dispatch(Screen *s, uint8_t final) {
+  if (s->answer_queries && s->intermediate == 0) {
+    QueryKind query = query_csi_kind(s->private_marker, s->n_params, s->params[0], final);
+    if (query != QUERY_NONE) {
+      screen_answer(s, query);
+      return;
+    }
+  }
+
+  if (s->private_marker != 0 && final != 'h' && final != 'l') return;
+  if (s->intermediate != 0) return;
+
+  Cell blank = screen_blank(s);
+  int n = screen_param(s, 0, 1);
+  int row = s->cur_row;
+  int col = s->cur_col;
+
+  switch (final) {
+    case '@': {  // ICH
+      Cell *line = screen_row(s, row);
+      if (n > s->cols - col) n = s->cols - col;
+      memmove(line + col + n, line + col, (size_t)(s->cols - col - n) * sizeof(Cell));
+      screen_fill(s, row, col, col + n, blank);
+      break;
+    }
+    case 'A':
+      screen_move_to(s, row - n < s->scroll_top && row >= s->scroll_top ? s->scroll_top : row - n, col);
+      break;
+    case 'B':
+      screen_move_to(s, row + n > s->scroll_bottom && row <= s->scroll_bottom ? s->scroll_bottom : row + n, col);
+      break;
+    case 'C':
+      screen_move_to(s, row, col + n);
+      break;
+    case 'D':
+      screen_move_to(s, row, col - n);
+      break;
+    case 'E':
+      screen_move_to(s, row + n, 0);
+      break;
+    case 'F':
+      screen_move_to(s, row - n, 0);
+      break;
+    case 'G':
+    case '`':
+      screen_move_to(s, row, n - 1);
+      break;
+    case 'H':
+    case 'f':
+      screen_move_to(s, screen_param(s, 0, 1) - 1, screen_param(s, 1, 1) - 1);
+      break;
+    case 'J': {
+      int mode = screen_param(s, 0, 0);
+      if (mode == 0) {
+        screen_fill(s, row, col, s->cols, blank);
+        for (int r = row + 1; r < s->rows; r++) screen_fill(s, r, 0, s->cols, blank);
+      } else if (mode == 1) {
+        for (int r = 0; r < row; r++) screen_fill(s, r, 0, s->cols, blank);
+        screen_fill(s, row, 0, col + 1, blank);
+      } else if (mode == 2 || mode == 3) {
+        for (int r = 0; r < s->rows; r++) screen_fill(s, r, 0, s->cols, blank);
+      }
+      break;
+    }
+    case 'K': {
+      int mode = screen_param(s, 0, 0);
+      if (mode == 0) {
+        screen_fill(s, row, col, s->cols, blank);
+      } else if (mode == 1) {
+        screen_fill(s, row, 0, col + 1, blank);
+      } else if (mode == 2) {
+        screen_fill(s, row, 0, s->cols, blank);
+      }
+      break;
+    }
+    case 'L':
+      if (row >= s->scroll_top && row <= s->scroll_bottom) screen_scroll_down(s, row, s->scroll_bottom, n);
+      break;
+    case 'M':
+      if (row >= s->scroll_top && row <= s->scroll_bottom) screen_scroll_up(s, row, s->scroll_bottom, n);
+      break;
+    case 'P': {  // DCH
+      Cell *line = screen_row(s, row);
+      if (n > s->cols - col) n = s->cols - col;
+      memmove(line + col, line + col + n, (size_t)(s->cols - col - n) * sizeof(Cell));
+      screen_fill(s, row, s->cols - n, s->cols, blank);
+      break;
+    }
+    case 'S':
+      screen_scroll_up(s, s->scroll_top, s->scroll_bottom, n);
+      break;
+    case 'T':
+      screen_scroll_down(s, s->scroll_top, s->scroll_bottom, n);
+      break;
+    case 'X':
+      screen_fill(s, row, col, col + n > s->cols ? s->cols : col + n, blank);
+      break;
+    case 'd':
+      screen_move_to(s, n - 1, col);
+      break;
+    case 'm':
+      screen_sgr(s);
+      break;
+    case 'r': {
+      int top = screen_param(s, 0, 1) - 1;
+      int bottom = screen_param(s, 1, s->rows) - 1;
+      if (bottom >= s->rows) bottom = s->rows - 1;
+      if (top < bottom) {
+        s->scroll_top = top;
+        s->scroll_bottom = bottom;
+        screen_move_to(s, 0, 0);
+      }
+      break;
+    }
+    case 's':
+      s->saved_row = row;
+      s->saved_col = col;
+      s->saved_pen = s->pen;
+      break;
+    case 'u':
+      screen_move_to(s, s->saved_row, s->saved_col);
+      s->pen = s->saved_pen;
+      break;
+    case 'h':
+      screen_set_mode(s, true);
+      break;
+    case 'l':
+      screen_set_mode(s, false);
+      break;
+  }
+}
+
+static inline void screen_esc_dispatch(Screen *s, uint8_t final) {
+  if (s->intermediate != 0) return;  // Charset designation and friends.
+
+  switch (final) {
+    case '7':
+      s->saved_row = s->cur_row;
+      s->saved_col = s->cur_col;
+      s->saved_pen = s->pen;
+      break;
+    case '8':
+      screen_move_to(s, s->saved_row, s->saved_col);
+      s->pen = s->saved_pen;
+      break;
+    case 'D':
+      screen_linefeed(s);
+      break;
+    case 'E':
+      s->cur_col = 0;
+      screen_linefeed(s);
+      break;
+    case 'M':
+      screen_reverse_index(s);
+      break;
+    case 'c':
+      screen_reset(s);
+      break;
+  }
+}
+
+// Answers OSC 10/11 with the default colour, terminated the way the query was.
+static inline void screen_answer_color(Screen *s, int which, bool bel) {
+  uint32_t color = which == 10 ? s->default_fg : s->default_bg;
+  if (COLOR_KIND(color) != COLOR_RGB) return;
+
+  int r = (color >> 16) & 0xff, g = (color >> 8) & 0xff, b = color & 0xff;
+  char reply[48];
+  int len = snprintf(reply, sizeof(reply), "\x1b]%d;rgb:%04x/%04x/%04x%s", which, r * 0x101, g * 0x101, b * 0x101,
+                     bel ? "\a" : "\x1b\\");
+  s->replies.append(reply, len);
+}
+
+// OSC 8 ; params ; URI starts a hyperlink, an empty URI ends it. OSC 10/11 colour queries may be answered, titles
+// and the other OSCs are ignored.
+static inline void screen_osc_dispatch(Screen *s, bool bel) {
+  int color_query = s->answer_queries ? query_osc_color(s->osc.data(), s->osc.size()) : 0;
+  if (color_query != 0) screen_answer_color(s, color_query, bel);
+
+  if (s->osc.compare(0, 2, "8;") != 0) return;
+
+  size_t params_end = s->osc.find(';', 2);
+  if (params_end == std::string::npos) return;
+
+  std::string uri = s->osc.substr(params_end + 1);
+  if (uri.empty()) {
+    s->pen.link = 0;
+    return;
+  }
+
+  uint16_t link = style_intern_link(&s->styles, uri);
+  if (link == 0) {
+    screen_collect_styles(s);
+    link = style_intern_link(&s->styles, uri);
+  }
+  s->pen.link = link;
+}
+
+static inline void screen_execute(Screen *s, uint8_t b) {
+  switch (b) {
+    case '\r':
+      s->cur_col = 0;
+      s->wrap_pending = false;
+      break;
+    case '\n':
+    case '\v':
+    case '\f':
+      screen_linefeed(s);
+      s->wrap_pending = false;
+      break;
+    case '\b':
+      if (s->cur_col > 0) s->cur_col--;
+      s->wrap_pending = false;
+      break;
+    case '\t': {
+      int next = (s->cur_col / 8 + 1) * 8;
+      s->cur_col = next >= s->cols ? s->cols - 1 : next;
+      break;
+    }
+    case 0x18:  // CAN
+    case 0x1a:  // SUB
+      s->state = PARSER_GROUND;
+      break;
+    case 0x1b:
+      s->state = PARSER_ESCAPE;
+      s->intermediate = 0;
+      break;
+  }
+}
+
+static inline void screen_feed_byte(Screen *s, uint8_t b) {
+  switch (s->state) {
+    case PARSER_GROUND: {
+      uint32_t cp;
+      bool retry;
+      if (s->utf8.need > 0) {
+        if (utf8_decoder_feed(&s->utf8, b, &cp, &retry) != UTF8_MORE) screen_print(s, cp);
+        if (!retry) return;
+      }
+
+      if (b < 0x20 || b == 0x7f) {
+        screen_execute(s, b);
+      } else if (b < 0x80) {
+        screen_put(s, b);
+      } else if (utf8_decoder_feed(&s->utf8, b, &cp, &retry) != UTF8_MORE) {
+        screen_print(s, cp);
+      }
+      break;
+    }
+
+    case PARSER_ESCAPE:
+      if (b == '[') {
+        s->state = PARSER_CSI;
+        s->n_params = 0;
+        s->params[0] = 0;
+        s->private_marker = 0;
+        s->intermediate = 0;
+      } else if (b == ']' || b == 'P' || b == 'X' || b == '^' || b == '_') {
+        s->state = PARSER_STRING;
+        s->string_is_osc = b == ']';
+        s->osc.clear();
+      } else if (b >= 0x20 && b <= 0x2f) {
+        s->intermediate = b;
+        s->state = PARSER_ESCAPE_INTERMEDIATE;
+      } else if (b < 0x20) {
+        screen_execute(s, b);
+      } else {
+        s->state = PARSER_GROUND;
+        screen_esc_dispatch(s, b);
+      }
+      break;
+
+    case PARSER_ESCAPE_INTERMEDIATE:
+      if (b >= 0x30 && b <= 0x7e) {
+        s->state = PARSER_GROUND;
+        screen_esc_dispatch(s, b);
+      } else if (b < 0x20) {
+        screen_execute(s, b);
+      }
+      break;
+
+    case PARSER_CSI:
+      if (b >= '0' && b <= '9') {
+        if (s->n_params == 0) s->n_params = 1;
+        int *p = &s->params[s->n_params - 1];
+        if (*p < 100000) *p = *p * 10 + (b - '0');
+      } else if (b == ';' || b == ':') {
+        if (s->n_params == 0) s->n_params = 1;
+        if (s->n_params < SCREEN_MAX_PARAMS) s->params[s->n_params++] = 0;
+      } else if (b >= '<' && b <= '?') {
+        s->private_marker = b;
+      } else if (b >= 0x20 && b <= 0x2f) {
+        s->intermediate = b;
+      } else if (b >= 0x40 && b <= 0x7e) {
+        s->state = PARSER_GROUND;
+        screen_csi_dispatch(s, b);
+      } else if (b < 0x20) {
+        screen_execute(s, b);
+      }
+      break;
+
+    case PARSER_STRING:
+      if (b == 0x07) {
+        s->state = PARSER_GROUND;
+        if (s->string_is_osc) screen_osc_dispatch(s, true);
+      } else if (b == 0x1b) {
+        s->state = PARSER_STRING_ESC;
+      } else if (s->string_is_osc && s->osc.size() < SCREEN_MAX_OSC) {
+        s->osc.push_back((char)b);
+      }
+      break;
+
+    case PARSER_STRING_ESC:
+      s->state = b == '\\' ? PARSER_GROUND : PARSER_STRING;
+      if (s->state == PARSER_GROUND && s->string_is_osc) screen_osc_dispatch(s, false);
+      break;
+  }
+}
+
+// Text in the ground state skips the byte at a time parser: printable ASCII goes in as whole runs, and complete
+// multi-byte sequences are decoded in place. Split or broken sequences and everything else take the slow path.
+static inline void screen_feed(Screen *s, const char *buf, size_t len) {
+  const uint8_t *p = (const uint8_t *)buf;
+  const uint8_t *end = p + len;
+
+  while (p < end) {
+    if (s->state == PARSER_GROUND && s->utf8.need == 0) {
+      if (*p >= 0x20 && *p < 0x7f) {
+        size_t run = utf8_ascii_run((const char *)p, end - p);
+        screen_put_ascii(s, p, run);
+        p += run;
+        continue;
+      }
+
+      const uint8_t *run_end = *p >= 0x80 ? screen_put_utf8_run(s, p, end) : p;
+      if (run_end != p) {
+        p = run_end;
+        continue;
+      }
+    }
+
+    screen_feed_byte(s, *p++);
+  }
+}
+
+static inline void screen_append_utf8(std::string *out, uint32_t cp) {
+  if (cp == CELL_WIDE_TAIL) return;  // The head cell already took both columns.
+
+  if (cp == 0) {
+    out->push_back(' ');
+  } else if (cp < 0x80) {
+    out->push_back((char)cp);
+  } else if (cp < 0x800) {
+    out->push_back((char)(0xc0 | (cp >> 6)));
+    out->push_back((char)(0x80 | (cp & 0x3f)));
+  } else if (cp < 0x10000) {
+    out->push_back((char)(0xe0 | (cp >> 12)));
+    out->push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+    out->push_back((char)(0x80 | (cp & 0x3f)));
+  } else {
+    out->push_back((char)(0xf0 | (cp >> 18)));
+    out->push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+    out->push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+    out->push_back((char)(0x80 | (cp & 0x3f)));
+  }
+}
+
+static inline int screen_format_color(char *buf, size_t buf_len, int sgr, uint32_t color) {
+  if (COLOR_KIND(color) == COLOR_PALETTE) return snprintf(buf, buf_len, ";%d;5;%u", sgr, color & 0xff);
+  if (COLOR_KIND(color) != COLOR_RGB) return 0;
+  return snprintf(buf, buf_len, ";%d;2;%u;%u;%u", sgr, (color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
+}
+
+static inline void screen_append_sgr(std::string *out, const Style &st) {
+  char buf[96];
+  int len = snprintf(buf, sizeof(buf), "\x1b[0%s%s%s%s%s%s", st.attrs & ATTR_BOLD ? ";1" : "",
+                     st.attrs & ATTR_DIM ? ";2" : "", st.attrs & ATTR_ITALIC ? ";3" : "",
+                     st.attrs & ATTR_UNDERLINE ? ";4" : "", st.attrs & ATTR_BLINK ? ";5" : "",
+                     st.attrs & ATTR_REVERSE ? ";7" : "");
+  len += screen_format_color(buf + len, sizeof(buf) - len, 38, st.fg);
+  len += screen_format_color(buf + len, sizeof(buf) - len, 48, st.bg);
+  buf[len++] = 'm';
+  out->append(buf, len);
+}
+
+// OSC 8 switching to `link`, 0 closes the open one.
+static inline void screen_append_link(const Screen *s, uint16_t link, std::string *out) {
+  out->append("\x1b]8;;");
+  if (link != 0) out->append(s->styles.links[link]);
+  out->append("\x1b\\");
+}
+
+// Moves the outer terminal from style `*last` to `st`.
+static inline void screen_append_style(const Screen *s, const Style &st, Style *last, std::string *out) {
+  if (st.link != last->link) screen_append_link(s, st.link, out);
+  if (st.fg != last->fg || st.bg != last->bg || st.attrs != last->attrs) screen_append_sgr(out, st);
+  *last = st;
+}
+
+// Appends `width` cells of `row` starting at column 0 as text with SGR changes. The caller positions the cursor first.
+// `last` carries the style already active on the outer terminal across calls, a hyperlink it has open is left open.
+static inline void screen_render_row(const Screen *s, int row, int width, std::string *out, Style *last) {
+  const Cell *line = screen_row(s, row);
+  if (width > s->cols) width = s->cols;
+
+  for (int c = 0; c < width; c++) {
+    const Style &st = s->styles.styles[line[c].style];
+    if (!style_equal(st, *last)) screen_append_style(s, st, last, out);
+
+    // A wide character goes out with its tail or not at all, so the outer terminal's columns stay in step with ours.
+    uint32_t cp = line[c].cp;
+    bool wide = cp != 0 && cp != CELL_WIDE_TAIL && utf8_width(cp) == 2;
+    if (wide && c + 1 < width && line[c + 1].cp == CELL_WIDE_TAIL) {
+      screen_append_utf8(out, cp);
+      c++;
+    } else if (wide || cp == CELL_WIDE_TAIL) {
+      out->push_back(' ');
+    } else {
+      screen_append_utf8(out, cp);
+    }
+  }
+}
+
+// Full repaint of the screen at the top-left of the outer terminal, leaving the cursor where the model has it.
+static inline void screen_snapshot(const Screen *s, std::string *out) {
+  char buf[32];
+  Style last{};
+
+  out->append("\x1b[0m\x1b[H\x1b[2J");
+  for (int r = 0; r < s->rows; r++) {
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", r + 1);
+    out->append(buf, len);
+    screen_render_row(s, r, s->cols, out, &last);
+  }
+
+  if (last.link != 0) screen_append_link(s, 0, out);
+
+  int len = snprintf(buf, sizeof(buf), "\x1b[0m\x1b[%d;%dH", s->cur_row + 1, s->cur_col + 1);
+  out->append(buf, len);
+  screen_append_sgr(out, s->pen);
+  if (s->pen.link != 0) screen_append_link(s, s->pen.link, out);
+  out->append(s->cursor_visible ? "\x1b[?25h" : "\x1b[?25l");
+}
+
+#endif  // SCREEN_H_
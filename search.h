@@ -0,0 +1,408 @@
+#ifndef SEARCH_H_
+#define SEARCH_H_
+
+// Full-text index of recorded output, one `<segment>.idx` next to every segment. A query reads a few kilobytes of
+// each index instead of grepping gigabytes of typescript.
+//
+// Lines are indexed as text, after `ansi_strip` and ASCII case folding. They are grouped into blocks of about
+// SEARCH_BLOCK_BYTES, and every trigram of a block's lines points to the block: a query looks up the trigrams of the
+// needle, intersects their block lists and only reads and verifies the lines of the blocks left over. Needles of
+// fewer than three bytes check every block.
+//
+// Every line also gets a time, from the segment's header and `.timing` file: the segment header names the session
+// and the wall-clock millisecond the segment's first chunk came in, the timing lines add up from there. A segment
+// recorded without timing gets neither, its lines have time 0.
+//
+// Layout, native byte order since the index is read where it was built:
+//   SearchHeader
+//   uint64_t line_offsets[n_lines + 1]  Segment offset of every line, then `covered`.
+//   uint32_t line_ms[n_lines]           Milliseconds from `start_ms` to the chunk the line began in.
+//   uint32_t block_lines[n_blocks + 1]  First line of every block, then `n_lines`.
+//   SearchGram grams[n_grams]           Sorted by gram.
+//   uint8_t postings[]                  Every gram's blocks, ascending, as varint deltas.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ansi.h"
+
+#define SEARCH_MAGIC 0x31494d54  // "TMI1"
+#define SEARCH_INDEX_FMT "%s.idx"
+#define SEARCH_BLOCK_BYTES 8192  // Stripped text per block: smaller blocks verify less, but grow the postings.
+#define SEARCH_GRAM_BITS 24
+#define SEARCH_HEADER_PREFIX "Script started on "
+
+struct SearchHeader {
+  uint32_t magic;
+  uint32_t session;   // Pid of the recording termy, 0 if unknown.
+  uint64_t start_ms;  // Wall clock of the segment's first chunk, 0 if unknown.
+  uint64_t covered;   // Segment bytes indexed, a longer segment has grown since.
+  uint32_t n_lines;
+  uint32_t n_blocks;
+  uint32_t n_grams;
+  uint32_t postings_len;
+};
+
+struct SearchGram {
+  uint32_t gram;
+  uint32_t offset;  // Into `postings`.
+  uint32_t count;   // Blocks.
+};
+
+struct SearchIndex {
+  void *map;
+  size_t map_len;
+  const SearchHeader *header;
+  const uint64_t *line_offsets;
+  const uint32_t *line_ms;
+  const uint32_t *block_lines;
+  const SearchGram *grams;
+  const uint8_t *postings;
+};
+
+static inline char search_fold(char c) {
+  return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+}
+
+static inline uint32_t search_gram(const char *p) {
+  return (uint32_t)(uint8_t)p[0] << 16 | (uint32_t)(uint8_t)p[1] << 8 | (uint8_t)p[2];
+}
+
+// Text of the line at `[begin, end)`, stripped and case folded into `folded`, and only stripped into `text` if given.
+static inline void search_line_text(const char *begin, const char *end, std::string *folded, std::string *text) {
+  AnsiStripper strip;
+  ansi_strip_init(&strip);
+  folded->resize(end - begin);
+  folded->resize(ansi_strip(&strip, begin, end - begin, &(*folded)[0]));
+  if (text != nullptr) *text = *folded;
+  for (char &c : *folded) c = search_fold(c);
+}
+
+struct SearchPosting {
+  uint32_t last;  // Last block added.
+  uint32_t count;
+  std::string deltas;
+};
+
+static inline void search_put_varint(std::string *out, uint32_t v) {
+  while (v >= 0x80) {
+    out->push_back((char)(v | 0x80));
+    v >>= 7;
+  }
+  out->push_back((char)v);
+}
+
+static inline const uint8_t *search_get_varint(const uint8_t *p, uint32_t *v) {
+  uint32_t x = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t b = *p++;
+    x |= (uint32_t)(b & 0x7f) << shift;
+    if (b < 0x80) break;
+  }
+  *v = x;
+  return p;
+}
+
+// Session and start time from a segment's header line, "Script started on ... [termy session=N start=MS]".
+static inline size_t search_parse_header(const char *data, size_t len, uint32_t *session, uint64_t *start_ms) {
+  *session = 0;
+  *start_ms = 0;
+  size_t prefix_len = strlen(SEARCH_HEADER_PREFIX);
+  if (len < prefix_len || memcmp(data, SEARCH_HEADER_PREFIX, prefix_len) != 0) return 0;
+
+  const char *newline = (const char *)memchr(data, '\n', len);
+  if (newline == nullptr) return 0;
+
+  std::string line(data, newline - data);
+  const char *v;
+  if ((v = strstr(line.c_str(), "session=")) != nullptr) *session = (uint32_t)strtoul(v + 8, nullptr, 10);
+  if ((v = strstr(line.c_str(), "start=")) != nullptr) *start_ms = strtoull(v + 6, nullptr, 10);
+  return newline + 1 - data;
+}
+
+// Chunk boundaries of a segment from its timing file: `ends[i]` is the segment offset the i-th chunk ends at,
+// `ms[i]` its time since the first chunk. False when there is no timing file.
+static inline bool search_read_timing(const char *timing_path, uint64_t data_start, std::vector<uint64_t> *ends,
+                                      std::vector<uint32_t> *ms) {
+  FILE *f = fopen(timing_path, "re");
+  if (f == nullptr) return false;
+
+  double t = 0;
+  uint64_t offset = data_start;
+  double delay;
+  unsigned long long bytes;
+  bool first = true;
+  while (fscanf(f, "%lf %llu", &delay, &bytes) == 2) {
+    if (!first) t += delay;  // The first delay counts from the previous segment's last chunk.
+    first = false;
+    offset += bytes;
+    ends->push_back(offset);
+    ms->push_back((uint32_t)(t * 1e3 + 0.5));
+  }
+
+  fclose(f);
+  return true;
+}
+
+// Writes `index_path` for the segment at `segment_path`, through a temporary file so concurrent queries see either
+// index whole. Returns false with errno set.
+static inline bool search_index_build(const char *segment_path, const char *timing_path, const char *index_path) {
+  int fd = open(segment_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    int prev_errno = errno;
+    close(fd);
+    errno = prev_errno;
+    return false;
+  }
+
+  size_t size = (size_t)st.st_size;
+  const char *data = nullptr;
+  if (size > 0) {
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      int prev_errno = errno;
+      close(fd);
+      errno = prev_errno;
+      return false;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    data = (const char *)map;
+  }
+  close(fd);
+
+  SearchHeader header = {};
+  header.magic = SEARCH_MAGIC;
+  size_t data_start = search_parse_header(data, size, &header.session, &header.start_ms);
+
+  std::vector<uint64_t> chunk_ends;
+  std::vector<uint32_t> chunk_ms;
+  if (timing_path != nullptr) search_read_timing(timing_path, data_start, &chunk_ends, &chunk_ms);
+
+  // A segment still being recorded may end mid-line: that line is indexed as far as it goes and whole on the next
+  // build, which the grown segment triggers.
+  const char *end = data + size;
+
+  std::vector<uint64_t> line_offsets;
+  std::vector<uint32_t> line_ms;
+  std::vector<uint32_t> block_lines;
+  std::unordered_map<uint32_t, SearchPosting> postings;
+
+  // Trigrams seen in the current block, a bit per possible gram.
+  std::vector<uint64_t> seen((1u << SEARCH_GRAM_BITS) / 64);
+  std::vector<uint32_t> block_grams;
+  size_t block_bytes = 0;
+  size_t chunk = 0;
+  std::string folded;
+
+  auto close_block = [&]() {
+    uint32_t block = (uint32_t)block_lines.size() - 1;
+    for (uint32_t gram : block_grams) {
+      seen[gram / 64] &= ~(1ull << (gram % 64));
+      SearchPosting &p = postings[gram];
+      search_put_varint(&p.deltas, p.count == 0 ? block : block - p.last);
+      p.last = block;
+      p.count++;
+    }
+    block_grams.clear();
+    block_bytes = 0;
+  };
+
+  for (const char *p = data + data_start; p < end;) {
+    const char *newline = (const char *)memchr(p, '\n', end - p);
+    const char *line_end = newline != nullptr ? newline + 1 : end;
+
+    uint64_t offset = p - data;
+    while (chunk < chunk_ends.size() && chunk_ends[chunk] <= offset) chunk++;
+    if (block_bytes == 0) block_lines.push_back((uint32_t)line_offsets.size());
+    line_offsets.push_back(offset);
+    line_ms.push_back(chunk < chunk_ms.size() ? chunk_ms[chunk] : chunk_ms.empty() ? 0 : chunk_ms.back());
+
+    search_line_text(p, line_end, &folded, nullptr);
+    for (size_t i = 0; i + 3 <= folded.size(); i++) {
+      uint32_t gram = search_gram(&folded[i]);
+      uint64_t bit = 1ull << (gram % 64);
+      if (seen[gram / 64] & bit) continue;
+      seen[gram / 64] |= bit;
+      block_grams.push_back(gram);
+    }
+
+    block_bytes += folded.size() + 1;
+    if (block_bytes >= SEARCH_BLOCK_BYTES) close_block();
+    p = line_end;
+  }
+  if (block_bytes > 0) close_block();
+
+  header.covered = end - data;
+  header.n_lines = (uint32_t)line_offsets.size();
+  header.n_blocks = (uint32_t)block_lines.size();
+  line_offsets.push_back(header.covered);
+  block_lines.push_back(header.n_lines);
+  if (data != nullptr) munmap((void *)data, size);
+
+  std::vector<uint32_t> sorted;
+  sorted.reserve(postings.size());
+  for (const auto &entry : postings) sorted.push_back(entry.first);
+  std::sort(sorted.begin(), sorted.end());
+
+  std::vector<SearchGram> grams;
+  std::string all_postings;
+  grams.reserve(sorted.size());
+  for (uint32_t gram : sorted) {
+    const SearchPosting &p = postings[gram];
+    grams.push_back(SearchGram{gram, (uint32_t)all_postings.size(), p.count});
+    all_postings += p.deltas;
+  }
+  header.n_grams = (uint32_t)grams.size();
+  header.postings_len = (uint32_t)all_postings.size();
+
+  std::string tmp_path = std::string(index_path) + ".tmp";
+  FILE *out = fopen(tmp_path.c_str(), "we");
+  if (out == nullptr) return false;
+
+  bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+            fwrite(line_offsets.data(), sizeof(uint64_t), line_offsets.size(), out) == line_offsets.size() &&
+            fwrite(line_ms.data(), sizeof(uint32_t), line_ms.size(), out) == line_ms.size() &&
+            fwrite(block_lines.data(), sizeof(uint32_t), block_lines.size(), out) == block_lines.size() &&
+            fwrite(grams.data(), sizeof(SearchGram), grams.size(), out) == grams.size() &&
+            fwrite(all_postings.data(), 1, all_postings.size(), out) == all_postings.size();
+  int prev_errno = errno;
+  if (fclose(out) != 0 && ok) {
+    ok = false;
+    prev_errno = errno;
+  }
+
+  if (!ok || rename(tmp_path.c_str(), index_path) == -1) {
+    if (ok) prev_errno = errno;
+    unlink(tmp_path.c_str());
+    errno = prev_errno;
+    return false;
+  }
+  return true;
+}
+
+// Maps an index. Returns false with errno set, EINVAL for a file that is not one.
+static inline bool search_index_open(const char *index_path, SearchIndex *idx) {
+  int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    int prev_errno = errno;
+    close(fd);
+    errno = prev_errno;
+    return false;
+  }
+  if ((size_t)st.st_size < sizeof(SearchHeader)) {
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int prev_errno = errno;
+  close(fd);
+  if (map == MAP_FAILED) {
+    errno = prev_errno;
+    return false;
+  }
+
+  const SearchHeader *h = (const SearchHeader *)map;
+  size_t expected = sizeof(SearchHeader) + (h->n_lines + 1ull) * sizeof(uint64_t) + h->n_lines * sizeof(uint32_t) +
+                    (h->n_blocks + 1ull) * sizeof(uint32_t) + h->n_grams * sizeof(SearchGram) + h->postings_len;
+  if (h->magic != SEARCH_MAGIC || expected != (size_t)st.st_size) {
+    munmap(map, st.st_size);
+    errno = EINVAL;
+    return false;
+  }
+
+  const char *p = (const char *)map + sizeof(SearchHeader);
+  idx->map = map;
+  idx->map_len = st.st_size;
+  idx->header = h;
+  idx->line_offsets = (const uint64_t *)p;
+  p += (h->n_lines + 1ull) * sizeof(uint64_t);
+  idx->line_ms = (const uint32_t *)p;
+  p += h->n_lines * sizeof(uint32_t);
+  idx->block_lines = (const uint32_t *)p;
+  p += (h->n_blocks + 1ull) * sizeof(uint32_t);
+  idx->grams = (const SearchGram *)p;
+  p += h->n_grams * sizeof(SearchGram);
+  idx->postings = (const uint8_t *)p;
+  return true;
+}
+
+static inline void search_index_close(SearchIndex *idx) {
+  munmap(idx->map, idx->map_len);
+}
+
+static inline const SearchGram *search_find_gram(const SearchIndex *idx, uint32_t gram) {
+  const SearchGram *begin = idx->grams;
+  const SearchGram *end = begin + idx->header->n_grams;
+  const SearchGram *found =
+      std::lower_bound(begin, end, gram, [](const SearchGram &g, uint32_t key) { return g.gram < key; });
+  return found != end && found->gram == gram ? found : nullptr;
+}
+
+// Blocks that may hold a line containing `needle`, already case folded.
+static inline void search_candidate_blocks(const SearchIndex *idx, const char *needle, size_t len,
+                                           std::vector<uint32_t> *blocks) {
+  blocks->clear();
+  if (len < 3) {
+    for (uint32_t b = 0; b < idx->header->n_blocks; b++) blocks->push_back(b);
+    return;
+  }
+
+  std::vector<const SearchGram *> grams;
+  for (size_t i = 0; i + 3 <= len; i++) {
+    const SearchGram *g = search_find_gram(idx, search_gram(needle + i));
+    if (g == nullptr) return;
+    grams.push_back(g);
+  }
+
+  // Rarest first, so every later list only thins out an already short one.
+  std::sort(grams.begin(), grams.end(), [](const SearchGram *a, const SearchGram *b) {
+    return a->count != b->count ? a->count < b->count : a < b;
+  });
+  grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+
+  const uint8_t *p = idx->postings + grams[0]->offset;
+  uint32_t block = 0;
+  for (uint32_t i = 0; i < grams[0]->count; i++) {
+    uint32_t delta;
+    p = search_get_varint(p, &delta);
+    block = i == 0 ? delta : block + delta;
+    blocks->push_back(block);
+  }
+
+  for (size_t g = 1; g < grams.size() && !blocks->empty(); g++) {
+    p = idx->postings + grams[g]->offset;
+    size_t kept = 0;
+    size_t next = 0;
+    block = 0;
+    for (uint32_t i = 0; i < grams[g]->count && next < blocks->size(); i++) {
+      uint32_t delta;
+      p = search_get_varint(p, &delta);
+      block = i == 0 ? delta : block + delta;
+      while (next < blocks->size() && (*blocks)[next] < block) next++;
+      if (next < blocks->size() && (*blocks)[next] == block) (*blocks)[kept++] = (*blocks)[next++];
+    }
+    blocks->resize(kept);
+  }
+}
+
+#endif  // SEARCH_H_
@@ -0,0 +1,1453 @@
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "handoff.h"
+#include "pool.h"
+#include "screen.h"
+#include "timer_wheel.h"
+
+#define SLAVE_NAME_BUF_SIZE 512
+#define READ_BUF_SIZE 65536
+#define DEBUG_BUF_SIZE 1024
+#define MAX_EVENTS 64
+#define POOL_INITIAL_CHUNKS 16
+#define SESSION_READ_MIN 4096  // Smaller tails of a pool chunk are left unused, a read gets a fresh chunk.
+#define CLIENT_WRITEV_MAX 64
+
+#define CLIENT_PREFIX_KEY 0x01           // ^A, followed by 'd' detaches.
+#define CLIENT_BACKLOG_MAX (1024 * 1024)  // Past this a slow client gets a fresh snapshot instead of the stream.
+
+#define SESSION_DEFAULT_ROWS 24  // For a client whose terminal reports a zero size.
+#define SESSION_DEFAULT_COLS 80
+#define SESSION_MAX_ROWS 1000
+#define SESSION_MAX_COLS 1000
+
+#define MONITOR_SILENCE_ENV "TERMY_SILENCE_SECS"  // Quiet this long is a silence event, 0 or unset turns it off.
+#define MONITOR_HOOK_ENV "TERMY_MONITOR_HOOK"     // Run with `sh -c` on every silence and activity event.
+#define MONITOR_ENV_BUF_SIZE 64
+
+#define DBG(...) debug(__FILE__, __LINE__, __VA_ARGS__)
+
+#define FAIL_IF_WITH_CODE(exp, msg) \
+  if (exp) {                        \
+    perror(msg);                    \
+    exit(EXIT_FAILURE);             \
+  }
+
+#define FAIL_IF(exp, msg) \
+  if (exp) {              \
+    printf(msg);          \
+    printf("\n");         \
+    exit(EXIT_FAILURE);   \
+  }
+
+using namespace std;
+
+enum MsgType : uint32_t {
+  MSG_NEW,      // Client -> server, AttachMsg. Starts a session and attaches to it.
+  MSG_ATTACH,   // Client -> server, AttachMsg.
+  MSG_INPUT,    // Client -> server, raw key bytes.
+  MSG_RESIZE,   // Client -> server, struct winsize.
+  MSG_DETACH,   // Both ways, empty.
+  MSG_LIST,     // Client -> server empty, server -> client text.
+  MSG_OUTPUT,   // Server -> client, bytes for the terminal.
+  MSG_EXIT,     // Server -> client, int32 wait status of the shell.
+  MSG_ERROR,    // Server -> client, text.
+  MSG_UPGRADE,  // Client -> server, path of the binary to hand over to. Server -> client, text, from the new binary.
+};
+
+struct MsgHeader {
+  uint32_t type;
+  uint32_t len;
+};
+
+// Same host, same ABI: termios and winsize are sent as they are.
+struct AttachMsg {
+  uint32_t session_id;
+  struct winsize ws;
+  struct termios tio;
+};
+
+struct Client;
+
+// First member of everything registered with epoll, so an event can be dispatched without a lookup.
+enum TagKind { TAG_SESSION, TAG_CLIENT };
+
+struct Session {
+  TagKind kind;
+  uint32_t id;
+  pid_t pid;
+  int master_fd;
+  Screen screen;
+  QueryFilter queries;  // Keeps what the model answers from reaching the client's terminal as well.
+  Client *client;
+  string input;  // For the master, what it did not take yet goes out on EPOLLOUT.
+  bool watching_out;
+
+  bool exited;  // Collected by `reap_children`, `exit_status` is its wait status.
+  int exit_status;
+
+  // Activity monitor. A read only stores the time, the timer is left at the deadline it was armed for and moved
+  // when it fires early: a busy session touches the wheel once per silence period, not once per read.
+  Timer silence_timer;
+  uint64_t last_output_ms;
+  bool silent;
+};
+
+struct Client {
+  TagKind kind;
+  int fd;
+  Session *session;
+  string in_buf;
+  BufQueue out;  // Shares the session's output chunks, nothing is copied per client.
+  bool needs_snapshot;  // Fell behind, the backlog was skipped and a snapshot is due once the socket drains.
+};
+
+int epoll_fd;
+int server_listen_fd;
+struct sockaddr_un server_addr;
+vector<Session *> sessions;
+vector<Session *> exiting;  // Master closed, waiting for `reap_children` to collect the shell.
+vector<Client *> clients;
+uint32_t next_session_id = 1;
+char read_buf[READ_BUF_SIZE];
+BufferPool pool;
+
+TimerWheel timers;
+uint64_t loop_ms;           // Taken once per loop iteration, the time timer callbacks see.
+uint64_t silence_ms;        // 0 when the monitor is off.
+const char *monitor_hook;  // nullptr when events only go to the stats.
+size_t silence_events;
+size_t activity_events;
+
+extern char **environ;
+
+struct termios tty_orig;
+volatile sig_atomic_t got_sigwinch = 0;
+volatile sig_atomic_t got_sigchld = 0;
+
+void debug(const char *file_name, int line_no, const char *msg, ...) {
+  int f = open("pty.log", O_CREAT | O_APPEND | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  FAIL_IF_WITH_CODE(f == -1, "Cannot open debug file");
+
+  int fmt_len;
+
+  va_list args;
+  va_start(args, msg);
+
+  char fmt_buf[DEBUG_BUF_SIZE];
+  const char *debug_fmt = "[\x1b[93m%s\x1b[39m:\x1b[96m%d\x1b[0m] %s\n";
+  fmt_len = snprintf(fmt_buf, DEBUG_BUF_SIZE, debug_fmt, file_name, line_no, msg);
+  FAIL_IF(fmt_len >= DEBUG_BUF_SIZE, "Debug fmt buffer overflow.");
+
+  char buf[DEBUG_BUF_SIZE];
+
+  int len = vsnprintf(buf, DEBUG_BUF_SIZE, fmt_buf, args);
+  FAIL_IF(len >= DEBUG_BUF_SIZE, "Debug buffer overflow.");
+
+  FAIL_IF_WITH_CODE(write(f, buf, strlen(buf)) == -1, "Cannot write to debug file");
+
+  va_end(args);
+
+  close(f);
+}
+
+int open_master_pty(char *slave_name_buf, int slave_name_max_len) {
+  int prev_errno;
+
+  // Opening the unused master.
+  int pty_master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (pty_master_fd == -1) {
+    DBG("Error: cannot create master PTY.");
+    return -1;
+  }
+
+  // Change slave ownership and permission.
+  if (grantpt(pty_master_fd) == -1 || unlockpt(pty_master_fd) == -1) {
+    DBG("Error: failed preparing slave.");
+
+    prev_errno = errno;
+    close(pty_master_fd);
+    errno = prev_errno;
+
+    return -1;
+  }
+
+  char *slave_name = ptsname(pty_master_fd);
+  if (slave_name == nullptr) {
+    DBG("Error: cannot obtain slave name.");
+
+    prev_errno = errno;
+    close(pty_master_fd);
+    errno = prev_errno;
+
+    return -1;
+  }
+
+  int slave_name_len = strlen(slave_name);
+  if (slave_name_len >= slave_name_max_len) {
+    DBG("Error: slave name is too large (%d), cannot fit into %d bytes.", slave_name_len, slave_name_max_len);
+
+    close(pty_master_fd);
+    errno = EOVERFLOW;
+
+    return -1;
+  }
+
+  strncpy(slave_name_buf, slave_name, slave_name_max_len);
+
+  return pty_master_fd;
+}
+
+pid_t pty_fork(int *master_pty_fd, const struct termios *slave_termios, const struct winsize *slave_winsize) {
+  char _slave_name_buf[SLAVE_NAME_BUF_SIZE];
+  int _master_pty_fd = open_master_pty(_slave_name_buf, SLAVE_NAME_BUF_SIZE);
+  if (_master_pty_fd == -1) return -1;
+
+  int prev_errno;
+
+  pid_t child_pid = fork();
+  if (child_pid == -1) {
+    prev_errno = errno;
+    close(_master_pty_fd);
+    errno = prev_errno;
+
+    return -1;
+  }
+
+  if (child_pid != 0) {  // Parent.
+    *master_pty_fd = _master_pty_fd;
+    return child_pid;
+  }
+
+  // Child.
+
+  FAIL_IF_WITH_CODE(setsid() == -1, "Error: cannot start session");
+
+  close(_master_pty_fd);
+
+  // Becoming controlling tty.
+  int slave_pty_fd = open(_slave_name_buf, O_RDWR);
+  FAIL_IF_WITH_CODE(slave_pty_fd == -1, "Error: cannot open slave file");
+
+#ifdef TIOCSCTTY
+  FAIL_IF_WITH_CODE(ioctl(slave_pty_fd, TIOCSCTTY, 0) == -1, "Error: cannot become controlling tty on BSD");
+#endif
+
+  if (slave_termios != nullptr) {
+    FAIL_IF_WITH_CODE(tcsetattr(slave_pty_fd, TCSANOW, slave_termios) == -1, "Error: cannot apply termios settings");
+  }
+
+  if (slave_winsize != nullptr) {
+    FAIL_IF_WITH_CODE(ioctl(slave_pty_fd, TIOCSWINSZ, slave_winsize) == -1, "Error: cannot set winsize");
+  }
+
+  FAIL_IF_WITH_CODE(dup2(slave_pty_fd, STDIN_FILENO) != STDIN_FILENO, "Error: cannot clone stdin");
+  FAIL_IF_WITH_CODE(dup2(slave_pty_fd, STDOUT_FILENO) != STDOUT_FILENO, "Error: cannot clone stdout");
+  FAIL_IF_WITH_CODE(dup2(slave_pty_fd, STDERR_FILENO) != STDERR_FILENO, "Error: cannot clone stderr");
+
+  if (slave_pty_fd > STDERR_FILENO) {
+    close(slave_pty_fd);
+  }
+
+  return 0;
+}
+
+static void tty_reset(void) {
+  if (tcsetattr(STDIN_FILENO, TCSANOW, &tty_orig) == -1) {
+    printf("Error: failed resetting tty.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+int tty_set_raw(int fd, struct termios *prev_termios) {
+  struct termios t;
+
+  if (tcgetattr(fd, &t) == -1) {
+    printf("Error: cannot get tty config.\n");
+    return -1;
+  }
+
+  if (prev_termios != nullptr) {
+    *prev_termios = t;
+  }
+
+  t.c_lflag &= ~(ICANON | ISIG | IEXTEN | ECHO);
+  t.c_iflag &= ~(BRKINT | ICRNL | IGNBRK | IGNCR | INLCR | INPCK | ISTRIP | IXON | PARMRK);
+
+  t.c_oflag &= ~OPOST;
+
+  t.c_cc[VMIN] = 1;
+  t.c_cc[VTIME] = 0;
+
+  if (tcsetattr(fd, TCSAFLUSH, &t) == -1) {
+    return -1;
+  }
+
+  return 0;
+}
+
+void sig_handler(int sig_no) {
+  if (sig_no == SIGWINCH) got_sigwinch = 1;
+  if (sig_no == SIGCHLD) got_sigchld = 1;
+}
+
+// The signal stays blocked outside of `epoll_pwait`/`ppoll`, so it can only interrupt the loop while it is idle.
+void setup_signal_handler(int sig_no, sigset_t *wait_mask) {
+  struct sigaction sa {
+    0
+  };
+
+  sa.sa_flags = 0;
+  sa.sa_handler = &sig_handler;
+
+  FAIL_IF_WITH_CODE(sigaction(sig_no, &sa, nullptr) == -1, "Error: cannot set signal handlers");
+
+  sigset_t block_mask;
+  sigemptyset(&block_mask);
+  sigaddset(&block_mask, sig_no);
+  FAIL_IF_WITH_CODE(sigprocmask(SIG_BLOCK, &block_mask, wait_mask) == -1, "Error: cannot block signals");
+
+  sigdelset(wait_mask, sig_no);
+}
+
+void write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, buf, len);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        poll(&pfd, 1, -1);
+        continue;
+      }
+
+      DBG("Error: invalid write to fd %d: %s.", fd, strerror(errno));
+      return;
+    }
+
+    buf += written;
+    len -= written;
+  }
+}
+
+void send_msg(int fd, uint32_t type, const void *payload, uint32_t len) {
+  MsgHeader header = {type, len};
+  write_all(fd, (const char *)&header, sizeof(header));
+  if (len > 0) write_all(fd, (const char *)payload, len);
+}
+
+// Pops one complete message off the front of `buf`. Returns false while the message is still incomplete.
+bool take_msg(string *buf, MsgHeader *header, string *payload) {
+  if (buf->size() < sizeof(MsgHeader)) return false;
+
+  memcpy(header, buf->data(), sizeof(MsgHeader));
+  if (buf->size() < sizeof(MsgHeader) + header->len) return false;
+
+  payload->assign(*buf, sizeof(MsgHeader), header->len);
+  buf->erase(0, sizeof(MsgHeader) + header->len);
+  return true;
+}
+
+void socket_path(const char *override_path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (override_path != nullptr) {
+    FAIL_IF(strlen(override_path) >= sizeof(addr->sun_path), "Error: socket path too long.");
+    strncpy(addr->sun_path, override_path, sizeof(addr->sun_path) - 1);
+  } else {
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/termy-%d.sock", (int)getuid());
+  }
+}
+
+//
+// Server.
+//
+
+void client_update_events(Client *c) {
+  struct epoll_event ev {
+    0
+  };
+  ev.events = EPOLLIN | (c->out.count > 0 ? (uint32_t)EPOLLOUT : 0);
+  ev.data.ptr = c;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void client_flush(Client *c) {
+  while (c->out.count > 0) {
+    struct iovec iov[CLIENT_WRITEV_MAX];
+    int iov_len = 0;
+    for (size_t i = 0; i < c->out.count && iov_len < CLIENT_WRITEV_MAX; i++) {
+      BufRef *ref = buf_queue_at(&c->out, i);
+      size_t skip = i == 0 ? c->out.sent : 0;
+      iov[iov_len].iov_base = ref->data + skip;
+      iov[iov_len].iov_len = ref->len - skip;
+      iov_len++;
+    }
+
+    ssize_t written = writev(c->fd, iov, iov_len);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      break;  // EAGAIN waits for EPOLLOUT, anything else surfaces as a hangup on the next read.
+    }
+    buf_queue_consume(&pool, &c->out, written);
+  }
+
+  client_update_events(c);
+}
+
+// Control messages and snapshots are copied into the pool, they are rare and may be larger than a chunk: the bytes
+// are spread over as many pieces as it takes, the socket sees one stream either way.
+void client_queue_bytes(Client *c, const void *buf, size_t len) {
+  while (len > 0) {
+    size_t avail;
+    char *dst = pool_reserve(&pool, 1, &avail);
+    FAIL_IF(dst == nullptr, "Error: out of memory for the client backlog.");
+
+    size_t piece = len < avail ? len : avail;
+    memcpy(dst, buf, piece);
+    buf_queue_push(&c->out, pool_commit(&pool, piece));
+    buf = (const char *)buf + piece;
+    len -= piece;
+  }
+}
+
+void client_queue(Client *c, uint32_t type, const void *payload, uint32_t len) {
+  MsgHeader header = {type, len};
+  client_queue_bytes(c, &header, sizeof(header));
+  client_queue_bytes(c, payload, len);
+  client_flush(c);
+}
+
+// The attach cost is one full repaint of the current grid: it does not depend on how long the session has run.
+void client_send_snapshot(Client *c) {
+  string snapshot;
+  screen_snapshot(&c->session->screen, &snapshot);
+  client_queue(c, MSG_OUTPUT, snapshot.data(), snapshot.size());
+  query_filter_init(&c->session->queries, false);  // Output from here on starts at a sequence boundary.
+  c->needs_snapshot = false;
+}
+
+Client *client_add(int fd) {
+  Client *c = new Client();
+  c->kind = TAG_CLIENT;
+  c->fd = fd;
+  c->session = nullptr;
+  buf_queue_init(&c->out);
+  c->needs_snapshot = false;
+
+  struct epoll_event ev {
+    0
+  };
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  clients.push_back(c);
+  return c;
+}
+
+void client_close(Client *c) {
+  DBG("Client %d gone.", c->fd);
+
+  if (c->session != nullptr && c->session->client == c) c->session->client = nullptr;
+  for (Session *s : exiting) {
+    if (s->client == c) s->client = nullptr;
+  }
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+  close(c->fd);
+  buf_queue_free(&pool, &c->out);
+
+  for (size_t i = 0; i < clients.size(); i++) {
+    if (clients[i] == c) {
+      clients.erase(clients.begin() + i);
+      break;
+    }
+  }
+  delete c;
+}
+
+//
+// Activity monitor.
+//
+
+// Starts the hook and leaves it running, `reap_children` collects it. The event is passed in the environment.
+void monitor_run_hook(const Session *s, const char *event, uint64_t quiet_ms) {
+  if (monitor_hook == nullptr) return;
+
+  char vars[4][MONITOR_ENV_BUF_SIZE];
+  snprintf(vars[0], sizeof(vars[0]), "TERMY_EVENT=%s", event);
+  snprintf(vars[1], sizeof(vars[1]), "TERMY_SESSION=%u", s->id);
+  snprintf(vars[2], sizeof(vars[2]), "TERMY_SESSION_PID=%d", (int)s->pid);
+  snprintf(vars[3], sizeof(vars[3]), "TERMY_QUIET_MS=%llu", (unsigned long long)quiet_ms);
+
+  vector<char *> envp;
+  for (char **e = environ; *e != nullptr; e++) envp.push_back(*e);
+  for (char *var : vars) envp.push_back(var);
+  envp.push_back(nullptr);
+
+  // The hook starts with no signals blocked, the loop keeps SIGCHLD blocked outside of its wait.
+  posix_spawnattr_t attr;
+  sigset_t empty_mask;
+  sigemptyset(&empty_mask);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+  posix_spawnattr_setsigmask(&attr, &empty_mask);
+
+  const char *argv[] = {"sh", "-c", monitor_hook, nullptr};
+  pid_t pid;
+  int code = posix_spawn(&pid, "/bin/sh", nullptr, &attr, (char *const *)argv, envp.data());
+  if (code != 0) DBG("Error: cannot run the monitor hook: %s.", strerror(code));
+  posix_spawnattr_destroy(&attr);
+}
+
+// The silence timer went off. The session may have written since it was armed, then it is only moved.
+void session_silence_fire(void *owner) {
+  Session *s = (Session *)owner;
+  uint64_t deadline = s->last_output_ms + silence_ms;
+  if (deadline > loop_ms) {
+    timer_arm(&timers, &s->silence_timer, deadline);
+    return;
+  }
+
+  s->silent = true;
+  silence_events++;
+  DBG("Session %u silent for %llu ms.", s->id, (unsigned long long)(loop_ms - s->last_output_ms));
+  monitor_run_hook(s, "silence", loop_ms - s->last_output_ms);
+}
+
+// Called on every read from the master, with the monitor on.
+void session_monitor_output(Session *s) {
+  uint64_t now = timer_clock_ms();
+  if (s->silent) {
+    s->silent = false;
+    activity_events++;
+    DBG("Session %u active after %llu ms.", s->id, (unsigned long long)(now - s->last_output_ms));
+    monitor_run_hook(s, "activity", now - s->last_output_ms);
+  }
+
+  s->last_output_ms = now;
+  if (!timer_armed(&s->silence_timer)) timer_arm(&timers, &s->silence_timer, now + silence_ms);
+}
+
+// A terminal reporting a zero size gets the default, an absurd one is cut down: the model has to have a cell.
+void sanitize_winsize(struct winsize *ws) {
+  if (ws->ws_row == 0) ws->ws_row = SESSION_DEFAULT_ROWS;
+  if (ws->ws_col == 0) ws->ws_col = SESSION_DEFAULT_COLS;
+  if (ws->ws_row > SESSION_MAX_ROWS) ws->ws_row = SESSION_MAX_ROWS;
+  if (ws->ws_col > SESSION_MAX_COLS) ws->ws_col = SESSION_MAX_COLS;
+}
+
+void session_update_events(Session *s) {
+  bool want_out = !s->input.empty();
+  if (want_out == s->watching_out) return;
+
+  struct epoll_event ev {
+    0
+  };
+  ev.events = EPOLLIN | (want_out ? (uint32_t)EPOLLOUT : 0);
+  ev.data.ptr = s;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->master_fd, &ev);
+  s->watching_out = want_out;
+}
+
+// Writes as much of the pending input as the master takes now. A shell that does not read only holds up itself.
+void session_flush(Session *s) {
+  size_t done = 0;
+  while (done < s->input.size()) {
+    ssize_t written = write(s->master_fd, s->input.data() + done, s->input.size() - done);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      break;  // EAGAIN waits for EPOLLOUT, anything else shows up as EIO on the next read.
+    }
+    done += written;
+  }
+  s->input.erase(0, done);
+  session_update_events(s);
+}
+
+void session_write(Session *s, const char *buf, size_t len) {
+  s->input.append(buf, len);
+  session_flush(s);
+}
+
+// Query replies queue with the keys. A shell that keeps asking without reading gets no more of them once the
+// queue is past QUERY_REPLY_BACKLOG, they are dropped rather than piled up.
+void session_reply(Session *s) {
+  string *replies = &s->screen.replies;
+  if (s->input.size() + replies->size() <= QUERY_REPLY_BACKLOG) {
+    session_write(s, replies->data(), replies->size());
+  } else {
+    DBG("Session %u is not reading, dropped %zu reply bytes.", s->id, replies->size());
+  }
+  replies->clear();
+}
+
+void session_attach(Session *s, Client *c, const struct winsize *ws) {
+  if (s->client != nullptr) {
+    client_queue(s->client, MSG_DETACH, nullptr, 0);
+    s->client->session = nullptr;
+  }
+
+  if (c->session != nullptr) c->session->client = nullptr;
+  s->client = c;
+  c->session = s;
+
+  if (ioctl(s->master_fd, TIOCSWINSZ, ws) == -1) DBG("Failed resizing session %u.", s->id);
+  screen_resize(&s->screen, ws->ws_row, ws->ws_col);
+  client_send_snapshot(c);
+}
+
+// Starts watching a session whose master is open and non-blocking.
+void session_add(Session *s) {
+  struct epoll_event ev {
+    0
+  };
+  ev.events = EPOLLIN;
+  ev.data.ptr = s;
+  FAIL_IF_WITH_CODE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->master_fd, &ev) == -1, "Error: cannot watch master pty");
+
+  if (silence_ms > 0 && !s->silent) timer_arm(&timers, &s->silence_timer, s->last_output_ms + silence_ms);
+  sessions.push_back(s);
+}
+
+Session *session_spawn(const AttachMsg *msg) {
+  Session *s = new Session();
+  s->kind = TAG_SESSION;
+  s->id = next_session_id++;
+  s->client = nullptr;
+  screen_init(&s->screen, msg->ws.ws_row, msg->ws.ws_col);
+  s->screen.answer_queries = true;  // Also while detached, a query must not leave the shell waiting.
+  query_filter_init(&s->queries, false);
+  timer_init(&s->silence_timer, session_silence_fire, s);
+  s->last_output_ms = timer_clock_ms();
+  s->silent = false;
+  s->watching_out = false;
+  s->exited = false;
+  s->exit_status = 0;
+
+  s->pid = pty_fork(&s->master_fd, &msg->tio, &msg->ws);
+  if (s->pid == -1) {
+    DBG("Error: cannot fork session: %s.", strerror(errno));
+    delete s;
+    return nullptr;
+  }
+
+  if (s->pid == 0) {  // Child.
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    sigprocmask(SIG_SETMASK, &empty_mask, nullptr);
+
+    const char *shell = getenv("SHELL");
+    if (shell == nullptr || *shell == '\0') {
+      shell = "/bin/sh";
+    }
+
+    execlp(shell, shell, (char *)nullptr);
+
+    // Should not get here in execution.
+    printf("Child | Fatal: should not get here in code.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  FAIL_IF_WITH_CODE(fcntl(s->master_fd, F_SETFL, O_NONBLOCK) == -1, "Error: cannot make master pty non-blocking");
+
+  session_add(s);
+  DBG("Session %u started, pid: %d.", s->id, s->pid);
+  return s;
+}
+
+// Tells the client how the shell ended, once it was collected.
+void session_finish(Session *s) {
+  DBG("Session %u done, status: %d.", s->id, s->exit_status);
+
+  if (s->client != nullptr) {
+    int32_t exit_status = s->exit_status;
+    client_queue(s->client, MSG_EXIT, &exit_status, sizeof(exit_status));
+  }
+  delete s;
+}
+
+// The master is gone. A shell not collected yet gets a SIGHUP, its pid is still ours until then, and the session
+// waits in `exiting` for `reap_children`: nothing here blocks on the shell.
+void session_close(Session *s) {
+  DBG("Session %u closed.", s->id);
+
+  timer_cancel(&timers, &s->silence_timer);
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->master_fd, nullptr);
+  close(s->master_fd);
+  s->master_fd = -1;
+
+  for (size_t i = 0; i < sessions.size(); i++) {
+    if (sessions[i] == s) {
+      sessions.erase(sessions.begin() + i);
+      break;
+    }
+  }
+  if (s->client != nullptr) s->client->session = nullptr;  // `s->client` stays, it gets the exit status.
+
+  if (!s->exited) {
+    kill(s->pid, SIGHUP);
+    exiting.push_back(s);
+    return;
+  }
+  session_finish(s);
+}
+
+// The read lands in the pool with room for the message header in front, the client backlog then references it
+// as it is.
+void session_handle_output(Session *s) {
+  size_t avail;
+  char *msg = pool_reserve(&pool, sizeof(MsgHeader) + SESSION_READ_MIN, &avail);
+  FAIL_IF(msg == nullptr, "Error: out of memory for session output.");
+  char *buf = msg + sizeof(MsgHeader);
+  size_t buf_len = avail - sizeof(MsgHeader) < READ_BUF_SIZE ? avail - sizeof(MsgHeader) : READ_BUF_SIZE;
+
+  ssize_t read_len = read(s->master_fd, buf, buf_len);
+  if (read_len <= 0) {
+    if (read_len == -1 && (errno == EAGAIN || errno == EINTR)) return;
+
+    session_close(s);  // EIO once the shell and everything it started are gone.
+    return;
+  }
+  if (silence_ms > 0) session_monitor_output(s);
+
+  // The model is always kept current, it is what a later attach gets. It answers the queries right away.
+  screen_feed(&s->screen, buf, read_len);
+  if (!s->screen.replies.empty()) session_reply(s);
+
+  Client *c = s->client;
+  if (c == nullptr || c->needs_snapshot) return;  // Not committed, the next read reuses the bytes.
+
+  if (c->out.bytes > CLIENT_BACKLOG_MAX) {
+    DBG("Client %d fell behind, skipping to a snapshot.", c->fd);
+    c->needs_snapshot = true;
+    return;
+  }
+
+  size_t len = query_filter(&s->queries, buf, read_len, buf);
+  if (len == 0) {
+    if (s->queries.released_len > 0) client_queue(c, MSG_OUTPUT, s->queries.released, s->queries.released_len);
+    return;
+  }
+
+  // Committed before the released bytes are queued, they reserve from the same chunk. They still go out first.
+  MsgHeader header = {MSG_OUTPUT, (uint32_t)len};
+  memcpy(msg, &header, sizeof(header));
+  BufRef output = pool_commit(&pool, sizeof(header) + len);
+  if (s->queries.released_len > 0) client_queue(c, MSG_OUTPUT, s->queries.released, s->queries.released_len);
+  buf_queue_push(&c->out, output);
+  client_flush(c);
+}
+
+//
+// Hot upgrade.
+//
+
+uint64_t monotonic_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The descriptors go in the order listening socket, masters, clients. The state starts with what any later binary
+// can read and is enough to keep every session going; the rest is only read when `handoff_layout` matches.
+void handoff_save(const Client *requester, uint64_t started_us, string *out, vector<int> *fds) {
+  uint32_t magic = HANDOFF_MAGIC;
+  uint32_t n_sessions = (uint32_t)sessions.size();
+  uint32_t n_clients = (uint32_t)clients.size();
+  int32_t requester_index = -1;
+  for (size_t i = 0; i < clients.size(); i++) {
+    if (clients[i] == requester) requester_index = (int32_t)i;
+  }
+
+  handoff_put(out, &magic, sizeof(magic));
+  handoff_put(out, &n_sessions, sizeof(n_sessions));
+  handoff_put(out, &n_clients, sizeof(n_clients));
+  handoff_put(out, &next_session_id, sizeof(next_session_id));
+  handoff_put(out, &started_us, sizeof(started_us));
+  handoff_put(out, &requester_index, sizeof(requester_index));
+  fds->push_back(server_listen_fd);
+  for (const Session *s : sessions) {
+    handoff_put(out, &s->id, sizeof(s->id));
+    handoff_put(out, &s->pid, sizeof(s->pid));
+    handoff_put(out, &s->screen.rows, sizeof(s->screen.rows));
+    handoff_put(out, &s->screen.cols, sizeof(s->screen.cols));
+    handoff_put(out, &s->exited, sizeof(s->exited));
+    handoff_put(out, &s->exit_status, sizeof(s->exit_status));
+    handoff_put_bytes(out, s->input.data(), s->input.size());
+    fds->push_back(s->master_fd);
+  }
+
+  uint32_t layout = handoff_layout();
+  handoff_put(out, &layout, sizeof(layout));
+  handoff_put(out, &silence_events, sizeof(silence_events));
+  handoff_put(out, &activity_events, sizeof(activity_events));
+  for (const Session *s : sessions) {
+    handoff_put(out, &s->last_output_ms, sizeof(s->last_output_ms));
+    handoff_put(out, &s->silent, sizeof(s->silent));
+    handoff_put(out, &s->queries, sizeof(s->queries));
+    handoff_put_screen(out, &s->screen);
+  }
+
+  string pending;
+  for (Client *c : clients) {
+    int32_t session_index = -1;
+    for (size_t i = 0; i < sessions.size(); i++) {
+      if (sessions[i] == c->session) session_index = (int32_t)i;
+    }
+
+    // The backlog as bytes, the pool does not survive the exec.
+    pending.clear();
+    for (size_t i = 0; i < c->out.count; i++) {
+      BufRef *ref = buf_queue_at(&c->out, i);
+      size_t skip = i == 0 ? c->out.sent : 0;
+      pending.append(ref->data + skip, ref->len - skip);
+    }
+
+    handoff_put(out, &session_index, sizeof(session_index));
+    handoff_put(out, &c->needs_snapshot, sizeof(c->needs_snapshot));
+    handoff_put_bytes(out, c->in_buf.data(), c->in_buf.size());
+    handoff_put_bytes(out, pending.data(), pending.size());
+    fds->push_back(c->fd);
+  }
+}
+
+// Execs `binary` in place of this process and hands it everything over a socketpair it inherits. The pid stays the
+// same, so the shells stay its children. Only returns when the upgrade failed, and then nothing was given up: the
+// descriptors in flight are dropped with the socketpair and this process goes on serving.
+void server_upgrade(Client *requester, const string &binary) {
+  uint64_t started_us = monotonic_us();
+  if (!exiting.empty()) {  // Their clients wait for an exit status only this process can collect.
+    const char *err = "a session is closing, try again";
+    client_queue(requester, MSG_ERROR, err, strlen(err));
+    return;
+  }
+
+  int sv[2];
+  if (access(binary.c_str(), X_OK) == 0 && socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0) {
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);  // Only the receiving end goes across the exec.
+
+    string state;
+    vector<int> fds;
+    handoff_save(requester, started_us, &state, &fds);
+    if (handoff_send(sv[0], state, fds)) {
+      char fd_arg[16];
+      snprintf(fd_arg, sizeof(fd_arg), "%d", sv[1]);
+      const char *argv[] = {binary.c_str(), "-S", server_addr.sun_path, "resume", fd_arg, nullptr};
+
+      DBG("Upgrading to %s: %zu sessions, %zu bytes of state.", binary.c_str(), sessions.size(), state.size());
+      execv(binary.c_str(), (char *const *)argv);
+    }
+
+    int prev_errno = errno;
+    close(sv[0]);
+    close(sv[1]);
+    errno = prev_errno;
+  }
+
+  string err = "cannot upgrade to " + binary + ": " + strerror(errno);
+  DBG("Error: %s.", err.c_str());
+  client_queue(requester, MSG_ERROR, err.data(), err.size());
+}
+
+// The first thing the new binary does: takes over what `server_upgrade` sent. Returns the listening socket.
+int server_resume(int handoff_fd) {
+  Handoff h;
+  FAIL_IF_WITH_CODE(!handoff_receive(handoff_fd, &h), "Error: cannot receive the sessions");
+  close(handoff_fd);
+
+  HandoffReader r = {h.state, h.state + h.state_len, true};
+  uint32_t magic = 0;
+  uint32_t n_sessions = 0;
+  uint32_t n_clients = 0;
+  uint64_t started_us = 0;
+  int32_t requester_index = -1;
+  handoff_get(&r, &magic, sizeof(magic));
+  handoff_get(&r, &n_sessions, sizeof(n_sessions));
+  handoff_get(&r, &n_clients, sizeof(n_clients));
+  handoff_get(&r, &next_session_id, sizeof(next_session_id));
+  handoff_get(&r, &started_us, sizeof(started_us));
+  handoff_get(&r, &requester_index, sizeof(requester_index));
+  FAIL_IF(!r.ok || magic != HANDOFF_MAGIC || h.fds.size() != 1 + (size_t)n_sessions + n_clients,
+          "Error: the handed over state does not match its descriptors.");
+
+  vector<Session *> resumed;
+  for (uint32_t i = 0; i < n_sessions; i++) {
+    Session *s = new Session();
+    s->kind = TAG_SESSION;
+    s->master_fd = h.fds[1 + i];
+    s->client = nullptr;
+    int rows = 0;
+    int cols = 0;
+    handoff_get(&r, &s->id, sizeof(s->id));
+    handoff_get(&r, &s->pid, sizeof(s->pid));
+    handoff_get(&r, &rows, sizeof(rows));
+    handoff_get(&r, &cols, sizeof(cols));
+    handoff_get(&r, &s->exited, sizeof(s->exited));
+    handoff_get(&r, &s->exit_status, sizeof(s->exit_status));
+    handoff_get_bytes(&r, &s->input);
+    FAIL_IF(!r.ok || rows <= 0 || cols <= 0, "Error: the handed over state is truncated.");
+
+    screen_init(&s->screen, rows, cols);
+    s->screen.answer_queries = true;
+    query_filter_init(&s->queries, false);
+    timer_init(&s->silence_timer, session_silence_fire, s);
+    s->last_output_ms = timer_clock_ms();
+    s->silent = false;
+    s->watching_out = false;
+    resumed.push_back(s);
+  }
+
+  // Past here a mismatch costs the screens, not the sessions: they go on from blank models at their size.
+  uint32_t layout = 0;
+  handoff_get(&r, &layout, sizeof(layout));
+  bool restored = r.ok && layout == handoff_layout();
+  if (restored) {
+    handoff_get(&r, &silence_events, sizeof(silence_events));
+    handoff_get(&r, &activity_events, sizeof(activity_events));
+  }
+  for (Session *s : resumed) {
+    uint64_t last_output_ms = 0;
+    bool silent = false;
+    QueryFilter queries;
+    if (restored) {
+      handoff_get(&r, &last_output_ms, sizeof(last_output_ms));
+      handoff_get(&r, &silent, sizeof(silent));
+      handoff_get(&r, &queries, sizeof(queries));
+    }
+
+    int rows = s->screen.rows;
+    int cols = s->screen.cols;
+    if (restored && handoff_get_screen(&r, &s->screen)) {
+      s->last_output_ms = last_output_ms;
+      s->silent = silent;
+      s->queries = queries;
+    } else {
+      restored = false;
+      screen_init(&s->screen, rows, cols);
+      s->screen.answer_queries = true;
+    }
+  }
+
+  for (Session *s : resumed) {
+    session_add(s);
+    session_flush(s);
+  }
+
+  Client *requester = nullptr;
+  string pending;
+  for (uint32_t i = 0; i < n_clients; i++) {
+    Client *c = client_add(h.fds[1 + n_sessions + i]);
+    if ((int32_t)i == requester_index) requester = c;
+
+    int32_t session_index = -1;
+    bool needs_snapshot = false;
+    if (restored) {
+      handoff_get(&r, &session_index, sizeof(session_index));
+      handoff_get(&r, &needs_snapshot, sizeof(needs_snapshot));
+      handoff_get_bytes(&r, &c->in_buf);
+      handoff_get_bytes(&r, &pending);
+    }
+
+    // Without the state a client does not know what it was looking at, it has to attach again.
+    if (!restored || !r.ok) {
+      if (c != requester) client_close(c);
+      continue;
+    }
+
+    if (session_index >= 0 && (uint32_t)session_index < n_sessions) {
+      c->session = resumed[session_index];
+      c->session->client = c;
+    }
+    c->needs_snapshot = needs_snapshot;
+    if (!pending.empty()) {
+      client_queue_bytes(c, pending.data(), pending.size());
+      client_flush(c);
+    }
+  }
+  handoff_release(&h);
+
+  char line[128];
+  int len = snprintf(line, sizeof(line), "upgraded: %zu sessions and %zu clients handed over in %.1f ms%s\n",
+                     sessions.size(), clients.size(), (monotonic_us() - started_us) / 1e3,
+                     restored ? "" : ", screens reset: the state format changed");
+  DBG("%.*s", len - 1, line);
+  if (requester != nullptr) client_queue(requester, MSG_UPGRADE, line, len);
+
+  server_listen_fd = h.fds[0];
+  return server_listen_fd;
+}
+
+// Returns false when the client is done and was closed.
+bool client_handle_msg(Client *c, const MsgHeader &header, const string &payload) {
+  switch (header.type) {
+    case MSG_NEW:
+    case MSG_ATTACH: {
+      if (payload.size() != sizeof(AttachMsg)) return false;
+
+      AttachMsg msg;
+      memcpy(&msg, payload.data(), sizeof(msg));
+      sanitize_winsize(&msg.ws);
+
+      Session *s = nullptr;
+      if (header.type == MSG_NEW) {
+        s = session_spawn(&msg);
+      } else {
+        for (Session *candidate : sessions) {
+          if (candidate->id == msg.session_id || (msg.session_id == 0 && candidate->client == nullptr)) {
+            s = candidate;
+            break;
+          }
+        }
+      }
+
+      if (s == nullptr) {
+        const char *err = "no such session";
+        client_queue(c, MSG_ERROR, err, strlen(err));
+        return true;
+      }
+
+      session_attach(s, c, &msg.ws);
+      break;
+    }
+
+    case MSG_INPUT:
+      if (c->session != nullptr) session_write(c->session, payload.data(), payload.size());
+      break;
+
+    case MSG_RESIZE: {
+      if (c->session == nullptr || payload.size() != sizeof(struct winsize)) break;
+
+      struct winsize ws;
+      memcpy(&ws, payload.data(), sizeof(ws));
+      sanitize_winsize(&ws);
+      if (ioctl(c->session->master_fd, TIOCSWINSZ, &ws) == -1) DBG("Failed resizing session %u.", c->session->id);
+      screen_resize(&c->session->screen, ws.ws_row, ws.ws_col);
+      break;
+    }
+
+    case MSG_DETACH:
+      client_close(c);
+      return false;
+
+    case MSG_UPGRADE:
+      server_upgrade(c, payload);  // Does not return when it worked.
+      break;
+
+    case MSG_LIST: {
+      string list;
+      char line[128];
+      for (Session *s : sessions) {
+        int len = snprintf(line, sizeof(line), "%u: pid %d, %dx%d%s", s->id, s->pid, s->screen.cols, s->screen.rows,
+                           s->client != nullptr ? " (attached)" : "");
+        list.append(line, len);
+        if (s->silent) {
+          len = snprintf(line, sizeof(line), ", silent for %llus",
+                         (unsigned long long)(timer_clock_ms() - s->last_output_ms) / 1000);
+          list.append(line, len);
+        }
+        list += '\n';
+      }
+      int len = pool_stats(&pool, line, sizeof(line));
+      list.append(line, len);
+      if (silence_ms > 0) {
+        len = snprintf(line, sizeof(line), "monitor: silence after %llu ms, %zu silence and %zu activity events\n",
+                       (unsigned long long)silence_ms, silence_events, activity_events);
+        list.append(line, len);
+      }
+      client_queue(c, MSG_LIST, list.data(), list.size());
+      break;
+    }
+  }
+
+  return true;
+}
+
+void client_handle_input(Client *c) {
+  ssize_t read_len = read(c->fd, read_buf, READ_BUF_SIZE);
+  if (read_len <= 0) {
+    if (read_len == -1 && (errno == EAGAIN || errno == EINTR)) return;
+
+    client_close(c);
+    return;
+  }
+
+  c->in_buf.append(read_buf, read_len);
+
+  MsgHeader header;
+  string payload;
+  while (take_msg(&c->in_buf, &header, &payload)) {
+    if (!client_handle_msg(c, header, payload)) return;
+  }
+}
+
+// Collects every child that exited: shells, whose status is kept for their client, and monitor hooks.
+void reap_children() {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    DBG("Child %d exited, status: %d.", pid, status);
+
+    for (Session *s : sessions) {
+      if (s->pid == pid) {
+        s->exited = true;  // Something it started may still hold the slave, the session goes on until EIO.
+        s->exit_status = status;
+      }
+    }
+    for (size_t i = 0; i < exiting.size(); i++) {
+      if (exiting[i]->pid == pid) {
+        Session *s = exiting[i];
+        exiting.erase(exiting.begin() + i);
+        s->exited = true;
+        s->exit_status = status;
+        session_finish(s);
+        break;
+      }
+    }
+  }
+}
+
+void server_init() {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  FAIL_IF_WITH_CODE(epoll_fd == -1, "Error: cannot create epoll instance");
+  FAIL_IF(!pool_init(&pool, POOL_CHUNK_SIZE, POOL_INITIAL_CHUNKS), "Error: cannot allocate the buffer pool.");
+
+  timer_wheel_init(&timers, timer_clock_ms());
+  const char *v;
+  if ((v = getenv(MONITOR_SILENCE_ENV)) != nullptr) silence_ms = (uint64_t)(atof(v) * 1000);
+  if ((v = getenv(MONITOR_HOOK_ENV)) != nullptr && *v != '\0') monitor_hook = v;
+}
+
+// Owns the PTYs for as long as any session is alive. It has no controlling terminal, so closing the terminal the
+// first client ran in does not reach it or its shells.
+void run_server(int listen_fd) {
+  server_listen_fd = listen_fd;
+
+  sigset_t wait_mask;
+  setup_signal_handler(SIGCHLD, &wait_mask);
+  signal(SIGPIPE, SIG_IGN);
+
+  // A NULL tag marks the listening socket.
+  struct epoll_event ev {
+    0
+  };
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  FAIL_IF_WITH_CODE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1, "Error: cannot watch socket");
+
+  struct epoll_event events[MAX_EVENTS];
+  bool had_session = !sessions.empty();  // A resumed server.
+
+  while (!had_session || !sessions.empty() || !exiting.empty()) {
+    int n = epoll_pwait(epoll_fd, events, MAX_EVENTS, timer_wheel_timeout(&timers, timer_clock_ms()), &wait_mask);
+    if (n == -1 && errno != EINTR) {
+      DBG("Error: epoll wait failed: %s.", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    loop_ms = timer_clock_ms();
+    timer_wheel_advance(&timers, loop_ms);
+
+    for (int i = 0; i < n; i++) {
+      void *tag = events[i].data.ptr;
+
+      if (tag == nullptr) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) continue;
+
+        client_add(fd);
+        DBG("Client %d connected.", fd);
+        continue;
+      }
+
+      if (*(TagKind *)tag == TAG_SESSION) {
+        Session *s = (Session *)tag;
+        if (events[i].events & EPOLLOUT) session_flush(s);
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) session_handle_output(s);
+        had_session = true;
+        continue;
+      }
+
+      Client *c = (Client *)tag;
+      if (events[i].events & EPOLLOUT) {
+        client_flush(c);
+        if (c->needs_snapshot && c->out.count == 0 && c->session != nullptr) client_send_snapshot(c);
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) client_handle_input(c);
+    }
+
+    if (got_sigchld) {
+      got_sigchld = 0;
+      reap_children();
+    }
+  }
+
+  DBG("Last session ended, server exits.");
+}
+
+// Starts the server in the background, detached from the caller's terminal.
+void spawn_server(const struct sockaddr_un *addr) {
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  FAIL_IF_WITH_CODE(listen_fd == -1, "Error: cannot create socket");
+
+  unlink(addr->sun_path);
+  FAIL_IF_WITH_CODE(bind(listen_fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1, "Error: cannot bind socket");
+  FAIL_IF_WITH_CODE(listen(listen_fd, 16) == -1, "Error: cannot listen on socket");
+
+  pid_t pid = fork();
+  FAIL_IF_WITH_CODE(pid == -1, "Error: cannot fork server");
+
+  if (pid != 0) {  // Parent, goes on to be the first client.
+    close(listen_fd);
+    return;
+  }
+
+  FAIL_IF_WITH_CODE(setsid() == -1, "Error: cannot start server session");
+
+  int null_fd = open("/dev/null", O_RDWR);
+  dup2(null_fd, STDIN_FILENO);
+  dup2(null_fd, STDOUT_FILENO);
+  dup2(null_fd, STDERR_FILENO);
+  if (null_fd > STDERR_FILENO) close(null_fd);
+
+  server_addr = *addr;
+  server_init();
+  run_server(listen_fd);
+
+  unlink(addr->sun_path);
+  exit(EXIT_SUCCESS);
+}
+
+//
+// Client.
+//
+
+int connect_server(const struct sockaddr_un *addr) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  FAIL_IF_WITH_CODE(fd == -1, "Error: cannot create socket");
+
+  if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Returns true when the session is over and the client should stop.
+bool client_handle_server_msg(const MsgHeader &header, const string &payload, int *exit_code) {
+  switch (header.type) {
+    case MSG_OUTPUT:
+      write_all(STDOUT_FILENO, payload.data(), payload.size());
+      return false;
+
+    case MSG_DETACH:
+      printf("\r\n[detached]\r\n");
+      return true;
+
+    case MSG_EXIT: {
+      int32_t status = 0;
+      if (payload.size() == sizeof(status)) memcpy(&status, payload.data(), sizeof(status));
+      printf("\r\n[exited, status %d]\r\n", WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+      return true;
+    }
+
+    case MSG_ERROR:
+      printf("Error: %.*s\r\n", (int)payload.size(), payload.data());
+      *exit_code = EXIT_FAILURE;
+      return true;
+  }
+
+  return false;
+}
+
+int run_client(int sock_fd, uint32_t type, uint32_t session_id) {
+  AttachMsg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.session_id = session_id;
+  FAIL_IF_WITH_CODE(tcgetattr(STDIN_FILENO, &msg.tio) == -1, "Cannot fetch current tty settings");
+  FAIL_IF_WITH_CODE(ioctl(STDIN_FILENO, TIOCGWINSZ, &msg.ws) < 0, "Cannot get current tty winsize");
+  send_msg(sock_fd, type, &msg, sizeof(msg));
+
+  tty_set_raw(STDIN_FILENO, &tty_orig);
+  FAIL_IF_WITH_CODE(atexit(tty_reset) != 0, "Error: cannot set exit handler");
+
+  sigset_t wait_mask;
+  setup_signal_handler(SIGWINCH, &wait_mask);
+
+  string in_buf;
+  bool prefix_seen = false;
+  int exit_code = EXIT_SUCCESS;
+
+  for (;;) {
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {sock_fd, POLLIN, 0}};
+    if (ppoll(fds, 2, nullptr, &wait_mask) == -1 && errno != EINTR) {
+      perror("Error: poll failed");
+      exit(EXIT_FAILURE);
+    }
+
+    if (got_sigwinch) {
+      got_sigwinch = 0;
+      struct winsize ws;
+      if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0) send_msg(sock_fd, MSG_RESIZE, &ws, sizeof(ws));
+    }
+
+    if (fds[0].revents & POLLIN) {  // STDIN --> server
+      ssize_t read_len = read(STDIN_FILENO, read_buf, READ_BUF_SIZE);
+      if (read_len <= 0) break;
+
+      ssize_t pass_from = 0;
+      for (ssize_t i = 0; i < read_len; i++) {
+        if (!prefix_seen && read_buf[i] != CLIENT_PREFIX_KEY) continue;
+
+        if (i > pass_from) send_msg(sock_fd, MSG_INPUT, read_buf + pass_from, i - pass_from);
+        pass_from = i + 1;
+
+        if (!prefix_seen) {
+          prefix_seen = true;
+          continue;
+        }
+        prefix_seen = false;
+
+        if (read_buf[i] == 'd') {
+          send_msg(sock_fd, MSG_DETACH, nullptr, 0);
+          printf("\r\n[detached]\r\n");
+          return EXIT_SUCCESS;
+        }
+        send_msg(sock_fd, MSG_INPUT, read_buf + i, 1);
+      }
+      if (read_len > pass_from && !prefix_seen) {
+        send_msg(sock_fd, MSG_INPUT, read_buf + pass_from, read_len - pass_from);
+      }
+    }
+
+    if (fds[1].revents & (POLLIN | POLLHUP)) {  // Server --> STDOUT
+      ssize_t read_len = read(sock_fd, read_buf, READ_BUF_SIZE);
+      if (read_len <= 0) {
+        printf("\r\n[server gone]\r\n");
+        return EXIT_FAILURE;
+      }
+
+      in_buf.append(read_buf, read_len);
+
+      MsgHeader header;
+      string payload;
+      while (take_msg(&in_buf, &header, &payload)) {
+        if (client_handle_server_msg(header, payload, &exit_code)) return exit_code;
+      }
+    }
+  }
+
+  return exit_code;
+}
+
+// Sends one request and prints the reply.
+int run_request(int sock_fd, uint32_t type, const void *request, uint32_t len) {
+  send_msg(sock_fd, type, request, len);
+
+  string in_buf;
+  MsgHeader header;
+  string payload;
+  for (;;) {
+    ssize_t read_len = read(sock_fd, read_buf, READ_BUF_SIZE);
+    FAIL_IF(read_len <= 0, "Error: server closed the connection.");
+
+    in_buf.append(read_buf, read_len);
+    if (take_msg(&in_buf, &header, &payload)) break;
+  }
+
+  if (header.type == MSG_ERROR) {
+    printf("Error: %.*s\n", (int)payload.size(), payload.data());
+    return EXIT_FAILURE;
+  }
+  printf("%.*s", (int)payload.size(), payload.data());
+  return EXIT_SUCCESS;
+}
+
+// Hands the running server over to this binary, the one `upgrade` was run from.
+int run_upgrade(int sock_fd) {
+  char path[PATH_MAX];
+  ssize_t len = readlink("/proc/self/exe", path, sizeof(path));
+  FAIL_IF_WITH_CODE(len == -1 || len == sizeof(path), "Error: cannot find this binary");
+  return run_request(sock_fd, MSG_UPGRADE, path, len);
+}
+
+void usage() {
+  printf("Usage: server [-S socket] new | attach [session-id] | ls | upgrade\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  const char *override_path = nullptr;
+  int arg = 1;
+  if (arg + 1 < argc && strcmp(argv[arg], "-S") == 0) {
+    override_path = argv[arg + 1];
+    arg += 2;
+  }
+
+  const char *command = arg < argc ? argv[arg++] : "new";
+
+  struct sockaddr_un addr;
+  socket_path(override_path, &addr);
+
+  if (strcmp(command, "resume") == 0) {  // Not for users: the new binary's half of `upgrade`.
+    FAIL_IF(arg >= argc, "Error: resume needs the handoff socket.");
+    server_addr = addr;
+    server_init();
+    run_server(server_resume(atoi(argv[arg])));
+    unlink(addr.sun_path);
+    exit(EXIT_SUCCESS);
+  }
+
+  int sock_fd = connect_server(&addr);
+
+  if (strcmp(command, "new") == 0) {
+    if (sock_fd == -1) {
+      spawn_server(&addr);
+      sock_fd = connect_server(&addr);
+      FAIL_IF_WITH_CODE(sock_fd == -1, "Error: cannot connect to server");
+    }
+    exit(run_client(sock_fd, MSG_NEW, 0));
+  }
+
+  FAIL_IF(sock_fd == -1, "Error: no server running.");
+
+  if (strcmp(command, "attach") == 0) {
+    uint32_t session_id = arg < argc ? (uint32_t)atoi(argv[arg]) : 0;
+    exit(run_client(sock_fd, MSG_ATTACH, session_id));
+  }
+
+  if (strcmp(command, "ls") == 0) {
+    exit(run_request(sock_fd, MSG_LIST, nullptr, 0));
+  }
+
+  if (strcmp(command, "upgrade") == 0) {
+    exit(run_upgrade(sock_fd));
+  }
+
+  usage();
+}
@@ -0,0 +1,219 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+// The current screen grid published in POSIX shared memory behind a seqlock. The writer never blocks and never makes
+// a syscall to publish; readers copy optimistically and retry when the sequence moved under them.
+//
+// The segment is sized for SNAPSHOT_MAX_ROWS x SNAPSHOT_MAX_COLS up front. tmpfs only backs pages that were written,
+// so a small screen costs a small segment.
+//
+// Cells hold indices into the writer's style table, so the table goes along with them: the styles in use, with the
+// hyperlink index cleared since the links themselves are not published.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+#include "screen.h"
+
+#define SNAPSHOT_MAGIC 0x73637232  // "scr2", bumped when the style table was added.
+#define SNAPSHOT_MAX_ROWS 512
+#define SNAPSHOT_MAX_COLS 1024
+#define SNAPSHOT_NAME_MAX 64
+#define SNAPSHOT_READ_RETRIES 1000
+
+#define SNAPSHOT_CURSOR_VISIBLE 0x1
+#define SNAPSHOT_ALT_SCREEN 0x2
+
+struct SnapshotHeader {
+  uint32_t magic;
+  uint32_t max_rows;
+  uint32_t max_cols;
+  alignas(64) std::atomic<uint32_t> seq;  // Odd while the writer is in the middle of an update.
+
+  // Guarded by `seq`.
+  uint32_t rows;
+  uint32_t cols;
+  uint32_t cur_row;
+  uint32_t cur_col;
+  uint32_t flags;
+  uint64_t version;  // Number of publishes so far, a cheap "did anything change" check for pollers.
+  uint32_t n_styles;
+};
+
+#define SNAPSHOT_CELLS_OFFSET ((sizeof(SnapshotHeader) + 63) & ~(size_t)63)
+#define SNAPSHOT_STYLES_OFFSET (SNAPSHOT_CELLS_OFFSET + sizeof(Cell) * SNAPSHOT_MAX_ROWS * SNAPSHOT_MAX_COLS)
+#define SNAPSHOT_SIZE (SNAPSHOT_STYLES_OFFSET + sizeof(Style) * STYLE_MAX)
+
+struct Snapshot {
+  SnapshotHeader *header;
+  Cell *cells;  // Row stride is always `max_cols`.
+  Style *styles;
+  char name[SNAPSHOT_NAME_MAX];
+  bool owner;
+};
+
+static inline Snapshot *snapshot_map(const char *name, int fd, bool owner) {
+  void *base = mmap(nullptr, SNAPSHOT_SIZE, owner ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) return nullptr;
+
+  Snapshot *snap = new Snapshot();
+  snap->header = (SnapshotHeader *)base;
+  snap->cells = (Cell *)((char *)base + SNAPSHOT_CELLS_OFFSET);
+  snap->styles = (Style *)((char *)base + SNAPSHOT_STYLES_OFFSET);
+  snprintf(snap->name, SNAPSHOT_NAME_MAX, "%s", name);
+  snap->owner = owner;
+  return snap;
+}
+
+static inline Snapshot *snapshot_create(const char *name) {
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd == -1) return nullptr;
+
+  Snapshot *snap = nullptr;
+  if (ftruncate(fd, SNAPSHOT_SIZE) == 0) snap = snapshot_map(name, fd, true);
+  if (snap == nullptr) {
+    int prev_errno = errno;
+    close(fd);
+    shm_unlink(name);
+    errno = prev_errno;
+    return nullptr;
+  }
+  close(fd);
+
+  new (snap->header) SnapshotHeader();
+  snap->header->max_rows = SNAPSHOT_MAX_ROWS;
+  snap->header->max_cols = SNAPSHOT_MAX_COLS;
+  snap->header->seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  snap->header->magic = SNAPSHOT_MAGIC;
+  return snap;
+}
+
+static inline Snapshot *snapshot_open(const char *name) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd == -1) return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < SNAPSHOT_SIZE) {
+    close(fd);
+    errno = EPROTO;
+    return nullptr;
+  }
+
+  Snapshot *snap = snapshot_map(name, fd, false);
+  close(fd);
+  if (snap != nullptr && snap->header->magic != SNAPSHOT_MAGIC) {
+    munmap(snap->header, SNAPSHOT_SIZE);
+    delete snap;
+    errno = EPROTO;
+    return nullptr;
+  }
+  return snap;
+}
+
+static inline void snapshot_close(Snapshot *snap) {
+  if (snap->owner) shm_unlink(snap->name);
+  munmap(snap->header, SNAPSHOT_SIZE);
+  delete snap;
+}
+
+// Copies the rows the model marked dirty, or all of them when `full`, and clears the marks. Anything past the
+// segment's limits is cut off. The style table goes every time, an index a clean row uses keeps its style but a
+// freed one may have been handed out again since; it is short next to the rows.
+static inline void snapshot_publish(Snapshot *snap, Screen *s, bool full) {
+  SnapshotHeader *h = snap->header;
+  uint32_t rows = s->rows < SNAPSHOT_MAX_ROWS ? s->rows : SNAPSHOT_MAX_ROWS;
+  uint32_t cols = s->cols < SNAPSHOT_MAX_COLS ? s->cols : SNAPSHOT_MAX_COLS;
+
+  uint32_t seq = h->seq.load(std::memory_order_relaxed);
+  h->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  h->rows = rows;
+  h->cols = cols;
+  h->cur_row = s->cur_row;
+  h->cur_col = s->cur_col;
+  h->flags = (s->cursor_visible ? SNAPSHOT_CURSOR_VISIBLE : 0) | (s->alt_active ? SNAPSHOT_ALT_SCREEN : 0);
+  h->version++;
+
+  for (uint32_t r = 0; r < rows; r++) {
+    if (!full && !s->dirty[r]) continue;
+    memcpy(&snap->cells[(size_t)r * SNAPSHOT_MAX_COLS], screen_row(s, r), cols * sizeof(Cell));
+  }
+
+  const std::vector<Style> &styles = s->styles.styles;
+  for (size_t id = 0; id < styles.size(); id++) {
+    snap->styles[id] = styles[id];
+    snap->styles[id].link = 0;
+  }
+  h->n_styles = (uint32_t)styles.size();
+
+  h->seq.store(seq + 2, std::memory_order_release);
+  screen_clear_dirty(s);
+}
+
+// Takes a consistent copy into `out` (rows x cols, packed) and, unless `styles` is null, the style table its cells
+// index. Returns false if the writer kept it busy for too long.
+static inline bool snapshot_read(const Snapshot *snap, SnapshotHeader *meta, std::vector<Cell> *out,
+                                 std::vector<Style> *styles = nullptr) {
+  const SnapshotHeader *h = snap->header;
+
+  for (int attempt = 0; attempt < SNAPSHOT_READ_RETRIES; attempt++) {
+    uint32_t seq = h->seq.load(std::memory_order_acquire);
+    if (seq & 1) continue;
+
+    uint32_t rows = h->rows < SNAPSHOT_MAX_ROWS ? h->rows : SNAPSHOT_MAX_ROWS;
+    uint32_t cols = h->cols < SNAPSHOT_MAX_COLS ? h->cols : SNAPSHOT_MAX_COLS;
+    meta->rows = rows;
+    meta->cols = cols;
+    meta->cur_row = h->cur_row;
+    meta->cur_col = h->cur_col;
+    meta->flags = h->flags;
+    meta->version = h->version;
+
+    out->resize((size_t)rows * cols);
+    for (uint32_t r = 0; r < rows; r++) {
+      memcpy(&(*out)[(size_t)r * cols], &snap->cells[(size_t)r * SNAPSHOT_MAX_COLS], cols * sizeof(Cell));
+    }
+
+    if (styles != nullptr) {
+      uint32_t n_styles = h->n_styles < STYLE_MAX ? h->n_styles : STYLE_MAX;
+      meta->n_styles = n_styles;
+      styles->assign(snap->styles, snap->styles + n_styles);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (h->seq.load(std::memory_order_relaxed) == seq) return true;
+  }
+
+  return false;
+}
+
+// Just the grid size, for pollers that keep a model of their own. Returns false if the writer kept it busy.
+static inline bool snapshot_read_size(const Snapshot *snap, uint32_t *rows, uint32_t *cols) {
+  const SnapshotHeader *h = snap->header;
+
+  for (int attempt = 0; attempt < SNAPSHOT_READ_RETRIES; attempt++) {
+    uint32_t seq = h->seq.load(std::memory_order_acquire);
+    if (seq & 1) continue;
+
+    *rows = h->rows < SNAPSHOT_MAX_ROWS ? h->rows : SNAPSHOT_MAX_ROWS;
+    *cols = h->cols < SNAPSHOT_MAX_COLS ? h->cols : SNAPSHOT_MAX_COLS;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (h->seq.load(std::memory_order_relaxed) == seq) return true;
+  }
+
+  return false;
+}
+
+#endif  // SNAPSHOT_H_
@@ -0,0 +1,97 @@
+#ifndef SPSC_H_
+#define SPSC_H_
+
+// Bounded lock-free queue for exactly one producer and one consumer thread. Each side keeps a private copy of the
+// other side's index and only reloads it when the queue looks full or empty, so in steady state the two threads do
+// not bounce each other's cache lines.
+//
+// The consumer peeks with `front()` and releases with `pop()` after it is done with the item. When items point into
+// a buffer the producer reuses, a slot is only handed back once nothing refers to it anymore.
+//
+// An idle consumer sleeps on a futex. The producer only makes the wake-up syscall when the consumer actually went to
+// sleep, a busy pipeline costs no syscalls at all.
+
+#include <linux/futex.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#define SPSC_SPIN_LIMIT 64
+
+template <typename T, size_t N>
+class SpscQueue {
+  static_assert((N & (N - 1)) == 0, "SpscQueue capacity must be a power of two.");
+
+ public:
+  SpscQueue() : head_(0), cached_tail_(0), tail_(0), cached_head_(0), consumer_sleeping_(0) {}
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+  // Producer. Returns false when full.
+  bool push(const T &item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ == N) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ == N) return false;
+    }
+
+    items_[tail & (N - 1)] = item;
+    tail_.store(tail + 1, std::memory_order_seq_cst);
+
+    // Pairs with the store-then-check in `wait()`: either the consumer sees the new tail or this sees it sleeping.
+    if (consumer_sleeping_.load(std::memory_order_seq_cst) != 0 && consumer_sleeping_.exchange(0) != 0) {
+      syscall(SYS_futex, (uint32_t *)&consumer_sleeping_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+    return true;
+  }
+
+  // Consumer. The oldest item, nullptr when empty.
+  T *front() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) return nullptr;
+    }
+    return &items_[head & (N - 1)];
+  }
+
+  // Consumer. Hands the slot of `front()` back to the producer.
+  void pop() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Consumer. Blocks until `front()` has something.
+  void wait() {
+    for (int i = 0; i < SPSC_SPIN_LIMIT; i++) {
+      if (front() != nullptr) return;
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#endif
+    }
+
+    while (front() == nullptr) {
+      consumer_sleeping_.store(1, std::memory_order_seq_cst);
+      if (tail_.load(std::memory_order_seq_cst) != head_.load(std::memory_order_relaxed)) break;
+      syscall(SYS_futex, (uint32_t *)&consumer_sleeping_, FUTEX_WAIT_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+    consumer_sleeping_.store(0, std::memory_order_relaxed);
+  }
+
+  size_t size() const {
+    return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+  }
+
+ private:
+  alignas(64) std::atomic<size_t> head_;  // Written by the consumer.
+  size_t cached_tail_;
+  alignas(64) std::atomic<size_t> tail_;  // Written by the producer.
+  size_t cached_head_;
+  alignas(64) std::atomic<uint32_t> consumer_sleeping_;
+  alignas(64) T items_[N];
+};
+
+#endif  // SPSC_H_
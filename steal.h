@@ -0,0 +1,80 @@
+#ifndef STEAL_H_
+#define STEAL_H_
+
+// Work-stealing queue for a fixed set of workers. Each worker has its own deque: it pushes and pops at the back,
+// idle workers steal from the front of the others'. Jobs here take milliseconds to minutes, so a mutex per deque is
+// cheap enough and keeps it obviously correct; contention only happens while stealing.
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+template <typename T>
+class StealQueue {
+ public:
+  explicit StealQueue(int workers) : deques_(new Deque[workers]), workers_(workers) {}
+
+  StealQueue(const StealQueue &) = delete;
+  StealQueue &operator=(const StealQueue &) = delete;
+
+  int workers() const {
+    return workers_;
+  }
+
+  void push(int worker, T item) {
+    Deque &d = deques_[worker % workers_];
+    std::lock_guard<std::mutex> guard(d.lock);
+    d.items.push_back(std::move(item));
+  }
+
+  // Spreads `items` round-robin so every worker starts with local work.
+  void push_all(std::vector<T> items) {
+    for (size_t i = 0; i < items.size(); i++) push((int)(i % workers_), std::move(items[i]));
+  }
+
+  // Own work first (newest, cache-warm), then the oldest item of the next non-empty victim.
+  bool pop(int worker, T *out) {
+    {
+      Deque &own = deques_[worker];
+      std::lock_guard<std::mutex> guard(own.lock);
+      if (!own.items.empty()) {
+        *out = std::move(own.items.back());
+        own.items.pop_back();
+        return true;
+      }
+    }
+
+    for (int i = 1; i < workers_; i++) {
+      Deque &victim = deques_[(worker + i) % workers_];
+      std::lock_guard<std::mutex> guard(victim.lock);
+      if (!victim.items.empty()) {
+        *out = std::move(victim.items.front());
+        victim.items.pop_front();
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+ private:
+  struct Deque {
+    std::mutex lock;
+    std::deque<T> items;
+  };
+
+  std::unique_ptr<Deque[]> deques_;
+  int workers_;
+};
+
+// Runs `fn(worker_index)` on `workers` threads and waits for all of them.
+template <typename Fn>
+void run_workers(int workers, Fn fn) {
+  std::vector<std::thread> threads;
+  for (int i = 0; i < workers; i++) threads.emplace_back(fn, i);
+  for (std::thread &t : threads) t.join();
+}
+
+#endif  // STEAL_H_
@@ -0,0 +1,654 @@
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "ring.h"
+#include "screen.h"
+#include "snapshot.h"
+
+#define READ_BUF_SIZE 65536
+#define RING_NAME_FMT "/termy-%s"
+#define SNAPSHOT_NAME_FMT "/termy-screen-%s"
+#define STREAM_DEFAULT_PORT "4747"
+#define STREAM_DEFAULT_LISTEN "127.0.0.1"  // Watching from elsewhere takes naming an address, e.g. 0.0.0.0.
+#define STREAM_MIN_INTERVAL_MS 16.0   // About 60 frames a second on a fast link.
+#define STREAM_MAX_INTERVAL_MS 500.0  // And never slower than this, a slow link gets coarser frames instead.
+#define STREAM_MAX_INFLIGHT 4         // Frames a watcher may be behind on acknowledging before it is skipped.
+#define STREAM_RUN_GAP 4              // Unchanged cells that are cheaper to resend than to start a new run after.
+#define STREAM_MSG_MAX (16 * 1024 * 1024)
+#define IDLE_SLEEP_MIN_MS 1
+#define IDLE_SLEEP_MAX_MS 20
+
+#define FAIL_IF_WITH_CODE(exp, msg) \
+  if (exp) {                        \
+    perror(msg);                    \
+    exit(EXIT_FAILURE);             \
+  }
+
+#define FAIL_IF(exp, msg) \
+  if (exp) {              \
+    printf(msg);          \
+    printf("\n");         \
+    exit(EXIT_FAILURE);   \
+  }
+
+using namespace std;
+
+// Every message is a u32 type and a u32 payload length, then the payload. All integers are little-endian.
+//
+// Frame payload: u32 frame number, u16 rows, u16 cols, u16 cursor row, u16 cursor col, u8 flags, then runs up to the
+// end: u16 row, u16 col, u16 count, and per cell varint(cp << 1 | new_style) followed, if new_style, by u32 fg, u32 bg
+// and u16 attrs. The style carries over from cell to cell and run to run, each frame starts at the default. Links
+// are not streamed.
+enum StreamMsgType : uint32_t {
+  STREAM_KEYFRAME,  // Server -> watcher, every cell.
+  STREAM_DELTA,     // Server -> watcher, the cells that changed since the previous frame.
+  STREAM_ACK,       // Watcher -> server, u32 number of the frame it has drawn.
+};
+
+#define STREAM_CURSOR_VISIBLE 0x1
+
+struct Watcher {
+  int fd;
+  string in_buf;
+  string out;
+  size_t out_sent;
+
+  // What the watcher has on screen as of the last frame: the cells and the style table they referred to.
+  vector<Cell> shown;
+  vector<Style> shown_styles;
+  int rows;  // 0 until the keyframe went out.
+  int cols;
+  uint64_t shown_gen;
+
+  // Rate control. A frame goes out once the previous ones were acknowledged and half a round-trip has passed.
+  uint32_t next_frame;
+  uint32_t acked;
+  double frame_sent_ms[STREAM_MAX_INFLIGHT];
+  double srtt_ms;
+  double due_ms;
+
+  uint64_t raw_at_join;
+  uint64_t bytes_sent;
+};
+
+volatile sig_atomic_t stop = 0;
+
+void sig_stop(int) {
+  stop = 1;
+}
+
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void put_u16(string *out, uint16_t v) {
+  out->push_back((char)(v & 0xff));
+  out->push_back((char)(v >> 8));
+}
+
+void put_u32(string *out, uint32_t v) {
+  put_u16(out, v & 0xffff);
+  put_u16(out, v >> 16);
+}
+
+void put_varint(string *out, uint32_t v) {
+  while (v >= 0x80) {
+    out->push_back((char)(v | 0x80));
+    v >>= 7;
+  }
+  out->push_back((char)v);
+}
+
+// Bounds-checked cursor over a received payload, `ok` turns false on the first read past the end.
+struct Reader {
+  const uint8_t *p;
+  const uint8_t *end;
+  bool ok;
+};
+
+uint32_t get_bytes(Reader *r, int n) {
+  if (r->end - r->p < n) {
+    r->ok = false;
+    return 0;
+  }
+
+  uint32_t v = 0;
+  for (int i = 0; i < n; i++) v |= (uint32_t)r->p[i] << (8 * i);
+  r->p += n;
+  return v;
+}
+
+uint32_t get_varint(Reader *r) {
+  uint32_t v = 0;
+  for (int shift = 0; shift < 32; shift += 7) {
+    if (r->p == r->end) break;
+    uint8_t b = *r->p++;
+    v |= (uint32_t)(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) return v;
+  }
+  r->ok = false;
+  return 0;
+}
+
+void set_nodelay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Server side.
+
+// Starts the model from the published grid, so a watcher joining a running session sees it right away. The styles
+// are interned into the model's own table, hyperlinks are not published and the ring brings them back as they are
+// redrawn.
+void seed_model(Screen *s, const Snapshot *snap) {
+  SnapshotHeader meta;
+  vector<Cell> cells;
+  vector<Style> styles;
+  if (!snapshot_read(snap, &meta, &cells, &styles) || meta.rows == 0 || meta.cols == 0) return;
+
+  screen_init(s, meta.rows, meta.cols);
+  vector<int> ids(styles.size(), -1);  // Published index to ours.
+  for (size_t i = 0; i < cells.size(); i++) {
+    s->cells[i].cp = cells[i].cp;
+    uint32_t id = cells[i].style;
+    if (id >= styles.size()) continue;
+    if (ids[id] == -1) ids[id] = style_intern(&s->styles, styles[id]);
+    if (ids[id] != -1) s->cells[i].style = ids[id];
+  }
+  s->cur_row = meta.cur_row < meta.rows ? meta.cur_row : meta.rows - 1;
+  s->cur_col = meta.cur_col < meta.cols ? meta.cur_col : meta.cols - 1;
+  s->cursor_visible = meta.flags & SNAPSHOT_CURSOR_VISIBLE;
+}
+
+bool same_look(const Style &a, const Style &b) {
+  return a.fg == b.fg && a.bg == b.bg && a.attrs == b.attrs;
+}
+
+void put_style(string *out, const Style &st) {
+  put_u32(out, st.fg);
+  put_u32(out, st.bg);
+  put_u16(out, st.attrs);
+}
+
+// Appends the next frame for `w` to its output: a keyframe when it has nothing or a different size, else the row
+// runs that differ from what it shows.
+void encode_frame(const Screen *s, Watcher *w) {
+  bool key = w->rows != s->rows || w->cols != s->cols;
+  const vector<Style> &styles = s->styles.styles;
+  string *out = &w->out;
+
+  size_t header_at = out->size();
+  put_u32(out, key ? STREAM_KEYFRAME : STREAM_DELTA);
+  put_u32(out, 0);  // Length, patched below.
+  put_u32(out, w->next_frame);
+  put_u16(out, s->rows);
+  put_u16(out, s->cols);
+  put_u16(out, s->cur_row);
+  put_u16(out, s->cur_col);
+  out->push_back(s->cursor_visible ? STREAM_CURSOR_VISIBLE : 0);
+
+  auto changed = [&](const Cell *now, const Cell *was, int c) {
+    return key || now[c].cp != was[c].cp || !same_look(styles[now[c].style], w->shown_styles[was[c].style]);
+  };
+
+  Style pen{};
+  for (int r = 0; r < s->rows; r++) {
+    const Cell *now = screen_row(s, r);
+    const Cell *was = key ? nullptr : &w->shown[(size_t)r * s->cols];
+
+    int c = 0;
+    while (c < s->cols) {
+      if (!changed(now, was, c)) {
+        c++;
+        continue;
+      }
+
+      int last = c;
+      for (int end = c + 1; end < s->cols && end - last <= STREAM_RUN_GAP; end++) {
+        if (changed(now, was, end)) last = end;
+      }
+
+      put_u16(out, r);
+      put_u16(out, c);
+      put_u16(out, last - c + 1);
+      for (; c <= last; c++) {
+        const Style &st = styles[now[c].style];
+        bool new_style = !same_look(st, pen);
+        put_varint(out, (uint32_t)now[c].cp << 1 | (new_style ? 1 : 0));
+        if (new_style) {
+          put_style(out, st);
+          pen = st;
+        }
+      }
+    }
+  }
+
+  uint32_t len = out->size() - header_at - 2 * sizeof(uint32_t);
+  for (int i = 0; i < 4; i++) (*out)[header_at + 4 + i] = (char)(len >> (8 * i));
+
+  w->shown = s->cells;
+  w->shown_styles = styles;
+  w->rows = s->rows;
+  w->cols = s->cols;
+}
+
+// Returns false when the watcher is gone.
+bool watcher_flush(Watcher *w) {
+  while (w->out_sent < w->out.size()) {
+    ssize_t sent = send(w->fd, w->out.data() + w->out_sent, w->out.size() - w->out_sent, MSG_NOSIGNAL);
+    if (sent == -1) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN;
+    }
+    w->out_sent += sent;
+    w->bytes_sent += sent;
+  }
+
+  w->out.clear();
+  w->out_sent = 0;
+  return true;
+}
+
+// Takes the acks, each one is a round-trip sample. Returns false when the watcher is gone.
+bool watcher_read(Watcher *w, double now) {
+  char buf[512];
+  ssize_t read_len = recv(w->fd, buf, sizeof(buf), 0);
+  if (read_len == 0 || (read_len == -1 && errno != EAGAIN && errno != EINTR)) return false;
+  if (read_len > 0) w->in_buf.append(buf, read_len);
+
+  while (w->in_buf.size() >= 12) {
+    Reader r = {(const uint8_t *)w->in_buf.data(), (const uint8_t *)w->in_buf.data() + 12, true};
+    uint32_t type = get_bytes(&r, 4);
+    uint32_t len = get_bytes(&r, 4);
+    uint32_t frame = get_bytes(&r, 4);
+    if (type != STREAM_ACK || len != 4 || frame >= w->next_frame || frame < w->acked) return false;
+    w->in_buf.erase(0, 12);
+
+    double sample = now - w->frame_sent_ms[frame % STREAM_MAX_INFLIGHT];
+    w->srtt_ms = w->srtt_ms == 0 ? sample : (7 * w->srtt_ms + sample) / 8;
+    w->acked = frame + 1;
+  }
+  return true;
+}
+
+// Whether `w` takes a frame now: something changed, its socket drained, it is not too many frames behind and the
+// interval for its link has passed.
+bool watcher_due(const Watcher *w, uint64_t gen, double now) {
+  if (w->shown_gen == gen && w->rows != 0) return false;
+  if (!w->out.empty() || w->next_frame - w->acked >= STREAM_MAX_INFLIGHT) return false;
+  return now >= w->due_ms;
+}
+
+void watcher_send_frame(Watcher *w, const Screen *s, uint64_t gen, double now) {
+  encode_frame(s, w);
+  w->frame_sent_ms[w->next_frame % STREAM_MAX_INFLIGHT] = now;
+  w->next_frame++;
+  w->shown_gen = gen;
+
+  double interval = w->srtt_ms / 2;
+  if (interval < STREAM_MIN_INTERVAL_MS) interval = STREAM_MIN_INTERVAL_MS;
+  if (interval > STREAM_MAX_INTERVAL_MS) interval = STREAM_MAX_INTERVAL_MS;
+  w->due_ms = now + interval;
+}
+
+void watcher_close(Watcher *w, uint64_t raw_bytes) {
+  uint64_t raw = raw_bytes - w->raw_at_join;
+  printf("Watcher %d: %u frames, %llu bytes for %llu bytes of raw output (%.1fx less), rtt %.1f ms.\n", w->fd,
+         w->next_frame, (unsigned long long)w->bytes_sent, (unsigned long long)raw,
+         w->bytes_sent > 0 ? (double)raw / w->bytes_sent : 0.0, w->srtt_ms);
+  close(w->fd);
+  delete w;
+}
+
+int listen_tcp(const char *address, const char *port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST;
+
+  struct addrinfo *res;
+  FAIL_IF(getaddrinfo(address, port, &hints, &res) != 0, "Error: invalid listen address or port.");
+
+  int fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  FAIL_IF_WITH_CODE(fd == -1, "Error: cannot create socket");
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  FAIL_IF_WITH_CODE(bind(fd, res->ai_addr, res->ai_addrlen) == -1, "Error: cannot bind");
+  FAIL_IF_WITH_CODE(listen(fd, 16) == -1, "Error: cannot listen");
+  freeaddrinfo(res);
+  return fd;
+}
+
+// Follows a running termy's output ring with a screen model of its own and streams that model to every watcher.
+// The ring is read at the writer's pace, frames go out at each watcher's. Anyone who can connect sees the whole
+// screen, unredacted, so only loopback is listened on unless `address` says otherwise.
+int run_serve(const char *termy_pid, const char *port, const char *address) {
+  char name[RING_NAME_MAX];
+  snprintf(name, sizeof(name), RING_NAME_FMT, termy_pid);
+  Ring *ring = ring_open(name);
+  FAIL_IF_WITH_CODE(ring == nullptr, "Error: cannot open ring");
+  int slot = ring_join(ring);
+  FAIL_IF_WITH_CODE(slot == -1, "Error: no free reader slot");
+
+  snprintf(name, sizeof(name), SNAPSHOT_NAME_FMT, termy_pid);
+  Snapshot *snap = snapshot_open(name);
+  FAIL_IF_WITH_CODE(snap == nullptr, "Error: cannot open snapshot");
+
+  Screen screen;
+  screen_init(&screen, 24, 80);
+  seed_model(&screen, snap);
+
+  int listen_fd = listen_tcp(address, port);
+  printf("Streaming termy %s on %s port %s.\n", termy_pid, address, port);
+
+  vector<Watcher *> watchers;
+  vector<struct pollfd> fds;
+  char buf[READ_BUF_SIZE];
+  uint64_t gen = 1;  // Bumped whenever the model took new output.
+  uint64_t raw_bytes = 0;
+  uint64_t skipped = 0;
+  int idle_ms = IDLE_SLEEP_MIN_MS;
+  bool ended = false;
+
+  while (!stop && !ended) {
+    bool got_output = false;
+    for (;;) {
+      ssize_t read_len = ring_read(ring, slot, buf, READ_BUF_SIZE, RING_LAG_SKIP);
+      if (read_len == -1) {
+        ended = true;  // EPIPE: termy is done. ENOLINK cannot happen when skipping.
+        break;
+      }
+      if (read_len == 0) break;
+
+      uint32_t rows, cols;
+      if (snapshot_read_size(snap, &rows, &cols) && rows > 0 && cols > 0) screen_resize(&screen, rows, cols);
+      screen_feed(&screen, buf, read_len);
+      raw_bytes += read_len;
+      got_output = true;
+    }
+
+    uint64_t lagged = ring->header->readers[slot].skipped.load(std::memory_order_relaxed);
+    if (lagged != skipped) {  // The model missed output, start over from the published grid.
+      skipped = lagged;
+      seed_model(&screen, snap);
+    }
+
+    if (got_output) {
+      gen++;
+      idle_ms = IDLE_SLEEP_MIN_MS;
+    } else {
+      idle_ms = idle_ms * 2 > IDLE_SLEEP_MAX_MS ? IDLE_SLEEP_MAX_MS : idle_ms * 2;
+    }
+
+    // Frames, and how long until the next one is due. The ring has no wake-up, it is polled with backoff.
+    double now = now_ms();
+    int timeout = idle_ms;
+    for (Watcher *w : watchers) {
+      if (watcher_due(w, gen, now) || (ended && w->shown_gen != gen)) watcher_send_frame(w, &screen, gen, now);
+      if (w->shown_gen != gen && w->due_ms > now && w->due_ms - now < timeout) timeout = (int)(w->due_ms - now) + 1;
+    }
+
+    fds.clear();
+    fds.push_back({listen_fd, POLLIN, 0});
+    for (Watcher *w : watchers) {
+      fds.push_back({w->fd, (short)(POLLIN | (w->out.empty() ? 0 : POLLOUT)), 0});
+    }
+    if (poll(fds.data(), fds.size(), ended ? 0 : timeout) == -1 && errno != EINTR) {
+      perror("Error: poll failed");
+      break;
+    }
+
+    now = now_ms();
+    vector<Watcher *> alive;
+    for (size_t i = 0; i < watchers.size(); i++) {
+      Watcher *w = watchers[i];
+      short revents = fds[i + 1].revents;
+      bool ok = true;
+      if (revents & (POLLIN | POLLHUP | POLLERR)) ok = watcher_read(w, now);
+      if (ok) ok = watcher_flush(w);
+
+      if (ok) {
+        alive.push_back(w);
+      } else {
+        watcher_close(w, raw_bytes);
+      }
+    }
+    watchers.swap(alive);
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd != -1) {
+        set_nodelay(fd);
+        Watcher *w = new Watcher();
+        w->fd = fd;
+        w->raw_at_join = raw_bytes;
+        watchers.push_back(w);
+      }
+    }
+  }
+
+  // Last frames out, as far as the sockets take them without waiting.
+  for (Watcher *w : watchers) {
+    watcher_flush(w);
+    watcher_close(w, raw_bytes);
+  }
+
+  close(listen_fd);
+  snapshot_close(snap);
+  ring_leave(ring, slot);
+  ring_close(ring);
+  return EXIT_SUCCESS;
+}
+
+// Watcher side.
+
+// Applies one frame to the local model. Returns false on a malformed payload.
+bool apply_frame(Screen *s, bool *have_screen, uint32_t type, Reader *r, uint32_t *frame) {
+  *frame = get_bytes(r, 4);
+  int rows = get_bytes(r, 2);
+  int cols = get_bytes(r, 2);
+  int cur_row = get_bytes(r, 2);
+  int cur_col = get_bytes(r, 2);
+  uint8_t flags = get_bytes(r, 1);
+  if (!r->ok || rows == 0 || cols == 0 || rows > SNAPSHOT_MAX_ROWS || cols > SNAPSHOT_MAX_COLS) return false;
+
+  if (type == STREAM_KEYFRAME) {
+    if (!*have_screen) {
+      screen_init(s, rows, cols);
+      *have_screen = true;
+    }
+    screen_resize(s, rows, cols);
+    screen_mark_dirty(s, 0, rows - 1);
+  } else if (!*have_screen || rows != s->rows || cols != s->cols) {
+    return false;
+  }
+
+  Style pen{};
+  uint16_t pen_id = STYLE_DEFAULT;
+  while (r->ok && r->p < r->end) {
+    int row = get_bytes(r, 2);
+    int col = get_bytes(r, 2);
+    int n = get_bytes(r, 2);
+    if (!r->ok || row >= rows || col + n > cols) return false;
+
+    Cell *line = screen_row(s, row);
+    for (int c = col; c < col + n; c++) {
+      uint32_t v = get_varint(r);
+      if (v & 1) {
+        pen.fg = get_bytes(r, 4);
+        pen.bg = get_bytes(r, 4);
+        pen.attrs = get_bytes(r, 2);
+        pen_id = screen_intern(s, pen);
+      }
+      line[c].cp = v >> 1;
+      line[c].style = pen_id;
+    }
+    s->cells_written += n;
+    screen_mark_dirty(s, row, row);
+  }
+
+  s->cur_row = cur_row < rows ? cur_row : rows - 1;
+  s->cur_col = cur_col < cols ? cur_col : cols - 1;
+  s->cursor_visible = flags & STREAM_CURSOR_VISIBLE;
+  return r->ok;
+}
+
+void render(Screen *s, bool clear, string *out) {
+  char buf[32];
+  out->clear();
+  if (clear) out->append("\x1b[0m\x1b[H\x1b[2J");
+
+  Style last{};
+  out->append("\x1b[0m");
+  for (int r = 0; r < s->rows; r++) {
+    if (!s->dirty[r]) continue;
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", r + 1);
+    out->append(buf, len);
+    screen_render_row(s, r, s->cols, out, &last);
+  }
+  screen_clear_dirty(s);
+
+  int len = snprintf(buf, sizeof(buf), "\x1b[0m\x1b[%d;%dH", s->cur_row + 1, s->cur_col + 1);
+  out->append(buf, len);
+  out->append(s->cursor_visible ? "\x1b[?25h" : "\x1b[?25l");
+}
+
+int connect_tcp(const char *host, const char *port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo *res;
+  int err = getaddrinfo(host, port, &hints, &res);
+  if (err != 0) {
+    printf("Error: cannot resolve %s: %s\n", host, gai_strerror(err));
+    exit(EXIT_FAILURE);
+  }
+
+  int fd = -1;
+  for (struct addrinfo *ai = res; ai != nullptr && fd == -1; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  FAIL_IF_WITH_CODE(fd == -1, "Error: cannot connect");
+
+  set_nodelay(fd);
+  return fd;
+}
+
+// Rebuilds the streamed screen in the local terminal. Every batch of frames is drawn once and then acknowledged,
+// the acks are what paces the server.
+int run_watch(const char *host, const char *port) {
+  int fd = connect_tcp(host, port);
+
+  Screen screen;
+  bool have_screen = false;
+  string in_buf, out, ack;
+  char buf[READ_BUF_SIZE];
+  uint64_t bytes_received = 0;
+  int exit_code = EXIT_SUCCESS;
+
+  while (!stop) {
+    ssize_t read_len = recv(fd, buf, sizeof(buf), 0);
+    if (read_len == -1 && errno == EINTR) continue;
+    if (read_len <= 0) break;
+    in_buf.append(buf, read_len);
+    bytes_received += read_len;
+
+    bool drawn = false, clear = false;
+    uint32_t frame = 0;
+    size_t used = 0;
+    while (in_buf.size() - used >= 8) {
+      Reader header = {(const uint8_t *)in_buf.data() + used, (const uint8_t *)in_buf.data() + used + 8, true};
+      uint32_t type = get_bytes(&header, 4);
+      uint32_t len = get_bytes(&header, 4);
+      if (len > STREAM_MSG_MAX || (type != STREAM_KEYFRAME && type != STREAM_DELTA)) {
+        fprintf(stderr, "\r\n[stream: bad message]\r\n");
+        exit_code = EXIT_FAILURE;
+        stop = 1;
+        break;
+      }
+      if (in_buf.size() - used - 8 < len) break;
+
+      Reader payload = {header.p, header.p + len, true};
+      if (!apply_frame(&screen, &have_screen, type, &payload, &frame)) {
+        fprintf(stderr, "\r\n[stream: bad frame]\r\n");
+        exit_code = EXIT_FAILURE;
+        stop = 1;
+        break;
+      }
+      clear |= type == STREAM_KEYFRAME;
+      drawn = true;
+      used += 8 + len;
+    }
+    in_buf.erase(0, used);
+    if (!drawn) continue;
+
+    render(&screen, clear, &out);
+    FAIL_IF(write(STDOUT_FILENO, out.data(), out.size()) != (ssize_t)out.size(), "Error: invalid write to stdout.");
+
+    ack.clear();
+    put_u32(&ack, STREAM_ACK);
+    put_u32(&ack, 4);
+    put_u32(&ack, frame);
+    if (send(fd, ack.data(), ack.size(), MSG_NOSIGNAL) != (ssize_t)ack.size()) break;
+  }
+
+  fprintf(stderr, "\x1b[0m\x1b[?25h\r\n[stream ended, %llu bytes received]\r\n", (unsigned long long)bytes_received);
+  close(fd);
+  return exit_code;
+}
+
+void usage() {
+  printf("Usage: stream serve <termy-pid> [port [listen-address]] | stream watch <host> [port]\n");
+  printf("serve listens on %s unless given an address. The stream is neither authenticated nor redacted: anyone\n",
+         STREAM_DEFAULT_LISTEN);
+  printf("who can connect sees the full screen.\n");
+  exit(EXIT_FAILURE);
+}
+
+// Watches a termy session from another machine. Instead of the raw output, which a full-screen app that redraws all
+// the time makes expensive, the watcher gets a keyframe and then only the cells that changed, as often as its link
+// keeps up with.
+int main(int argc, char **argv) {
+  if (argc < 3) usage();
+  const char *port = argc > 3 ? argv[3] : STREAM_DEFAULT_PORT;
+  const char *address = argc > 4 ? argv[4] : STREAM_DEFAULT_LISTEN;
+
+  // No SA_RESTART: a watcher blocked in recv() has to notice.
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sig_stop;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  if (strcmp(argv[1], "serve") == 0) return run_serve(argv[2], port, address);
+  if (strcmp(argv[1], "watch") == 0) return run_watch(argv[2], port);
+  usage();
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,153 @@
+#ifndef STYLE_H_
+#define STYLE_H_
+
+// Interned cell styles. A screen has far fewer distinct styles than cells, so a cell only stores a small index into a
+// per-screen table and the full style (truecolor fg/bg, attributes, hyperlink) is kept once.
+//
+// Nothing is reference counted: writing a cell stays a plain store. When the table fills up, the owner marks the
+// indices its cells still use and `style_collect` frees the rest in one sweep.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define STYLE_INDEX_BITS 11
+#define STYLE_MAX (1 << STYLE_INDEX_BITS)
+#define STYLE_HASH_SIZE (2 * STYLE_MAX)
+#define STYLE_MAX_LINKS 1024
+
+#define STYLE_DEFAULT 0  // Index of the all-default style, always present.
+
+#define COLOR_DEFAULT 0
+#define COLOR_PALETTE 0x01000000  // Low byte is an xterm palette index.
+#define COLOR_RGB 0x02000000      // Low 24 bits are 0xRRGGBB.
+#define COLOR_KIND(c) ((c)&0xff000000)
+
+#define ATTR_BOLD 0x01
+#define ATTR_DIM 0x02
+#define ATTR_ITALIC 0x04
+#define ATTR_UNDERLINE 0x08
+#define ATTR_BLINK 0x10
+#define ATTR_REVERSE 0x20
+
+struct Style {
+  uint32_t fg;
+  uint32_t bg;
+  uint16_t attrs;
+  uint16_t link;  // 0 for none, else an index into `StyleTable::links`.
+};
+
+static inline bool style_equal(const Style &a, const Style &b) {
+  return a.fg == b.fg && a.bg == b.bg && a.attrs == b.attrs && a.link == b.link;
+}
+
+struct StyleTable {
+  std::vector<Style> styles;
+  std::vector<uint16_t> free_ids;
+  uint16_t hash[STYLE_HASH_SIZE];  // Index + 1, 0 is an empty slot.
+  size_t live;
+
+  std::vector<std::string> links;  // OSC 8 URIs, slot 0 unused.
+  std::vector<uint16_t> free_links;
+  std::unordered_map<std::string, uint16_t> link_ids;
+};
+
+static inline uint32_t style_hash(const Style &st) {
+  uint64_t h = ((uint64_t)st.fg << 32 | st.bg) * 0x9e3779b97f4a7c15ull;
+  h ^= ((uint64_t)st.attrs << 16 | st.link) * 0xc2b2ae3d27d4eb4full;
+  return (uint32_t)(h >> 40);
+}
+
+static inline void style_hash_insert(StyleTable *t, uint16_t id) {
+  uint32_t slot = style_hash(t->styles[id]) & (STYLE_HASH_SIZE - 1);
+  while (t->hash[slot] != 0) slot = (slot + 1) & (STYLE_HASH_SIZE - 1);
+  t->hash[slot] = id + 1;
+}
+
+static inline void style_table_init(StyleTable *t) {
+  t->styles.assign(1, Style{});
+  t->free_ids.clear();
+  memset(t->hash, 0, sizeof(t->hash));
+  style_hash_insert(t, STYLE_DEFAULT);
+  t->live = 1;
+
+  t->links.assign(1, std::string());
+  t->free_links.clear();
+  t->link_ids.clear();
+}
+
+// Index of `st`, added if new. -1 when the table is full, collect and try again.
+static inline int style_intern(StyleTable *t, const Style &st) {
+  uint32_t slot = style_hash(st) & (STYLE_HASH_SIZE - 1);
+  for (; t->hash[slot] != 0; slot = (slot + 1) & (STYLE_HASH_SIZE - 1)) {
+    if (style_equal(t->styles[t->hash[slot] - 1], st)) return t->hash[slot] - 1;
+  }
+
+  uint16_t id;
+  if (!t->free_ids.empty()) {
+    id = t->free_ids.back();
+    t->free_ids.pop_back();
+  } else if (t->styles.size() < STYLE_MAX) {
+    id = (uint16_t)t->styles.size();
+    t->styles.push_back(st);
+  } else {
+    return -1;
+  }
+
+  t->styles[id] = st;
+  t->hash[slot] = id + 1;
+  t->live++;
+  return id;
+}
+
+// Link index for an OSC 8 URI, 0 when the table is full.
+static inline uint16_t style_intern_link(StyleTable *t, const std::string &uri) {
+  auto found = t->link_ids.find(uri);
+  if (found != t->link_ids.end()) return found->second;
+
+  uint16_t id;
+  if (!t->free_links.empty()) {
+    id = t->free_links.back();
+    t->free_links.pop_back();
+    t->links[id] = uri;
+  } else if (t->links.size() < STYLE_MAX_LINKS) {
+    id = (uint16_t)t->links.size();
+    t->links.push_back(uri);
+  } else {
+    return 0;
+  }
+
+  t->link_ids[uri] = id;
+  return id;
+}
+
+// Frees every style not set in `live_styles` and every link neither a surviving style nor `live_links` refers to.
+// Both vectors are indexed by id and sized by the caller to `styles.size()` and `links.size()`.
+static inline void style_collect(StyleTable *t, std::vector<uint8_t> *live_styles, std::vector<uint8_t> *live_links) {
+  (*live_styles)[STYLE_DEFAULT] = 1;
+  memset(t->hash, 0, sizeof(t->hash));
+  t->free_ids.clear();
+  t->live = 0;
+
+  for (size_t id = 0; id < t->styles.size(); id++) {
+    if ((*live_styles)[id]) {
+      style_hash_insert(t, (uint16_t)id);
+      (*live_links)[t->styles[id].link] = 1;
+      t->live++;
+    } else {
+      t->free_ids.push_back((uint16_t)id);
+    }
+  }
+
+  for (size_t id = 1; id < t->links.size(); id++) {
+    if ((*live_links)[id] || t->links[id].empty()) continue;
+    t->link_ids.erase(t->links[id]);
+    t->links[id].clear();
+    t->free_links.push_back((uint16_t)id);
+  }
+}
+
+#endif  // STYLE_H_
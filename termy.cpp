@@ -0,0 +1,299 @@
+#include "termy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SLAVE_NAME_BUF_SIZE 512
+
+namespace termy {
+
+namespace {
+
+Error ok() {
+  return Error{0, nullptr};
+}
+
+Error fail(const char *op) {
+  return Error{errno, op};
+}
+
+// Slave set up from the parent: the child side of posix_spawn can only open files, not run ioctls.
+Error setup_slave(const SpawnOptions &options, const char *slave_name) {
+  if (options.termios == nullptr && (options.winsize.ws_row == 0 || options.winsize.ws_col == 0)) return ok();
+
+  int slave_fd = open(slave_name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (slave_fd == -1) return fail("open slave");
+
+  Error err = ok();
+  if (options.termios != nullptr && tcsetattr(slave_fd, TCSANOW, options.termios) == -1) {
+    err = fail("tcsetattr");
+  } else if (options.winsize.ws_row != 0 && options.winsize.ws_col != 0 &&
+             ioctl(slave_fd, TIOCSWINSZ, &options.winsize) == -1) {
+    err = fail("TIOCSWINSZ");
+  }
+
+  ::close(slave_fd);
+  return err;
+}
+
+// The child runs in a new session and opens the slave as its stdin. A session leader without a controlling terminal
+// acquires the first terminal it opens on Linux, so no TIOCSCTTY is needed. glibc runs this in a CLONE_VM|CLONE_VFORK
+// child: nothing of the parent is copied, however large it is.
+Error spawn_child(const SpawnOptions &options, const char *slave_name, const char *const *argv, pid_t *pid) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  int code = posix_spawn_file_actions_init(&actions);
+  if (code != 0) return Error{code, "posix_spawn_file_actions_init"};
+  code = posix_spawnattr_init(&attr);
+  if (code != 0) {
+    posix_spawn_file_actions_destroy(&actions);
+    return Error{code, "posix_spawnattr_init"};
+  }
+
+  // The embedding process may block or ignore signals, the child starts clean.
+  sigset_t empty_mask;
+  sigemptyset(&empty_mask);
+  sigset_t default_signals;
+  sigemptyset(&default_signals);
+  const int reset_signals[] = {SIGINT, SIGQUIT, SIGPIPE, SIGCHLD, SIGHUP, SIGTERM};
+  for (int sig_no : reset_signals) sigaddset(&default_signals, sig_no);
+
+  const char *op = "posix_spawnattr";
+  code = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  if (code == 0) code = posix_spawnattr_setsigmask(&attr, &empty_mask);
+  if (code == 0) code = posix_spawnattr_setsigdefault(&attr, &default_signals);
+
+  if (code == 0) {
+    op = "posix_spawn_file_actions";
+    code = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, slave_name, O_RDWR, 0);
+    if (code == 0) code = posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+    if (code == 0) code = posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+    if (code == 0 && options.cwd != nullptr) code = posix_spawn_file_actions_addchdir_np(&actions, options.cwd);
+  }
+
+  if (code == 0) {
+    op = "posix_spawn";
+    char *const *envp = options.envp != nullptr ? (char *const *)options.envp : environ;
+    code = posix_spawnp(pid, argv[0], &actions, &attr, (char *const *)argv, envp);
+  }
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  return Error{code, code != 0 ? op : nullptr};
+}
+
+// Opens an unused master with its slave unlocked.
+int open_master_pty(char *slave_name_buf, size_t slave_name_max_len) {
+  int master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (master_fd == -1) return -1;
+
+  if (grantpt(master_fd) == -1 || unlockpt(master_fd) == -1 ||
+      ptsname_r(master_fd, slave_name_buf, slave_name_max_len) != 0) {
+    int prev_errno = errno;
+    ::close(master_fd);
+    errno = prev_errno;
+    return -1;
+  }
+
+  return master_fd;
+}
+
+}  // namespace
+
+PtySession::PtySession() : master_fd_(-1), pid_(-1), reaped_(false), status_(0) {}
+
+PtySession::~PtySession() {
+  close();
+}
+
+PtySession::PtySession(PtySession &&other) noexcept
+    : master_fd_(other.master_fd_), pid_(other.pid_), reaped_(other.reaped_), status_(other.status_) {
+  other.master_fd_ = -1;
+  other.pid_ = -1;
+}
+
+PtySession &PtySession::operator=(PtySession &&other) noexcept {
+  if (this != &other) {
+    close();
+    master_fd_ = other.master_fd_;
+    pid_ = other.pid_;
+    reaped_ = other.reaped_;
+    status_ = other.status_;
+    other.master_fd_ = -1;
+    other.pid_ = -1;
+  }
+  return *this;
+}
+
+Error PtySession::spawn(const SpawnOptions &options, PtySession *out) {
+  const char *default_argv[2] = {nullptr, nullptr};
+  const char *const *argv = options.argv;
+  if (argv == nullptr || argv[0] == nullptr) {
+    const char *shell = getenv("SHELL");
+    default_argv[0] = shell != nullptr && *shell != '\0' ? shell : "/bin/sh";
+    argv = default_argv;
+  }
+
+  char slave_name[SLAVE_NAME_BUF_SIZE];
+  int master_fd = open_master_pty(slave_name, sizeof(slave_name));
+  if (master_fd == -1) return fail("open master pty");
+
+  Error err = setup_slave(options, slave_name);
+  pid_t pid = -1;
+  if (err.ok()) err = spawn_child(options, slave_name, argv, &pid);
+  if (!err.ok()) {
+    ::close(master_fd);
+    return err;
+  }
+
+  if (fcntl(master_fd, F_SETFL, O_NONBLOCK) == -1) {
+    err = fail("fcntl O_NONBLOCK");
+    ::close(master_fd);
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    return err;
+  }
+
+  *out = PtySession();
+  out->master_fd_ = master_fd;
+  out->pid_ = pid;
+  return ok();
+}
+
+IoResult PtySession::read(char *buf, size_t len) {
+  IoResult result = {0, ok(), false, false};
+
+  ssize_t got;
+  do {
+    got = ::read(master_fd_, buf, len);
+  } while (got == -1 && errno == EINTR);
+
+  if (got > 0) {
+    result.bytes = got;
+  } else if (got == 0 || errno == EIO) {
+    result.hangup = true;  // Linux reports a vanished slave as EIO.
+  } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    result.would_block = true;
+  } else {
+    result.error = fail("read");
+  }
+
+  return result;
+}
+
+IoResult PtySession::write(const char *buf, size_t len) {
+  IoResult result = {0, ok(), false, false};
+
+  ssize_t written;
+  do {
+    written = ::write(master_fd_, buf, len);
+  } while (written == -1 && errno == EINTR);
+
+  if (written >= 0) {
+    result.bytes = written;
+    result.would_block = (size_t)written < len;
+  } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    result.would_block = true;
+  } else if (errno == EIO) {
+    result.hangup = true;
+  } else {
+    result.error = fail("write");
+  }
+
+  return result;
+}
+
+Error PtySession::resize(unsigned short rows, unsigned short cols) {
+  struct winsize ws = {rows, cols, 0, 0};
+  if (ioctl(master_fd_, TIOCSWINSZ, &ws) == -1) return fail("TIOCSWINSZ");
+  return ok();
+}
+
+Error PtySession::signal(int sig_no) {
+  if (pid_ <= 0 || reaped_) return Error{ESRCH, "kill"};
+  if (kill(-pid_, sig_no) == -1 && kill(pid_, sig_no) == -1) return fail("kill");
+  return ok();
+}
+
+bool PtySession::try_wait(int *status) {
+  if (!reaped_ && pid_ > 0) {
+    pid_t got = waitpid(pid_, &status_, WNOHANG);
+    reaped_ = got == pid_ || (got == -1 && errno == ECHILD);
+  }
+
+  if (reaped_ && status != nullptr) *status = status_;
+  return reaped_;
+}
+
+void PtySession::close() {
+  if (master_fd_ != -1) {
+    ::close(master_fd_);
+    master_fd_ = -1;
+  }
+
+  // Not blocking on the child here. The pid is kept so try_wait still works after a hangup; a caller that drops the
+  // session before the child is gone should have SIGCHLD ignored so the kernel reaps it.
+  try_wait(nullptr);
+}
+
+ShellPool::ShellPool(const SpawnOptions &options, size_t size) : options_(options), size_(size) {}
+
+Error ShellPool::fill() {
+  while (idle_.size() < size_) {
+    PtySession session;
+    Error err = PtySession::spawn(options_, &session);
+    if (!err.ok()) return err;
+    idle_.push_back(std::move(session));
+  }
+  return ok();
+}
+
+Error ShellPool::take(unsigned short rows, unsigned short cols, PtySession *out) {
+  while (!idle_.empty()) {
+    PtySession session = std::move(idle_.back());
+    idle_.pop_back();
+    if (session.try_wait(nullptr)) continue;
+
+    // The shell redraws its prompt on the SIGWINCH if the size changed.
+    Error err = session.resize(rows, cols);
+    if (!err.ok()) continue;
+
+    *out = std::move(session);
+    return ok();
+  }
+
+  SpawnOptions options = options_;
+  options.winsize.ws_row = rows;
+  options.winsize.ws_col = cols;
+  return PtySession::spawn(options, out);
+}
+
+Error tty_set_raw(int fd, struct termios *prev_termios) {
+  struct termios t;
+
+  if (tcgetattr(fd, &t) == -1) return fail("tcgetattr");
+
+  if (prev_termios != nullptr) {
+    *prev_termios = t;
+  }
+
+  t.c_lflag &= ~(ICANON | ISIG | IEXTEN | ECHO);
+  t.c_iflag &= ~(BRKINT | ICRNL | IGNBRK | IGNCR | INLCR | INPCK | ISTRIP | IXON | PARMRK);
+
+  t.c_oflag &= ~OPOST;
+
+  t.c_cc[VMIN] = 1;
+  t.c_cc[VTIME] = 0;
+
+  if (tcsetattr(fd, TCSAFLUSH, &t) == -1) return fail("tcsetattr");
+
+  return ok();
+}
+
+}  // namespace termy
@@ -0,0 +1,119 @@
+#ifndef TERMY_H_
+#define TERMY_H_
+
+// libtermy: PTY sessions as values. No globals, nothing calls exit(), every failure comes back as an `Error`. The
+// master fd is non-blocking and exposed, so any number of sessions can be driven from the caller's own event loop.
+//
+// Build as a static library:
+//   g++ -std=c++17 -O2 -c termy.cpp expect.cpp && ar rcs libtermy.a termy.o expect.o
+
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <termios.h>
+
+#include <vector>
+
+namespace termy {
+
+struct Error {
+  int code;        // errno value, 0 for success.
+  const char *op;  // Static string naming the step that failed.
+
+  bool ok() const {
+    return code == 0;
+  }
+};
+
+struct IoResult {
+  size_t bytes;
+  Error error;
+  bool would_block;  // Nothing to do right now, wait for the fd. Not an error.
+  bool hangup;       // The slave side is gone: the child and everything it started closed the terminal.
+};
+
+struct SpawnOptions {
+  const char *const *argv;         // nullptr runs $SHELL, or /bin/sh.
+  const char *const *envp;         // nullptr inherits the environment.
+  const char *cwd;                 // nullptr keeps the current directory.
+  const struct termios *termios;   // nullptr keeps the kernel defaults.
+  struct winsize winsize;          // Zero rows or columns leaves it unset.
+};
+
+class PtySession {
+ public:
+  PtySession();
+  ~PtySession();
+
+  PtySession(PtySession &&other) noexcept;
+  PtySession &operator=(PtySession &&other) noexcept;
+  PtySession(const PtySession &) = delete;
+  PtySession &operator=(const PtySession &) = delete;
+
+  // Starts a child on a fresh PTY with posix_spawn, no fork of the calling process. On failure `out` is left empty;
+  // that includes the exec failing in the child.
+  static Error spawn(const SpawnOptions &options, PtySession *out);
+
+  bool valid() const {
+    return master_fd_ != -1;
+  }
+
+  // Non-blocking master fd, register it for EPOLLIN (and EPOLLOUT after a short write).
+  int fd() const {
+    return master_fd_;
+  }
+
+  pid_t pid() const {
+    return pid_;
+  }
+
+  IoResult read(char *buf, size_t len);
+  IoResult write(const char *buf, size_t len);  // May be short, the rest is up to the caller.
+  Error resize(unsigned short rows, unsigned short cols);
+  Error signal(int sig_no);  // To the child's whole process group.
+
+  // Reaps the child without blocking. Returns true once it has exited, with the wait status in `status`.
+  bool try_wait(int *status);
+
+  // Hangs up: closes the master, which sends SIGHUP to the child's session, and reaps it if it is already gone.
+  void close();
+
+ private:
+  int master_fd_;
+  pid_t pid_;
+  bool reaped_;
+  int status_;
+};
+
+// Shells started ahead of time on their own PTYs. Handing one out costs no spawn and no rc file, the prompt is usually
+// already waiting in the master. `options` and everything it points to must outlive the pool.
+class ShellPool {
+ public:
+  ShellPool(const SpawnOptions &options, size_t size);
+
+  ShellPool(const ShellPool &) = delete;
+  ShellPool &operator=(const ShellPool &) = delete;
+
+  // Starts shells until `size` are idle. Call it off the latency-critical path, after `take`.
+  Error fill();
+
+  // An idle shell resized to `rows` x `cols`, or a freshly spawned one when none is left. Shells that exited while
+  // waiting are dropped.
+  Error take(unsigned short rows, unsigned short cols, PtySession *out);
+
+  size_t idle() const {
+    return idle_.size();
+  }
+
+ private:
+  SpawnOptions options_;
+  size_t size_;
+  std::vector<PtySession> idle_;
+};
+
+// Puts `fd` into raw mode, returning the previous settings in `prev_termios` when not null.
+Error tty_set_raw(int fd, struct termios *prev_termios);
+
+}  // namespace termy
+
+#endif  // TERMY_H_
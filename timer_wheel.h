@@ -0,0 +1,196 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+// Hierarchical timer wheel for an event loop with many timers that are mostly re-armed, rarely fired. Time is cut
+// into TIMER_WHEEL_TICK_MS ticks. Level 0 has a slot per tick for the next 64 ticks, each level above has slots 64
+// times as wide. A timer sits in a slot of the lowest level that reaches its expiry, and is moved one level down
+// (cascaded) when the wheel comes round to its slot. Arming, cancelling and firing are O(1): an intrusive list
+// link, no allocation and no heap to sift. Expiry is never early, and late by at most one tick.
+//
+// Each level keeps a bitmap of the slots it has timers in, so `timer_wheel_timeout` can tell the loop how long it
+// may sleep without stepping through empty ticks. A timer beyond the top level is parked in its farthest slot and
+// cascaded again until it is in reach.
+//
+// Not thread safe: the wheel and its timers belong to the loop thread.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TIMER_WHEEL_TICK_MS 10
+#define TIMER_WHEEL_LEVELS 4  // 64^4 ticks, about 46 hours at 10 ms.
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+struct Timer {
+  Timer *next;
+  Timer **pprev;  // nullptr while not armed.
+  uint64_t expires;  // In ticks.
+  uint32_t slot;     // Level * TIMER_WHEEL_SLOTS + slot, while armed.
+  void (*fire)(void *owner);
+  void *owner;
+};
+
+struct TimerWheel {
+  uint64_t origin_ms;
+  uint64_t now;  // The next tick to run.
+  Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  uint64_t occupied[TIMER_WHEEL_LEVELS];
+  size_t armed;
+  size_t fired;
+};
+
+// Milliseconds on the coarse monotonic clock, cheap enough to read on every PTY read.
+static inline uint64_t timer_clock_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline void timer_wheel_init(TimerWheel *w, uint64_t now_ms) {
+  w->origin_ms = now_ms;
+  w->now = 0;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) w->slots[level][slot] = nullptr;
+    w->occupied[level] = 0;
+  }
+  w->armed = 0;
+  w->fired = 0;
+}
+
+static inline void timer_init(Timer *t, void (*fire)(void *owner), void *owner) {
+  t->next = nullptr;
+  t->pprev = nullptr;
+  t->expires = 0;
+  t->slot = 0;
+  t->fire = fire;
+  t->owner = owner;
+}
+
+static inline bool timer_armed(const Timer *t) {
+  return t->pprev != nullptr;
+}
+
+// Expiry in milliseconds on the wheel's clock.
+static inline uint64_t timer_expires_ms(const TimerWheel *w, const Timer *t) {
+  return w->origin_ms + t->expires * TIMER_WHEEL_TICK_MS;
+}
+
+static inline void timer_wheel_link(TimerWheel *w, Timer *t) {
+  uint64_t expires = t->expires < w->now ? w->now : t->expires;
+  uint64_t delta = expires - w->now;
+
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << ((level + 1) * TIMER_WHEEL_BITS)) level++;
+  uint64_t reach = ((uint64_t)1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
+  if (delta > reach) expires = w->now + reach;  // Parked, cascaded again when its slot comes round.
+
+  int slot = (int)(expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+  Timer **head = &w->slots[level][slot];
+  t->next = *head;
+  if (t->next != nullptr) t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+  t->slot = level * TIMER_WHEEL_SLOTS + slot;
+  w->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static inline void timer_wheel_unlink(TimerWheel *w, Timer *t) {
+  *t->pprev = t->next;
+  if (t->next != nullptr) t->next->pprev = t->pprev;
+  t->next = nullptr;
+  t->pprev = nullptr;
+
+  int level = t->slot / TIMER_WHEEL_SLOTS;
+  int slot = t->slot % TIMER_WHEEL_SLOTS;
+  if (w->slots[level][slot] == nullptr) w->occupied[level] &= ~((uint64_t)1 << slot);
+  w->armed--;
+}
+
+static inline void timer_cancel(TimerWheel *w, Timer *t) {
+  if (timer_armed(t)) timer_wheel_unlink(w, t);
+}
+
+// (Re)arms `t` to fire at `expires_ms` on the wheel's clock, or on the next advance if that has passed.
+static inline void timer_arm(TimerWheel *w, Timer *t, uint64_t expires_ms) {
+  timer_cancel(w, t);
+  uint64_t ms = expires_ms > w->origin_ms ? expires_ms - w->origin_ms : 0;
+  t->expires = (ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+  timer_wheel_link(w, t);
+  w->armed++;
+}
+
+// Moves the timers of a slot of `level` down to where they are now in reach.
+static inline void timer_wheel_cascade(TimerWheel *w, int level, int slot) {
+  Timer *t = w->slots[level][slot];
+  w->slots[level][slot] = nullptr;
+  w->occupied[level] &= ~((uint64_t)1 << slot);
+
+  while (t != nullptr) {
+    Timer *next = t->next;
+    t->next = nullptr;
+    t->pprev = nullptr;
+    timer_wheel_link(w, t);
+    t = next;
+  }
+}
+
+// Runs every tick up to `now_ms` and fires what expired. A callback may arm or cancel any timer, itself included.
+static inline void timer_wheel_advance(TimerWheel *w, uint64_t now_ms) {
+  uint64_t target = now_ms > w->origin_ms ? (now_ms - w->origin_ms) / TIMER_WHEEL_TICK_MS : 0;
+
+  while (w->now <= target) {
+    if (w->armed == 0) {  // Nothing to cascade or fire, skip the empty ticks.
+      w->now = target + 1;
+      break;
+    }
+
+    int slot = (int)(w->now & TIMER_WHEEL_MASK);
+    for (int level = 1; level < TIMER_WHEEL_LEVELS && (w->now & (((uint64_t)1 << (level * TIMER_WHEEL_BITS)) - 1)) == 0;
+         level++) {
+      timer_wheel_cascade(w, level, (int)(w->now >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+    }
+    w->now++;
+
+    // Detached first: a callback arming a timer 64 ticks ahead puts it in this same slot.
+    Timer *expired = w->slots[0][slot];
+    w->slots[0][slot] = nullptr;
+    w->occupied[0] &= ~((uint64_t)1 << slot);
+    if (expired != nullptr) expired->pprev = &expired;
+
+    while (expired != nullptr) {
+      Timer *t = expired;
+      timer_wheel_unlink(w, t);
+      w->fired++;
+      t->fire(t->owner);
+    }
+  }
+}
+
+// Milliseconds the loop may sleep before the next advance has something to do, -1 when nothing is armed. For timers
+// above level 0 this is when their slot cascades, the loop wakes then and asks again.
+static inline int timer_wheel_timeout(const TimerWheel *w, uint64_t now_ms) {
+  if (w->armed == 0) return -1;
+
+  uint64_t next = UINT64_MAX;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    uint64_t bits = w->occupied[level];
+    if (bits == 0) continue;
+
+    // The first tick at or after `now` that runs this level's slot, then the first occupied slot from there.
+    int shift = level * TIMER_WHEEL_BITS;
+    uint64_t start = (w->now + ((uint64_t)1 << shift) - 1) >> shift;
+    int rot = (int)(start & TIMER_WHEEL_MASK);
+    uint64_t rotated = rot == 0 ? bits : (bits >> rot) | (bits << (TIMER_WHEEL_SLOTS - rot));
+    uint64_t tick = (start + __builtin_ctzll(rotated)) << shift;
+    if (tick < next) next = tick;
+  }
+
+  uint64_t due_ms = w->origin_ms + next * TIMER_WHEEL_TICK_MS;
+  if (due_ms <= now_ms) return 0;
+  uint64_t wait = due_ms - now_ms;
+  return wait > INT32_MAX ? INT32_MAX : (int)wait;
+}
+
+#endif  // TIMER_WHEEL_H_
@@ -0,0 +1,64 @@
+#ifndef TIMING_H_
+#define TIMING_H_
+
+// Timestamps for recorded output. The relay loop reads the clock once per chunk, never per line or byte, and uses
+// CLOCK_MONOTONIC_COARSE: the kernel's cached tick, read from the vDSO without touching the TSC. Its resolution is
+// one tick (1-4 ms), well below anything a replay or a human reading a log would notice.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+
+#define LINE_STAMP_FMT "[%10.3f] "
+#define LINE_STAMP_MAX 32
+
+struct ChunkClock {
+  struct timespec origin;
+};
+
+static inline void chunk_clock_init(ChunkClock *c) {
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &c->origin);
+}
+
+// Seconds since `chunk_clock_init`.
+static inline double chunk_clock_now(const ChunkClock *c) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (double)(ts.tv_sec - c->origin.tv_sec) + (ts.tv_nsec - c->origin.tv_nsec) / 1e9;
+}
+
+struct LineStamper {
+  bool at_line_start;
+};
+
+static inline void line_stamper_init(LineStamper *s) {
+  s->at_line_start = true;
+}
+
+// Copies `buf` to `out` with a timestamp in front of every line. A line is stamped with the time of the chunk its
+// first byte came in, so a line trickling in over several reads shows when it started.
+static inline void line_stamp(LineStamper *s, const char *buf, size_t len, double now, std::string *out) {
+  char stamp[LINE_STAMP_MAX];
+  int stamp_len = -1;  // Formatted on first use, most chunks of a flood start mid-line.
+
+  out->clear();
+  const char *end = buf + len;
+  while (buf < end) {
+    if (s->at_line_start) {
+      if (stamp_len == -1) stamp_len = snprintf(stamp, sizeof(stamp), LINE_STAMP_FMT, now);
+      out->append(stamp, stamp_len);
+      s->at_line_start = false;
+    }
+
+    const char *newline = (const char *)memchr(buf, '\n', end - buf);
+    const char *line_end = newline != nullptr ? newline + 1 : end;
+    out->append(buf, line_end - buf);
+    buf = line_end;
+    s->at_line_start = newline != nullptr;
+  }
+}
+
+#endif  // TIMING_H_
@@ -2,6 +2,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -9,19 +10,90 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "collapse.h"
+#include "recorder.h"
+#include "redact.h"
+#include "ring.h"
+#include "screen.h"
+#include "snapshot.h"
+#include "spsc.h"
+#include "timing.h"
+
 #define SLAVE_NAME_BUF_SIZE 512
 #define READ_BUF_SIZE 256
 #define DEBUG_BUF_SIZE 1024
+#define RING_CAPACITY (1 << 20)
+#define RING_NAME_FMT "/termy-%d"
+#define SNAPSHOT_NAME_FMT "/termy-screen-%d"
+#define SCRIPT_BASE "output"
+#define CHUNK_QUEUE_SIZE 2048
+#define CHUNK_QUEUE_FULL_SLEEP_NS 50000
+#define PROBE_REPLY_MAX 256
+#define PROBE_TIMEOUT_MS 200
 #define DBG(...) debug(__FILE__, __LINE__, __VA_ARGS__)
 
+#define POLL_STDIN 0
+#define POLL_MASTER 1
+#define POLL_CHILD 2
+#define POLL_REPLIES 3
+#define POLL_FDS 4
+
 using namespace std;
 
+// A chunk of master output, still sitting in the ring. Zero length marks the
+// end of the output.
+struct OutputChunk {
+  const char *data;
+  size_t len;
+  double time;
+};
+
+typedef SpscQueue<OutputChunk, CHUNK_QUEUE_SIZE> ChunkQueue;
+
+// The ring is the buffer pool: queued chunks must not be overwritten before
+// the worker is done with them. The reader can be at most every queued chunk
+// plus the one being filled ahead of the worker.
+static_assert((CHUNK_QUEUE_SIZE + 1) * READ_BUF_SIZE <= RING_CAPACITY,
+              "Chunk queue can outrun the ring.");
+
+// Query replies on their way from the worker to the relay, which owns the
+// writes to the master. At most QUERY_REPLY_BACKLOG bytes wait here.
+struct ReplyBox {
+  mutex lock;
+  string pending;
+  int event_fd;  // Readable while `pending` may have something.
+};
+
+struct OutputSinks {
+  ChunkQueue *queue;
+  Redactor *redactor;
+  Collapser *collapser;
+  Recorder *recorder;
+  Screen *screen;
+  Snapshot *snapshot;
+  ReplyBox *replies;  // Where the screen model's query replies go.
+};
+
 struct termios tty_orig;
 int global_master_pty_fd;
+volatile sig_atomic_t winsize_changed = 0;
+QueryFilter answered_queries;
+
+#ifdef CONF_WITH_LINE_TIMESTAMPS
+LineStamper line_stamper;
+string line_stamped;
+#endif
 
 void debug(const char *file_name, int line_no, const char *msg, ...) {
   int f = open("pty.log", O_CREAT | O_APPEND | O_WRONLY,
@@ -286,6 +358,8 @@ void sig_winch(int sig_no, siginfo_t *info, void *context) {
       perror("Error: failed setting winsize for master pty.\n");
       exit(EXIT_FAILURE);
     }
+
+    winsize_changed = 1;
   }
 }
 
@@ -305,47 +379,283 @@ void setup_signal_handlers() {
   DBG("Signal handlers set.");
 }
 
-void io_proc_handle_stdin_comms(int master_pty_fd) {
-  ssize_t read_len;
-  char read_buf[READ_BUF_SIZE];
+// The screen model follows the stream and the rows each chunk touched are
+// published right after, so the snapshot is never staler than one read.
+void update_screen_snapshot(Screen *screen, Snapshot *snapshot,
+                            const char *buf, ssize_t len) {
+  if (winsize_changed) {
+    winsize_changed = 0;
+
+    struct winsize ws;
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0) {
+      screen_resize(screen, ws.ws_row, ws.ws_col);
+    }
+  }
+
+  screen_feed(screen, buf, len);
+
+  if (screen->any_dirty) {
+    snapshot_publish(snapshot, screen, false);
+  }
+}
+
+// Hands the replies to the queries the screen model answered to the relay.
+// Never waits for the shell: one that stops reading while it keeps asking
+// loses the replies past the backlog, not the worker.
+void post_replies(ReplyBox *box, string *replies) {
+  {
+    lock_guard<mutex> guard(box->lock);
+    if (box->pending.size() + replies->size() <= QUERY_REPLY_BACKLOG) {
+      box->pending.append(*replies);
+    }
+  }
+  replies->clear();
+
+  uint64_t one = 1;
+  if (write(box->event_fd, &one, sizeof(one)) == -1) {
+    // Only fails when the counter is about to overflow, already readable.
+  }
+}
+
+void write_script(Recorder *recorder, const char *buf, size_t len,
+                  double now) {
+#ifdef CONF_WITH_LINE_TIMESTAMPS
+  line_stamp(&line_stamper, buf, len, now, &line_stamped);
+  buf = line_stamped.data();
+  len = line_stamped.size();
+#endif
+
+  if (!recorder_write(recorder, buf, len, now)) {
+    perror("Parent | Error: cannot write script segment.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Everything that needs CPU per byte runs here, off the relay path: the
+// redacted (and maybe collapsed) recording and the screen model behind the
+// snapshot.
+void output_worker(OutputSinks *sinks) {
+  const char *redacted;
+  size_t redacted_len;
+  const char *recorded;
+  size_t recorded_len;
+  double now = 0;
 
   for (;;) {
-    read_len = read(STDIN_FILENO, read_buf, READ_BUF_SIZE);
+    sinks->queue->wait();
+    OutputChunk *chunk = sinks->queue->front();
 
-    if (read_len <= 0) {
+    if (chunk->len == 0) {
+      sinks->queue->pop();
       break;
     }
 
-    if (write(master_pty_fd, read_buf, read_len) != read_len) {
-      printf("Parent | Error: invalid write len to master-pty-fd.\n");
-      exit(EXIT_FAILURE);
+    now = chunk->time;
+    redacted_len = redactor_feed(sinks->redactor, chunk->data, chunk->len,
+                                 &redacted);
+    recorded_len = collapse_feed(sinks->collapser, redacted, redacted_len,
+                                 now, &recorded);
+    write_script(sinks->recorder, recorded, recorded_len, now);
+
+    update_screen_snapshot(sinks->screen, sinks->snapshot, chunk->data,
+                           chunk->len);
+    if (!sinks->screen->replies.empty()) {
+      post_replies(sinks->replies, &sinks->screen->replies);
     }
+
+    sinks->queue->pop();
+  }
+
+  redacted_len = redactor_finish(sinks->redactor, &redacted);
+  recorded_len = collapse_feed(sinks->collapser, redacted, redacted_len, now,
+                               &recorded);
+  write_script(sinks->recorder, recorded, recorded_len, now);
+  recorded_len = collapse_finish(sinks->collapser, &recorded);
+  write_script(sinks->recorder, recorded, recorded_len, now);
+}
+
+void queue_chunk(ChunkQueue *queue, const OutputChunk &chunk) {
+  // Only when the worker is a whole queue behind, never on a keystroke echo.
+  struct timespec pause = {0, CHUNK_QUEUE_FULL_SLEEP_NS};
+  while (!queue->push(chunk)) {
+    nanosleep(&pause, nullptr);
+  }
+}
+
+// Output lands straight in the shared ring and every sink is fed from there.
+// Observers read the ring on their own, they cost nothing here. The relay
+// itself is read, write to stdout and a queue push; the worker thread does
+// the rest. The clock is read once per chunk, every sink shares that
+// timestamp. Queries the screen model answers are cut from what the terminal
+// sees, the worker replies to them instead. Returns what `read()` did: -1
+// with EAGAIN once drained, 0 or EIO once nothing holds the slave open
+// anymore.
+ssize_t relay_master_output(int master_pty_fd, Ring *ring, ChunkQueue *queue,
+                            ChunkClock *clock) {
+  char *read_buf = ring_write_ptr(ring);
+  ssize_t read_len = read(master_pty_fd, read_buf, READ_BUF_SIZE);
+
+  if (read_len <= 0) {
+    return read_len;
+  }
+
+  ring_commit(ring, read_len);
+
+  char out[READ_BUF_SIZE];
+  size_t out_len = query_filter(&answered_queries, read_buf, read_len, out);
+  size_t released_len = answered_queries.released_len;
+  if (write(STDOUT_FILENO, answered_queries.released, released_len) !=
+          (ssize_t)released_len ||
+      write(STDOUT_FILENO, out, out_len) != (ssize_t)out_len) {
+    printf("Parent | Error: invalid write len to stdout.\n");
+    exit(EXIT_FAILURE);
   }
 
-  exit(EXIT_SUCCESS);
+  queue_chunk(queue, {read_buf, (size_t)read_len, chunk_clock_now(clock)});
+  return read_len;
 }
 
-void io_proc_handle_master_pty_comms(int master_pty_fd, int script_fd) {
-  ssize_t read_len;
-  char read_buf[READ_BUF_SIZE];
+// One thread, one poll: keys and query replies go to the shell, output comes
+// back, and the shell's pidfd says when it is over. The master is
+// non-blocking, so the drain after the exit stops at what the shell left
+// behind, even with a background job still holding the slave open. Returns
+// the wait status.
+int io_loop(int master_pty_fd, pid_t child_pid, int child_pidfd, Ring *ring,
+            ChunkQueue *queue, ReplyBox *box) {
+  ChunkClock clock;
+  chunk_clock_init(&clock);
+
+  // Keys not yet taken by the slave. Stdin is not read while there are any.
+  char input[READ_BUF_SIZE];
+  size_t input_len = 0;
+  size_t input_sent = 0;
+  bool stdin_open = true;
+
+  // Replies taken from the box, the next ones are taken once these are out.
+  string replies;
+
+  struct pollfd fds[POLL_FDS];
+  fds[POLL_STDIN].fd = STDIN_FILENO;
+  fds[POLL_MASTER].fd = master_pty_fd;
+  fds[POLL_CHILD].fd = child_pidfd;
+  fds[POLL_CHILD].events = POLLIN;
+  fds[POLL_REPLIES].events = POLLIN;
 
   for (;;) {
-    read_len = read(master_pty_fd, read_buf, READ_BUF_SIZE);
+    bool pending = input_len > 0 || !replies.empty();
+    fds[POLL_STDIN].fd = stdin_open && input_len == 0 ? STDIN_FILENO : -1;
+    fds[POLL_STDIN].events = POLLIN;
+    fds[POLL_MASTER].events = POLLIN | (pending ? POLLOUT : 0);
+    fds[POLL_REPLIES].fd = replies.empty() ? box->event_fd : -1;
+
+    if (poll(fds, POLL_FDS, -1) == -1) {
+      if (errno == EINTR) continue;  // SIGWINCH.
+      perror("Parent | Error: poll failed.\n");
+      exit(EXIT_FAILURE);
+    }
 
-    if (read_len <= 0) {
-      break;
+    if (fds[POLL_STDIN].revents != 0) {
+      ssize_t read_len = read(STDIN_FILENO, input, READ_BUF_SIZE);
+      if (read_len > 0) {
+        input_len = read_len;
+        input_sent = 0;
+      } else if (read_len == 0 || errno != EINTR) {
+        stdin_open = false;
+      }
     }
 
-    if (write(STDOUT_FILENO, read_buf, read_len) != read_len) {
-      printf("Parent | Error: invalid write len to stdout.\n");
-      exit(EXIT_FAILURE);
+    if (fds[POLL_REPLIES].revents & POLLIN) {
+      uint64_t posted;
+      if (read(box->event_fd, &posted, sizeof(posted)) == -1) {
+        // EAGAIN: another wakeup took them already.
+      }
+      lock_guard<mutex> guard(box->lock);
+      replies.swap(box->pending);
     }
 
-    if (write(script_fd, read_buf, read_len) != read_len) {
-      printf("Parent | Error: invalid write len to script file.\n");
-      exit(EXIT_FAILURE);
+    // Ahead of the keys, the shell is waiting for them.
+    if (!replies.empty()) {
+      ssize_t written = write(master_pty_fd, replies.data(), replies.size());
+      if (written > 0) replies.erase(0, written);
+      if (written == -1 && errno == EIO) replies.clear();
+    }
+
+    if (input_len > 0 && replies.empty()) {
+      ssize_t written = write(master_pty_fd, input + input_sent,
+                              input_len - input_sent);
+      if (written > 0) input_sent += written;
+      // EIO: the shell is gone, the pidfd tells shortly.
+      if (input_sent == input_len || (written == -1 && errno == EIO)) {
+        input_len = 0;
+      }
+    }
+
+    if (fds[POLL_MASTER].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t read_len =
+          relay_master_output(master_pty_fd, ring, queue, &clock);
+      if (read_len == 0 ||
+          (read_len == -1 && errno != EAGAIN && errno != EINTR)) {
+        fds[POLL_MASTER].fd = -1;  // Slave closed, the exit is near.
+      }
+    }
+
+    if (fds[POLL_CHILD].revents & POLLIN) {
+      break;
     }
   }
+
+  for (;;) {
+    ssize_t read_len = relay_master_output(master_pty_fd, ring, queue, &clock);
+    if (read_len <= 0 && !(read_len == -1 && errno == EINTR)) {
+      break;
+    }
+  }
+  queue_chunk(queue, {nullptr, 0, chunk_clock_now(&clock)});
+
+  int status = 0;
+  while (waitpid(child_pid, &status, 0) == -1 && errno == EINTR) {
+  }
+  return status;
+}
+
+// Asks the terminal for its default colours once, so the screen model can
+// answer OSC 10/11 from then on. DA1 goes last: every terminal answers it, so
+// one that ignores OSC 10/11 does not cost the whole timeout.
+bool probe_default_colors(Screen *screen) {
+  const char probe[] = "\x1b]10;?\x1b\\\x1b]11;?\x1b\\\x1b[c";
+  if (write(STDOUT_FILENO, probe, sizeof(probe) - 1) != sizeof(probe) - 1) {
+    return false;
+  }
+
+  char reply[PROBE_REPLY_MAX + 1];
+  size_t len = 0;
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  while (len < PROBE_REPLY_MAX && poll(&pfd, 1, PROBE_TIMEOUT_MS) > 0) {
+    ssize_t read_len = read(STDIN_FILENO, reply + len, PROBE_REPLY_MAX - len);
+    if (read_len <= 0) break;
+    len += read_len;
+    reply[len] = '\0';
+
+    const char *da = strstr(reply, "\x1b[?");
+    if (da != nullptr && strchr(da, 'c') != nullptr) break;
+  }
+  reply[len] = '\0';
+
+  // Both or neither: with only one known, the terminal would still have to
+  // see the queries for the other.
+  uint32_t fg_rgb, bg_rgb;
+  const char *fg = strstr(reply, "\x1b]10;");
+  const char *bg = strstr(reply, "\x1b]11;");
+  if (fg == nullptr || !query_parse_color(fg + 5, &fg_rgb) || bg == nullptr ||
+      !query_parse_color(bg + 5, &bg_rgb)) {
+    DBG("Default colors unknown, OSC 10/11 go to the terminal.");
+    return false;
+  }
+
+  screen->default_fg = COLOR_RGB | fg_rgb;
+  screen->default_bg = COLOR_RGB | bg_rgb;
+  DBG("Default colors: fg %06x, bg %06x.", fg_rgb, bg_rgb);
+  return true;
 }
 
 int main(void) {
@@ -385,32 +695,69 @@ int main(void) {
 
   // Parent process.
 
-  int script_fd =
-      open("output", O_WRONLY | O_CREAT | O_TRUNC,
-           S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-  if (script_fd == -1) {
+  RecorderConfig recorder_config;
+  recorder_config_from_env(&recorder_config, SCRIPT_BASE);
+#ifdef CONF_WITH_LINE_TIMESTAMPS
+  // Stamped lines no longer match the terminal stream byte for byte.
+  recorder_config.timing = false;
+  line_stamper_init(&line_stamper);
+#endif
+  Recorder *recorder = recorder_open(&recorder_config);
+  if (recorder == nullptr) {
     perror("Parent | Error: cannot open output file.\n");
     exit(EXIT_FAILURE);
   }
 
-  printf("Parent | Set tty raw.\n");
-  tty_set_raw(STDIN_FILENO, &tty_orig);
+  Redactor redactor;
+  if (!redactor_init(&redactor, READ_BUF_SIZE)) {
+    perror("Parent | Error: cannot set up redaction.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Collapser collapser;
+  collapse_init(&collapser);
+
+  char ring_name[RING_NAME_MAX];
+  snprintf(ring_name, RING_NAME_MAX, RING_NAME_FMT, getpid());
+  Ring *ring = ring_create(ring_name, RING_CAPACITY, READ_BUF_SIZE);
+  if (ring == nullptr) {
+    perror("Parent | Error: cannot create output ring.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("Parent | Output ring: %s.\n", ring_name);
+
+  Screen screen;
+  screen_init(&screen, current_tty_winsize.ws_row, current_tty_winsize.ws_col);
+
+  char snapshot_name[SNAPSHOT_NAME_MAX];
+  snprintf(snapshot_name, SNAPSHOT_NAME_MAX, SNAPSHOT_NAME_FMT, getpid());
+  Snapshot *snapshot = snapshot_create(snapshot_name);
+  if (snapshot == nullptr) {
+    perror("Parent | Error: cannot create screen snapshot.\n");
+    exit(EXIT_FAILURE);
+  }
+  snapshot_publish(snapshot, &screen, true);
 
-  int master_pty_fd_for_child = dup(master_pty_fd);
+  printf("Parent | Screen snapshot: %s.\n", snapshot_name);
 
-  int io_proc_child_pid = fork();
-  if (io_proc_child_pid == -1) {
-    perror("Error: cannot create IO handler fork.\n");
+  int child_pidfd = syscall(SYS_pidfd_open, child_pid, 0);
+  if (child_pidfd == -1) {
+    perror("Parent | Error: cannot open pidfd for the shell.\n");
     exit(EXIT_FAILURE);
   }
 
-  if (io_proc_child_pid == 0) {  // Child.
-    close(master_pty_fd);
-    close(script_fd);
-    io_proc_handle_stdin_comms(master_pty_fd_for_child);
+  if (fcntl(master_pty_fd, F_SETFL, O_NONBLOCK) == -1) {
+    perror("Parent | Error: cannot make master pty non-blocking.\n");
+    exit(EXIT_FAILURE);
   }
 
-  close(master_pty_fd_for_child);
+  printf("Parent | Set tty raw.\n");
+  tty_set_raw(STDIN_FILENO, &tty_orig);
+
+  // From here on the screen model answers terminal queries itself.
+  screen.answer_queries = true;
+  query_filter_init(&answered_queries, probe_default_colors(&screen));
 
   setup_signal_handlers();
 
@@ -419,8 +766,44 @@ int main(void) {
     exit(EXIT_FAILURE);
   }
 
-  // Parent.
-  io_proc_handle_master_pty_comms(master_pty_fd, script_fd);
+  // SIGWINCH stays with this thread, so its reads are the ones restarted.
+  ChunkQueue *queue = new ChunkQueue();
+  ReplyBox *reply_box = new ReplyBox();
+  reply_box->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (reply_box->event_fd == -1) {
+    perror("Parent | Error: cannot create reply eventfd.\n");
+    exit(EXIT_FAILURE);
+  }
+  OutputSinks sinks = {queue,   &redactor, &collapser, recorder,
+                       &screen, snapshot,  reply_box};
 
-  exit(EXIT_SUCCESS);
+  sigset_t winch_mask, prev_mask;
+  sigemptyset(&winch_mask);
+  sigaddset(&winch_mask, SIGWINCH);
+  pthread_sigmask(SIG_BLOCK, &winch_mask, &prev_mask);
+  thread worker(output_worker, &sinks);
+  pthread_sigmask(SIG_SETMASK, &prev_mask, nullptr);
+
+  // Parent.
+  int status =
+      io_loop(master_pty_fd, child_pid, child_pidfd, ring, queue, reply_box);
+  worker.join();
+  delete queue;
+  close(reply_box->event_fd);
+  delete reply_box;
+  close(child_pidfd);
+
+  recorder_close(recorder);
+  ring_close(ring);
+  redactor_free(&redactor);
+  snapshot_close(snapshot);
+
+  tty_reset();
+  if (WIFSIGNALED(status)) {
+    printf("Parent | Shell killed by signal %d.\n", WTERMSIG(status));
+    exit(128 + WTERMSIG(status));
+  }
+
+  printf("Parent | Shell exited with status %d.\n", WEXITSTATUS(status));
+  exit(WEXITSTATUS(status));
 }